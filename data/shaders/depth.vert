@@ -3,6 +3,9 @@ layout(location = ATTR_POSITION) in vec3 position;
 #ifdef USE_ALPHA_TEST
 layout(location = ATTR_TEXCOORD) in vec2 texcoord;
 #endif
+#ifdef USE_TERRAIN_MORPH
+layout(location = ATTR_MORPH) in vec4 morph;
+#endif
 #ifdef USE_SKINNING
 layout(location = ATTR_BONE_INDEX) in vec4 boneIndices;
 layout(location = ATTR_BONE_WEIGHT) in vec4 boneWeights;
@@ -23,12 +26,24 @@ void main()
 {
 	vec4 pos = vec4(position, 1.0);
 #ifdef USE_SKINNING
-	mat3x4 m = boneMatrices[int(boneIndices.x)] * boneWeights.x;
-	m += boneMatrices[int(boneIndices.y)] * boneWeights.y;
-	m += boneMatrices[int(boneIndices.z)] * boneWeights.z;
-	m += boneMatrices[int(boneIndices.w)] * boneWeights.w;
+#ifdef USE_BONE_PALETTE
+	SkinnedInstanceData instance = skinnedInstances[skinnedDraw[gl_InstanceID]];
+#endif
+	mat3x4 m = BONE_MATRIX(boneIndices.x) * boneWeights.x;
+	m += BONE_MATRIX(boneIndices.y) * boneWeights.y;
+	m += BONE_MATRIX(boneIndices.z) * boneWeights.z;
+	m += BONE_MATRIX(boneIndices.w) * boneWeights.w;
 	pos = vec4(pos * m, 1.0);
+#ifdef USE_BONE_PALETTE
+	// Drawn with an identity model matrix, the instance places the model in the world
+	pos = vec4(pos * instance.modelMatrix, 1.0);
+#endif
 #endif // USE_SKINNING
+#ifdef USE_TERRAIN_MORPH
+	// CDLOD: blend towards the coarser level over the end of the LOD range (w)
+	float morphDist = distance(cameraPosition, (modelMatrix * pos).xyz);
+	pos.xyz += morph.xyz * clamp((morphDist / morph.w - TERRAIN_MORPH_START) / (1.0 - TERRAIN_MORPH_START), 0.0, 1.0);
+#endif
 #ifdef USE_DEPTH_CUBE
 	gl_Position = modelMatrix * pos;
 #else
@@ -6,4 +6,5 @@
 #else
 #extension GL_ARB_shading_language_420pack : enable
 #extension GL_ARB_explicit_uniform_location : enable
+#extension GL_ARB_shader_storage_buffer_object : enable
 #endif
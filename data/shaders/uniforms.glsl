@@ -4,7 +4,7 @@
 #define MAX_SHADOW_CUBES 3
 #define MAX_SHADOWS (MAX_SHADOW_MAPS + MAX_SHADOW_CUBES)
 #define MAX_REFLECTIONS 2
-#define MAX_BONES 80
+#define MAX_BONES 80 // Per draw when the bone palette is not supported
 #define PARTICLE_GROUP_SIZE 32
 
 #ifdef __cplusplus
@@ -75,6 +75,13 @@ UBO_PREFIX(UniformSkinningBlock, 6)
 	mat3x4 boneMatrices[MAX_BONES];
 };
 
+// Animated model drawn from the frame's bone palette, matrices are transposed like bones
+struct SkinnedInstanceData {
+	mat3x4 modelMatrix;
+	mat3x4 normalMatrix;
+	uint boneOffset; uint pad1; uint pad2; uint pad3;
+};
+
 UBO_PREFIX(UniformPostProcessBlock, 7)
 	int tonemap; float exposure; float saturation; int postAA;
 	vec3 vignette; float sepia;
@@ -113,6 +120,9 @@ static_assert(BINDING_SCENE_COLOR >= (BINDING_SHADOW_CUBE + MAX_SHADOW_CUBES), "
 #define BINDING_SSBO_VELOCITY 31
 #define BINDING_SSBO_LIFE 32
 #define BINDING_SSBO_EXTRA 33
+#define BINDING_SSBO_BONE_PALETTE 34
+#define BINDING_SSBO_SKINNED_INSTANCES 35
+#define BINDING_SSBO_SKINNED_DRAW 36
 
 #ifndef __cplusplus
 
@@ -137,6 +147,10 @@ static_assert(BINDING_SCENE_COLOR >= (BINDING_SHADOW_CUBE + MAX_SHADOW_CUBES), "
 #define ATTR_COLOR 4
 #define ATTR_BONE_INDEX 5
 #define ATTR_BONE_WEIGHT 6
+#define ATTR_MORPH 7
+
+// Fraction of the LOD range after which terrain starts morphing to the next level
+#define TERRAIN_MORPH_START 0.7
 
 #ifdef USE_SHADOW_MAP
 #define SHADOW_VARYINGS vec4 shadowcoords[MAX_SHADOW_MAPS]; vec3 worldPosition;
@@ -170,6 +184,23 @@ static_assert(BINDING_SCENE_COLOR >= (BINDING_SHADOW_CUBE + MAX_SHADOW_CUBES), "
 #define USE_SKINNING
 #endif
 
+#if defined(USE_SKINNING) && defined(USE_BONE_PALETTE)
+// Bones of every animated model in the frame
+layout(binding = BINDING_SSBO_BONE_PALETTE, std430) readonly buffer BonePalette {
+	mat3x4 bonePalette[];
+};
+layout(binding = BINDING_SSBO_SKINNED_INSTANCES, std430) readonly buffer SkinnedInstances {
+	SkinnedInstanceData skinnedInstances[];
+};
+// Instances of the current draw call, indexed by gl_InstanceID
+layout(binding = BINDING_SSBO_SKINNED_DRAW, std430) readonly buffer SkinnedDraw {
+	uint skinnedDraw[];
+};
+#define BONE_MATRIX(i) bonePalette[instance.boneOffset + uint(i)]
+#else
+#define BONE_MATRIX(i) boneMatrices[int(i)]
+#endif
+
 #ifdef USE_DIFFUSE_MAP
 layout(binding = BINDING_DIFFUSE_MAP) uniform sampler2D diffuseMap;
 #endif
@@ -1,6 +1,17 @@
 #include "animation.hpp"
 #include "components.hpp"
 #include "geometry.hpp"
+#include "engine.hpp"
+#include <algorithm>
+
+static CVar<int> cvar_skeletonsPerTask("anim.skeletonsPerTask", 16);
+static CVar<float> cvar_compressionError("anim.compressionError", 0.0005f); // Negative plays uncompressed clips
+static CVar<int> cvar_lod("anim.lod", 1);
+static CVar<float> cvar_lodFullRateSize("anim.lodFullRateSize", 0.2f); // Smaller characters are updated less often
+static CVar<int> cvar_lodMaxInterval("anim.lodMaxInterval", 8); // Frames
+static CVar<int> cvar_lodOffscreenInterval("anim.lodOffscreenInterval", 0); // 0 only advances the clock
+static CVar<float> cvar_lodReducedSize("anim.lodReducedSize", 0.05f); // Below this only animate bones up to lodReducedDepth
+static CVar<int> cvar_lodReducedDepth("anim.lodReducedDepth", 4);
 
 using namespace ecs;
 
@@ -20,86 +31,209 @@ void AnimationSystem::reset()
 template<typename T> inline T interp(T a, T b, float alpha) { return glm::mix(a, b, alpha); }
 template<> inline quat interp(quat a, quat b, float alpha) { return glm::slerp(a, b, alpha); }
 
-template<typename T>
-static inline void lerpPropertyTrack(PropertyAnimation::Track<T>& track, float time) {
-	const auto& keyframes = track.keyframes;
-	if (keyframes.empty())
-		return;
-	if (time <= keyframes[0].time) {
-		track.currentValue =  keyframes[0].value;
-		return;
+namespace {
+	// Fields that property animation tracks can drive, looked up by track id
+	template<typename T>
+	struct PropertyTarget {
+		uint id;
+		T Transform::* transform;
+		T Light::* light;
+	};
+
+	const PropertyTarget<float> s_floatTargets[] = {
+		{ $id(intensity), nullptr, &Light::intensity },
+		{ $id(distance), nullptr, &Light::distance },
+	};
+	const PropertyTarget<vec3> s_vec3Targets[] = {
+		{ $id(position), &Transform::position, nullptr },
+		{ $id(scale), &Transform::scale, nullptr },
+		{ $id(color), nullptr, &Light::color },
+	};
+	const PropertyTarget<quat> s_quatTargets[] = {
+		{ $id(rotation), &Transform::rotation, nullptr },
+	};
+
+	// Components of one entity, looked up only once a track needs them
+	struct PropertyTargetComponents {
+		Entity entity;
+		Transform* transform = nullptr;
+		Light* light = nullptr;
+		bool fetched = false;
+
+		void fetch() {
+			if (fetched)
+				return;
+			fetched = true;
+			if (entity.has<Transform>())
+				transform = &entity.get<Transform>();
+			if (entity.has<Light>())
+				light = &entity.get<Light>();
+		}
+	};
+
+	// Keyframe index i such that times[i] <= time < times[i + 1]. Normal playback
+	// stays on the cached key or moves to the next one, anything else is a seek.
+	uint findKeyframe(const std::vector<float>& times, uint cursor, float time) {
+		const uint last = times.size() - 1;
+		if (cursor < last && times[cursor] <= time) {
+			if (time < times[cursor + 1])
+				return cursor;
+			if (cursor + 1 < last && time < times[cursor + 2])
+				return cursor + 1;
+		}
+		return std::upper_bound(times.begin(), times.end(), time) - times.begin() - 1;
+	}
+
+	template<typename T>
+	void samplePropertyTrack(PropertyAnimation::Track<T>& track, float time) {
+		const auto& times = track.times;
+		if (times.empty())
+			return;
+		const uint lastIndex = times.size() - 1;
+		if (time <= times[0]) {
+			track.cursor = 0;
+			track.currentValue = track.values[0];
+			return;
+		}
+		if (time >= times[lastIndex]) {
+			track.cursor = lastIndex;
+			track.currentValue = track.values[lastIndex];
+			return;
+		}
+		uint i = track.cursor = findKeyframe(times, track.cursor, time);
+		float alpha = (time - times[i]) / (times[i + 1] - times[i]);
+		track.currentValue = interp(track.values[i], track.values[i + 1], alpha);
+	}
+
+	template<typename T, size_t N>
+	uint evaluatePropertyTracks(std::vector<PropertyAnimation::Track<T>>& tracks, const PropertyTarget<T> (&targets)[N],
+		float time, PropertyTargetComponents& components)
+	{
+		for (auto& track : tracks) {
+			samplePropertyTrack(track, time);
+			if (track.target == -1) {
+				track.target = -2; // Nothing to drive
+				for (uint i = 0; i < N; ++i)
+					if (targets[i].id == track.id)
+						track.target = i;
+			}
+			if (track.target < 0)
+				continue;
+			const PropertyTarget<T>& target = targets[track.target];
+			components.fetch();
+			if (target.transform && components.transform) {
+				components.transform->*target.transform = track.currentValue;
+				components.transform->dirty = true;
+			} else if (target.light && components.light) {
+				components.light->*target.light = track.currentValue;
+			}
+		}
+		return tracks.size();
+	}
+
+	float calculateAnimLength(const PropertyAnimation& anim) {
+		float length = 0.f;
+		for (auto& track : anim.floatTracks)
+			length = glm::max(track.length(), length);
+		for (auto& track : anim.vec3Tracks)
+			length = glm::max(track.length(), length);
+		for (auto& track : anim.quatTracks)
+			length = glm::max(track.length(), length);
+		return length;
 	}
-	const uint lastIndex = keyframes.size() - 1;
-	if (time >= keyframes[lastIndex].time) {
-		track.currentValue = keyframes[lastIndex].value;
-		return;
+}
+
+void AnimationSystem::prepare(BoneAnimation& anim, Geometry& geom, SkeletonJob& job)
+{
+	ASSERT(anim.bones.size() == geom.bones.size());
+	const Geometry::Animation& a = geom.animations[anim.animation];
+	job.anim = &anim;
+	job.geometry = &geom;
+	job.stride = (geom.bones.size() + 3) & ~3u;
+	job.frameA = (int)std::floor(anim.time) % a.length;
+	job.frameB = (job.frameA + 1) % a.length;
+	job.alpha = glm::fract(anim.time);
+	job.maxDepth = 255;
+	if (cvar_compressionError() >= 0.f) {
+		job.clip = &geom.compressedAnimation(anim.animation, cvar_compressionError());
+		job.poses = nullptr;
+		anim.cursors.resize(job.clip->tracks.size());
+	} else {
+		job.clip = nullptr;
+		job.poses = &geom.animationPoses(anim.animation);
 	}
-	uint i = 0;
-	while (i < lastIndex && keyframes[i + 1].time < time) ++i;
-	const auto& frame1 = keyframes[i];
-	const auto& frame2 = keyframes[i + 1];
-	float alpha = (time - frame1.time) / (frame2.time - frame1.time);
-	track.currentValue = interp(frame1.value, frame2.value, alpha);
 }
 
-static inline float calculateAnimLength(const PropertyAnimation anim) {
-	float length = 0.f;
-	for (auto& track : anim.floatTracks)
-		length = glm::max(track.length(), length);
-	for (auto& track : anim.vec3Tracks)
-		length = glm::max(track.length(), length);
-	for (auto& track : anim.quatTracks)
-		length = glm::max(track.length(), length);
-	return length;
+void AnimationSystem::evaluate(const SkeletonJob& job)
+{
+	thread_local std::vector<mat3x4> pose;
+	thread_local std::vector<float> channels;
+	const Geometry& geom = *job.geometry;
+	pose.resize(job.stride);
+	if (job.clip) {
+		channels.resize(job.stride * kernels::AnimationPoses::NUM_CHANNELS);
+		kernels::sampleAnimation(*job.clip, job.frameA + job.alpha, job.anim->cursors.data(), channels.data(), job.stride,
+			geom.boneDepths().data(), job.maxDepth);
+		kernels::composePoses(channels.data(), job.stride, pose.data());
+	} else {
+		kernels::blendPoses(*job.poses, job.frameA, job.frameB, job.alpha, pose.data());
+	}
+	kernels::concatenateBones(pose.data(), geom.boneParents.data(), geom.inverseBindPose().data(),
+		geom.bones.size(), job.anim->bones.data(), geom.boneDepths().data(), job.maxDepth);
 }
 
 void AnimationSystem::update(Entities& entities, float dt)
 {
-	entities.for_each<BoneAnimation, Model>([dt](Entity, BoneAnimation& anim, Model& model) {
+	START_MEASURE(skinningTimeMs);
+	// Advance time and prepare pose data serially, evaluate skeletons in parallel
+	m_jobs.clear();
+	stats = Stats();
+	++m_frame;
+	entities.for_each<BoneAnimation, Model>([this, dt](Entity e, BoneAnimation& anim, Model& model) {
 		if (anim.state != AnimationState::PLAYING)
 			return;
 		Geometry& geom = *model.lods[0].geometry;
-		Geometry::Animation a = geom.animations[anim.animation];
-		anim.time += dt * anim.speed * a.frameRate;
-		float alpha = glm::fract(anim.time);
-		uint frameA = (int)std::floor(anim.time) % a.length;
-		uint frameB = (frameA + 1) % a.length;
-		mat3x4* matA = &geom.animFrames[frameA * geom.bones.size()];
-		mat3x4* matB = &geom.animFrames[frameB * geom.bones.size()];
-		ASSERT(anim.bones.size() == geom.bones.size());
-		for (uint i = 0; i < anim.bones.size(); ++i) {
-			mat3x4 mat = matA[i] * (1.f - alpha) + matB[i] * alpha;
-			int parent = geom.boneParents[i];
-			ASSERT(parent < (int)i);
-			if (parent >= 0) anim.bones[i] = multiplyBones(anim.bones[parent], mat);
-			else anim.bones[i] = mat;
+		anim.time += dt * anim.speed * geom.animations[anim.animation].frameRate;
+		// Significance: the clock always runs, but hidden and small characters are evaluated less often
+		uint interval = 1;
+		uint maxDepth = 255;
+		if (cvar_lod()) {
+			if (!anim.visible)
+				interval = glm::max(cvar_lodOffscreenInterval(), 0);
+			else if (anim.screenSize < cvar_lodFullRateSize())
+				interval = glm::clamp((int)(cvar_lodFullRateSize() / glm::max(anim.screenSize, 0.001f)), 1, glm::max(cvar_lodMaxInterval(), 1));
+			if (anim.screenSize < cvar_lodReducedSize())
+				maxDepth = glm::clamp(cvar_lodReducedDepth(), 0, 255);
+		}
+		// Spread throttled characters evenly across frames
+		if (interval == 0 || (m_frame + e.get_index()) % interval) {
+			if (anim.visible) stats.throttled++;
+			else stats.offscreen++;
+			return;
 		}
+		m_jobs.emplace_back();
+		prepare(anim, geom, m_jobs.back());
+		m_jobs.back().maxDepth = maxDepth;
+	});
+	Engine::threadpool().parallel_for(m_jobs.size(), cvar_skeletonsPerTask(), [this](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i)
+			evaluate(m_jobs[i]);
 	});
-	entities.for_each<PropertyAnimation>([this, dt](Entity e, PropertyAnimation& anim) {
+	END_MEASURE(skinningTimeMs);
+	stats.skeletons = m_jobs.size();
+	stats.skeletonMs = skinningTimeMs;
+
+	START_MEASURE(propertyTimeMs);
+	uint propertyTracks = 0;
+	entities.for_each<PropertyAnimation>([&](Entity e, PropertyAnimation& anim) {
 		if (anim.state != AnimationState::PLAYING)
 			return;
 		anim.time += dt * anim.speed;
-		for (auto& track : anim.floatTracks) {
-			lerpPropertyTrack(track, anim.time);
-		}
-		for (auto& track : anim.vec3Tracks) {
-			lerpPropertyTrack(track, anim.time);
-			if (track.id == $id(position)) {
-				if (e.has<Transform>())
-					e.get<Transform>().setPosition(track.currentValue);
-			}
-			else if (track.id == $id(scale)) {
-				if (e.has<Transform>())
-					e.get<Transform>().setScale(track.currentValue);
-			}
-		}
-		for (auto& track : anim.quatTracks) {
-			lerpPropertyTrack(track, anim.time);
-			if (track.id == $id(rotation)) {
-				if (e.has<Transform>())
-					e.get<Transform>().setRotation(track.currentValue);
-			}
-		}
+		PropertyTargetComponents components;
+		components.entity = e;
+		propertyTracks += evaluatePropertyTracks(anim.floatTracks, s_floatTargets, anim.time, components);
+		propertyTracks += evaluatePropertyTracks(anim.vec3Tracks, s_vec3Targets, anim.time, components);
+		propertyTracks += evaluatePropertyTracks(anim.quatTracks, s_quatTargets, anim.time, components);
 		if (anim.length <= 0.f)
 			anim.length = calculateAnimLength(anim);
 		bool atEnd = anim.time >= anim.length;
@@ -111,6 +245,9 @@ void AnimationSystem::update(Entities& entities, float dt)
 			}
 		}
 	});
+	END_MEASURE(propertyTimeMs);
+	stats.propertyTracks = propertyTracks;
+	stats.propertyMs = propertyTimeMs;
 }
 
 void AnimationSystem::play(Entity e)
@@ -121,9 +258,11 @@ void AnimationSystem::play(Entity e)
 			anim.state = AnimationState::PLAYING;
 		} else {
 			Geometry& geom = *e.get<Model>().lods[0].geometry;
-			Geometry::Animation a = geom.animations[anim.animation];
 			anim.state = AnimationState::PLAYING;
-			anim.bones.assign(&geom.animFrames[a.start * geom.bones.size()], &geom.animFrames[a.start * geom.bones.size() + geom.bones.size()]);
+			anim.bones.resize(geom.bones.size());
+			SkeletonJob job;
+			prepare(anim, geom, job);
+			evaluate(job);
 		}
 	}
 	if (e.has<PropertyAnimation>()) {
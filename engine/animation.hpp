@@ -2,6 +2,10 @@
 #include "common.hpp"
 #include <ecs/ecs.hpp>
 
+struct Geometry;
+struct BoneAnimation;
+namespace kernels { struct AnimationPoses; struct CompressedAnimation; }
+
 class AnimationSystem : public ecs::System
 {
 public:
@@ -13,4 +17,29 @@ public:
 	void play(ecs::Entity entity);
 	void pause(ecs::Entity entity);
 	void stop(ecs::Entity entity);
+
+	struct Stats {
+		uint skeletons = 0; // Evaluated this frame
+		uint throttled = 0; // Visible but skipped this frame due to small size
+		uint offscreen = 0;
+		float skeletonMs = 0.f;
+		uint propertyTracks = 0; // Property animation tracks evaluated this frame
+		float propertyMs = 0.f;
+	} stats;
+
+private:
+	struct SkeletonJob {
+		BoneAnimation* anim;
+		const Geometry* geometry;
+		const kernels::AnimationPoses* poses; // Dense clip
+		const kernels::CompressedAnimation* clip; // Compressed clip, used instead if set
+		uint stride;
+		uint frameA, frameB;
+		float alpha;
+		uint maxDepth; // Bone LOD
+	};
+	static void prepare(BoneAnimation& anim, Geometry& geom, SkeletonJob& job);
+	static void evaluate(const SkeletonJob& job);
+	std::vector<SkeletonJob> m_jobs;
+	uint m_frame = 0;
 };
@@ -0,0 +1,441 @@
+#include "animationkernels.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE_KERNELS 1
+#include <emmintrin.h>
+#endif
+
+namespace kernels {
+
+namespace {
+	// Inverse of an affine bone matrix (rows of rotation/scale with translation in w)
+	mat3x4 invertBone(const mat3x4& m) {
+		mat3 inv = glm::inverse(mat3(vec3(m[0]), vec3(m[1]), vec3(m[2])));
+		vec3 trans(m[0].w, m[1].w, m[2].w);
+		return mat3x4(vec4(inv[0], -glm::dot(inv[0], trans)),
+			vec4(inv[1], -glm::dot(inv[1], trans)),
+			vec4(inv[2], -glm::dot(inv[2], trans)));
+	}
+
+	// Same as multiplyBones() in geometry.hpp
+	inline mat3x4 concatenate(const mat3x4& lhs, const mat3x4& rhs) {
+		return mat3x4(
+			vec4(rhs[0] * lhs[0].x + rhs[1] * lhs[0].y + rhs[2] * lhs[0].z + vec4(0, 0, 0, lhs[0].w)),
+			vec4(rhs[0] * lhs[1].x + rhs[1] * lhs[1].y + rhs[2] * lhs[1].z + vec4(0, 0, 0, lhs[1].w)),
+			vec4(rhs[0] * lhs[2].x + rhs[1] * lhs[2].y + rhs[2] * lhs[2].z + vec4(0, 0, 0, lhs[2].w)));
+	}
+
+#ifndef USE_SSE_KERNELS
+	inline mat3x4 composeBone(vec3 t, quat r, vec3 s) {
+		float x = r.x, y = r.y, z = r.z, w = r.w,
+			tx = 2*x, ty = 2*y, tz = 2*z,
+			txx = tx*x, tyy = ty*y, tzz = tz*z,
+			txy = tx*y, txz = tx*z, tyz = ty*z,
+			twx = w*tx, twy = w*ty, twz = w*tz;
+		vec3 a = vec3(1 - (tyy + tzz), txy - twz, txz + twy);
+		vec3 b = vec3(txy + twz, 1 - (txx + tzz), tyz - twx);
+		vec3 c = vec3(txz - twy, tyz + twx, 1 - (txx + tyy));
+		return mat3x4(vec4(a * s, t.x), vec4(b * s, t.y), vec4(c * s, t.z));
+	}
+#else
+	inline __m128 lerp4(__m128 a, __m128 b, __m128 alpha) {
+		return _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), alpha));
+	}
+
+	// Writes four matrices given as 12 element lanes (row by row, w last)
+	inline void storeBones4(mat3x4* out, __m128 e[12]) {
+		for (int row = 0; row < 3; ++row) {
+			__m128 c0 = e[row * 4], c1 = e[row * 4 + 1], c2 = e[row * 4 + 2], c3 = e[row * 4 + 3];
+			_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+			_mm_storeu_ps(&out[0][row].x, c0);
+			_mm_storeu_ps(&out[1][row].x, c1);
+			_mm_storeu_ps(&out[2][row].x, c2);
+			_mm_storeu_ps(&out[3][row].x, c3);
+		}
+	}
+
+	// Normalizes the rotations and expands four TRS poses to matrices,
+	// same expansion as composeBone() in the scalar path
+	inline void composeBones4(__m128 tx, __m128 ty, __m128 tz, __m128 qx, __m128 qy, __m128 qz, __m128 qw,
+		__m128 sx, __m128 sy, __m128 sz, mat3x4* out)
+	{
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 two = _mm_set1_ps(2.f);
+		__m128 lenSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qx, qx), _mm_mul_ps(qy, qy)),
+			_mm_add_ps(_mm_mul_ps(qz, qz), _mm_mul_ps(qw, qw)));
+		__m128 invLen = _mm_div_ps(one, _mm_sqrt_ps(lenSq));
+		qx = _mm_mul_ps(qx, invLen); qy = _mm_mul_ps(qy, invLen);
+		qz = _mm_mul_ps(qz, invLen); qw = _mm_mul_ps(qw, invLen);
+		__m128 x2 = _mm_mul_ps(two, qx), y2 = _mm_mul_ps(two, qy), z2 = _mm_mul_ps(two, qz);
+		__m128 xx = _mm_mul_ps(x2, qx), yy = _mm_mul_ps(y2, qy), zz = _mm_mul_ps(z2, qz);
+		__m128 xy = _mm_mul_ps(x2, qy), xz = _mm_mul_ps(x2, qz), yz = _mm_mul_ps(y2, qz);
+		__m128 wx = _mm_mul_ps(qw, x2), wy = _mm_mul_ps(qw, y2), wz = _mm_mul_ps(qw, z2);
+		__m128 e[12] = {
+			_mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx), _mm_mul_ps(_mm_sub_ps(xy, wz), sy), _mm_mul_ps(_mm_add_ps(xz, wy), sz), tx,
+			_mm_mul_ps(_mm_add_ps(xy, wz), sx), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy), _mm_mul_ps(_mm_sub_ps(yz, wx), sz), ty,
+			_mm_mul_ps(_mm_sub_ps(xz, wy), sx), _mm_mul_ps(_mm_add_ps(yz, wx), sy), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz), tz
+		};
+		storeBones4(out, e);
+	}
+
+	inline void concatenate4(const mat3x4& lhs, const mat3x4& rhs, mat3x4& out) {
+		__m128 r0 = _mm_loadu_ps(&rhs[0].x);
+		__m128 r1 = _mm_loadu_ps(&rhs[1].x);
+		__m128 r2 = _mm_loadu_ps(&rhs[2].x);
+		for (int row = 0; row < 3; ++row) {
+			const vec4& l = lhs[row];
+			__m128 res = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(l.x)), _mm_mul_ps(r1, _mm_set1_ps(l.y))),
+				_mm_add_ps(_mm_mul_ps(r2, _mm_set1_ps(l.z)), _mm_set_ps(l.w, 0.f, 0.f, 0.f)));
+			_mm_storeu_ps(&out[row].x, res);
+		}
+	}
+#endif
+}
+
+void AnimationPoses::resize(uint bones, uint frames)
+{
+	numBones = bones;
+	stride = (bones + 3) & ~3u;
+	numFrames = frames;
+	data.assign(stride * NUM_CHANNELS * frames, 0.f);
+	for (uint f = 0; f < frames; ++f) {
+		float* channels = frame(f);
+		for (uint i = bones; i < stride; ++i) {
+			channels[RW * stride + i] = 1.f;
+			channels[SX * stride + i] = 1.f;
+			channels[SY * stride + i] = 1.f;
+			channels[SZ * stride + i] = 1.f;
+		}
+	}
+}
+
+void decomposeAnimation(const mat3x4* frames, uint numFrames, const mat3x4* bindPose,
+	const int* parents, uint numBones, AnimationPoses& out)
+{
+	std::vector<mat3x4> inverseParents(numBones);
+	for (uint i = 0; i < numBones; ++i)
+		if (parents[i] >= 0)
+			inverseParents[i] = invertBone(bindPose[parents[i]]);
+	out.resize(numBones, numFrames);
+	const uint stride = out.stride;
+	for (uint f = 0; f < numFrames; ++f) {
+		float* channels = out.frame(f);
+		for (uint i = 0; i < numBones; ++i) {
+			mat3x4 local = concatenate(frames[f * numBones + i], bindPose[i]);
+			if (parents[i] >= 0)
+				local = concatenate(inverseParents[i], local);
+			mat3 basis(vec3(local[0].x, local[1].x, local[2].x),
+				vec3(local[0].y, local[1].y, local[2].y),
+				vec3(local[0].z, local[1].z, local[2].z));
+			vec3 scale(glm::length(basis[0]), glm::length(basis[1]), glm::length(basis[2]));
+			if (glm::determinant(basis) < 0.f)
+				scale.x = -scale.x;
+			for (int c = 0; c < 3; ++c)
+				basis[c] /= scale[c] != 0.f ? scale[c] : 1.f;
+			quat rot = glm::normalize(glm::quat_cast(basis));
+			channels[AnimationPoses::TX * stride + i] = local[0].w;
+			channels[AnimationPoses::TY * stride + i] = local[1].w;
+			channels[AnimationPoses::TZ * stride + i] = local[2].w;
+			channels[AnimationPoses::RX * stride + i] = rot.x;
+			channels[AnimationPoses::RY * stride + i] = rot.y;
+			channels[AnimationPoses::RZ * stride + i] = rot.z;
+			channels[AnimationPoses::RW * stride + i] = rot.w;
+			channels[AnimationPoses::SX * stride + i] = scale.x;
+			channels[AnimationPoses::SY * stride + i] = scale.y;
+			channels[AnimationPoses::SZ * stride + i] = scale.z;
+		}
+	}
+}
+
+void blendPoses(const AnimationPoses& poses, uint frameA, uint frameB, float alpha, mat3x4* local)
+{
+	const uint stride = poses.stride;
+	const float* a = poses.frame(frameA);
+	const float* b = poses.frame(frameB);
+#ifdef USE_SSE_KERNELS
+	const __m128 alpha4 = _mm_set1_ps(alpha);
+	const __m128 signBit = _mm_set1_ps(-0.f);
+	for (uint i = 0; i < stride; i += 4) {
+		__m128 ca[AnimationPoses::NUM_CHANNELS], cb[AnimationPoses::NUM_CHANNELS];
+		for (int c = 0; c < AnimationPoses::NUM_CHANNELS; ++c) {
+			ca[c] = _mm_loadu_ps(&a[c * stride + i]);
+			cb[c] = _mm_loadu_ps(&b[c * stride + i]);
+		}
+		__m128 tx = lerp4(ca[AnimationPoses::TX], cb[AnimationPoses::TX], alpha4);
+		__m128 ty = lerp4(ca[AnimationPoses::TY], cb[AnimationPoses::TY], alpha4);
+		__m128 tz = lerp4(ca[AnimationPoses::TZ], cb[AnimationPoses::TZ], alpha4);
+		__m128 sx = lerp4(ca[AnimationPoses::SX], cb[AnimationPoses::SX], alpha4);
+		__m128 sy = lerp4(ca[AnimationPoses::SY], cb[AnimationPoses::SY], alpha4);
+		__m128 sz = lerp4(ca[AnimationPoses::SZ], cb[AnimationPoses::SZ], alpha4);
+		// Nlerp along the shorter arc: flip b where the quaternions point away from each other
+		__m128 dot = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(ca[AnimationPoses::RX], cb[AnimationPoses::RX]), _mm_mul_ps(ca[AnimationPoses::RY], cb[AnimationPoses::RY])),
+			_mm_add_ps(_mm_mul_ps(ca[AnimationPoses::RZ], cb[AnimationPoses::RZ]), _mm_mul_ps(ca[AnimationPoses::RW], cb[AnimationPoses::RW])));
+		__m128 flip = _mm_and_ps(_mm_cmplt_ps(dot, _mm_setzero_ps()), signBit);
+		__m128 qx = lerp4(ca[AnimationPoses::RX], _mm_xor_ps(cb[AnimationPoses::RX], flip), alpha4);
+		__m128 qy = lerp4(ca[AnimationPoses::RY], _mm_xor_ps(cb[AnimationPoses::RY], flip), alpha4);
+		__m128 qz = lerp4(ca[AnimationPoses::RZ], _mm_xor_ps(cb[AnimationPoses::RZ], flip), alpha4);
+		__m128 qw = lerp4(ca[AnimationPoses::RW], _mm_xor_ps(cb[AnimationPoses::RW], flip), alpha4);
+		composeBones4(tx, ty, tz, qx, qy, qz, qw, sx, sy, sz, &local[i]);
+	}
+#else
+	for (uint i = 0; i < stride; ++i) {
+		auto channel = [&](const float* frame, int c) { return frame[c * stride + i]; };
+		vec3 t = glm::mix(vec3(channel(a, AnimationPoses::TX), channel(a, AnimationPoses::TY), channel(a, AnimationPoses::TZ)),
+			vec3(channel(b, AnimationPoses::TX), channel(b, AnimationPoses::TY), channel(b, AnimationPoses::TZ)), alpha);
+		vec3 s = glm::mix(vec3(channel(a, AnimationPoses::SX), channel(a, AnimationPoses::SY), channel(a, AnimationPoses::SZ)),
+			vec3(channel(b, AnimationPoses::SX), channel(b, AnimationPoses::SY), channel(b, AnimationPoses::SZ)), alpha);
+		quat ra(channel(a, AnimationPoses::RW), channel(a, AnimationPoses::RX), channel(a, AnimationPoses::RY), channel(a, AnimationPoses::RZ));
+		quat rb(channel(b, AnimationPoses::RW), channel(b, AnimationPoses::RX), channel(b, AnimationPoses::RY), channel(b, AnimationPoses::RZ));
+		if (glm::dot(ra, rb) < 0.f)
+			rb = -rb;
+		quat r = glm::normalize(ra * (1.f - alpha) + rb * alpha);
+		local[i] = composeBone(t, r, s);
+	}
+#endif
+}
+
+void composePoses(const float* channels, uint stride, mat3x4* local)
+{
+#ifdef USE_SSE_KERNELS
+	for (uint i = 0; i < stride; i += 4) {
+		__m128 c[AnimationPoses::NUM_CHANNELS];
+		for (int j = 0; j < AnimationPoses::NUM_CHANNELS; ++j)
+			c[j] = _mm_loadu_ps(&channels[j * stride + i]);
+		composeBones4(c[AnimationPoses::TX], c[AnimationPoses::TY], c[AnimationPoses::TZ],
+			c[AnimationPoses::RX], c[AnimationPoses::RY], c[AnimationPoses::RZ], c[AnimationPoses::RW],
+			c[AnimationPoses::SX], c[AnimationPoses::SY], c[AnimationPoses::SZ], &local[i]);
+	}
+#else
+	for (uint i = 0; i < stride; ++i) {
+		auto channel = [&](int c) { return channels[c * stride + i]; };
+		vec3 t(channel(AnimationPoses::TX), channel(AnimationPoses::TY), channel(AnimationPoses::TZ));
+		quat r(channel(AnimationPoses::RW), channel(AnimationPoses::RX), channel(AnimationPoses::RY), channel(AnimationPoses::RZ));
+		vec3 s(channel(AnimationPoses::SX), channel(AnimationPoses::SY), channel(AnimationPoses::SZ));
+		local[i] = composeBone(t, glm::normalize(r), s);
+	}
+#endif
+}
+
+void concatenateBones(mat3x4* pose, const int* parents, const mat3x4* inverseBindPose,
+	uint numBones, mat3x4* out, const uint8* depths, uint maxDepth)
+{
+	for (uint i = 0; i < numBones; ++i) {
+		int parent = parents[i];
+		ASSERT(parent < (int)i);
+		if (depths && depths[i] > maxDepth) {
+			// In bind pose relative to the parent, the skinning matrix is the parent's
+			out[i] = out[parent];
+			continue;
+		}
+#ifdef USE_SSE_KERNELS
+		if (parent >= 0)
+			concatenate4(pose[parent], pose[i], pose[i]);
+		concatenate4(pose[i], inverseBindPose[i], out[i]);
+#else
+		if (parent >= 0)
+			pose[i] = concatenate(pose[parent], pose[i]);
+		out[i] = concatenate(pose[i], inverseBindPose[i]);
+#endif
+	}
+}
+
+namespace {
+	const float SMALLEST_THREE_RANGE = 0.70710678f; // Components other than the largest are within +-1/sqrt(2)
+
+	// 48-bit smallest three quaternion: index of the largest component in the lowest
+	// two bits, then the other three components with 15 bits each
+	void packRotation(quat q, ushort* out) {
+		float c[4] = { q.x, q.y, q.z, q.w };
+		uint largest = 0;
+		for (uint i = 1; i < 4; ++i)
+			if (glm::abs(c[i]) > glm::abs(c[largest]))
+				largest = i;
+		float sign = c[largest] < 0.f ? -1.f : 1.f; // q and -q are the same rotation
+		uint64 bits = largest;
+		for (uint i = 0, n = 0; i < 4; ++i) {
+			if (i == largest)
+				continue;
+			float v = glm::clamp(c[i] * sign / SMALLEST_THREE_RANGE * 0.5f + 0.5f, 0.f, 1.f);
+			bits |= uint64(v * 32767.f + 0.5f) << (2 + 15 * n++);
+		}
+		out[0] = bits & 0xffff;
+		out[1] = (bits >> 16) & 0xffff;
+		out[2] = bits >> 32;
+	}
+
+	quat unpackRotation(const ushort* in) {
+		// Where each output component (x, y, z, w) is found among the three stored
+		// values and the reconstructed largest one (index 3) for each largest index
+		static const uint8 order[4][4] = { { 3, 0, 1, 2 }, { 0, 3, 1, 2 }, { 0, 1, 3, 2 }, { 0, 1, 2, 3 } };
+		const float scale = 2.f * SMALLEST_THREE_RANGE / 32767.f;
+		uint64 bits = in[0] | uint64(in[1]) << 16 | uint64(in[2]) << 32;
+		float c[4];
+		c[0] = ((bits >> 2) & 0x7fff) * scale - SMALLEST_THREE_RANGE;
+		c[1] = ((bits >> 17) & 0x7fff) * scale - SMALLEST_THREE_RANGE;
+		c[2] = ((bits >> 32) & 0x7fff) * scale - SMALLEST_THREE_RANGE;
+		c[3] = glm::sqrt(glm::max(1.f - c[0] * c[0] - c[1] * c[1] - c[2] * c[2], 0.f));
+		const uint8* o = order[bits & 3];
+		return quat(c[o[3]], c[o[0]], c[o[1]], c[o[2]]);
+	}
+
+	inline ushort quantize(float value, float min, float step) {
+		return step > 0.f ? ushort(glm::clamp((value - min) / step, 0.f, 65535.f) + 0.5f) : 0;
+	}
+
+	inline bool withinTolerance(const vec4& a, const vec4& b, float tolerance) {
+		vec4 d = glm::abs(a - b);
+		return glm::max(glm::max(d.x, d.y), glm::max(d.z, d.w)) <= tolerance;
+	}
+
+	// Greedily extends each segment while linear interpolation between its end
+	// keys stays within the tolerance at every skipped frame
+	void reduceKeys(const std::vector<vec4>& values, bool rotation, float tolerance, std::vector<uint>& keys) {
+		keys.clear();
+		keys.push_back(0);
+		uint count = values.size();
+		bool constant = true;
+		for (uint i = 1; i < count && constant; ++i)
+			constant = withinTolerance(values[i], values[0], tolerance);
+		if (constant)
+			return;
+		uint start = 0;
+		for (uint end = 2; end < count; ++end) {
+			bool ok = true;
+			for (uint i = start + 1; i < end && ok; ++i) {
+				vec4 v = glm::mix(values[start], values[end], float(i - start) / (end - start));
+				if (rotation)
+					v = glm::normalize(v);
+				ok = withinTolerance(v, values[i], tolerance);
+			}
+			if (!ok) {
+				start = end - 1;
+				keys.push_back(start);
+			}
+		}
+		keys.push_back(count - 1);
+	}
+
+	inline float channel(const AnimationPoses& poses, uint frame, int channel, uint bone) {
+		return poses.frame(frame)[channel * poses.stride + bone];
+	}
+}
+
+size_t CompressedAnimation::memoryUsage() const
+{
+	return tracks.size() * sizeof(Track) + keyFrames.size() * sizeof(ushort) + keyValues.size() * sizeof(ushort);
+}
+
+void compressAnimation(const AnimationPoses& poses, float tolerance, CompressedAnimation& out)
+{
+	ASSERT(poses.numFrames > 0 && poses.numFrames <= 0xffff);
+	out.numBones = poses.numBones;
+	out.numFrames = poses.numFrames;
+	out.tracks.assign(poses.numBones * CompressedAnimation::NUM_TRACK_TYPES, CompressedAnimation::Track());
+	out.keyFrames.clear();
+	out.keyValues.clear();
+	std::vector<vec4> values(poses.numFrames);
+	std::vector<uint> keys;
+	for (uint bone = 0; bone < poses.numBones; ++bone) {
+		for (int type = 0; type < CompressedAnimation::NUM_TRACK_TYPES; ++type) {
+			const bool rotation = type == CompressedAnimation::ROTATION;
+			const int first = type == CompressedAnimation::TRANSLATION ? AnimationPoses::TX :
+				rotation ? AnimationPoses::RX : AnimationPoses::SX;
+			vec3 min(FLT_MAX), max(-FLT_MAX);
+			for (uint f = 0; f < poses.numFrames; ++f) {
+				vec4& v = values[f];
+				for (int c = 0; c < (rotation ? 4 : 3); ++c)
+					v[c] = channel(poses, f, first + c, bone);
+				if (rotation) {
+					// Keep the hemisphere continuous so that keys interpolate along the short arc
+					if (f > 0 && glm::dot(v, values[f - 1]) < 0.f)
+						v = -v;
+				} else {
+					v.w = 0.f;
+					min = glm::min(min, vec3(v));
+					max = glm::max(max, vec3(v));
+				}
+			}
+			reduceKeys(values, rotation, tolerance, keys);
+			CompressedAnimation::Track& track = out.tracks[bone * CompressedAnimation::NUM_TRACK_TYPES + type];
+			track.firstKey = out.keyFrames.size();
+			track.numKeys = keys.size();
+			if (!rotation) {
+				track.min = min;
+				track.step = (max - min) / 65535.f;
+			}
+			for (uint key : keys) {
+				const vec4& v = values[key];
+				ushort packed[3];
+				if (rotation) {
+					packRotation(quat(v.w, v.x, v.y, v.z), packed);
+				} else {
+					for (int c = 0; c < 3; ++c)
+						packed[c] = quantize(v[c], track.min[c], track.step[c]);
+				}
+				out.keyFrames.push_back(key);
+				out.keyValues.insert(out.keyValues.end(), packed, packed + 3);
+			}
+		}
+	}
+}
+
+void sampleAnimation(const CompressedAnimation& clip, float frame, ushort* cursors, float* channels, uint stride,
+	const uint8* depths, uint maxDepth)
+{
+	for (uint bone = 0; bone < clip.numBones; ++bone) {
+		if (depths && depths[bone] > maxDepth)
+			continue;
+		for (int type = 0; type < CompressedAnimation::NUM_TRACK_TYPES; ++type) {
+			uint trackIndex = bone * CompressedAnimation::NUM_TRACK_TYPES + type;
+			const CompressedAnimation::Track& track = clip.tracks[trackIndex];
+			const ushort* keyFrames = &clip.keyFrames[track.firstKey];
+			const ushort* keyValues = &clip.keyValues[track.firstKey * 3];
+			ushort& cursor = cursors[trackIndex];
+			float* out = &channels[(type == CompressedAnimation::TRANSLATION ? AnimationPoses::TX :
+				type == CompressedAnimation::ROTATION ? AnimationPoses::RX : AnimationPoses::SX) * stride + bone];
+			if (track.numKeys == 1) {
+				// Constant tracks are common (e.g. scale), skip the interpolation
+				if (type == CompressedAnimation::ROTATION) {
+					quat r = unpackRotation(keyValues);
+					out[0] = r.x; out[stride] = r.y; out[2 * stride] = r.z; out[3 * stride] = r.w;
+				} else {
+					for (int c = 0; c < 3; ++c)
+						out[c * stride] = track.min[c] + keyValues[c] * track.step[c];
+				}
+				continue;
+			}
+			if (cursor >= track.numKeys || keyFrames[cursor] > frame)
+				cursor = 0;
+			while (cursor + 1u < track.numKeys && keyFrames[cursor + 1] <= frame)
+				++cursor;
+			// Past the last key the clip loops back to the first one like the dense frames do
+			uint next = cursor + 1u < track.numKeys ? cursor + 1u : 0u;
+			float span = (next ? keyFrames[next] : clip.numFrames) - keyFrames[cursor];
+			float alpha = span > 0.f ? glm::clamp((frame - keyFrames[cursor]) / span, 0.f, 1.f) : 0.f;
+			const ushort* a = &keyValues[cursor * 3];
+			const ushort* b = &keyValues[next * 3];
+			if (type == CompressedAnimation::ROTATION) {
+				quat ra = unpackRotation(a);
+				quat rb = unpackRotation(b);
+				if (glm::dot(ra, rb) < 0.f)
+					rb = -rb;
+				quat r = ra * (1.f - alpha) + rb * alpha; // Normalized in composePoses()
+				out[0] = r.x; out[stride] = r.y; out[2 * stride] = r.z; out[3 * stride] = r.w;
+			} else {
+				for (int c = 0; c < 3; ++c)
+					out[c * stride] = track.min[c] + (a[c] + (b[c] - a[c]) * alpha) * track.step[c];
+			}
+		}
+	}
+	for (uint bone = clip.numBones; bone < stride; ++bone) {
+		for (int c = 0; c < AnimationPoses::NUM_CHANNELS; ++c)
+			channels[c * stride + bone] = 0.f;
+		channels[AnimationPoses::RW * stride + bone] = 1.f;
+		channels[AnimationPoses::SX * stride + bone] = 1.f;
+		channels[AnimationPoses::SY * stride + bone] = 1.f;
+		channels[AnimationPoses::SZ * stride + bone] = 1.f;
+	}
+}
+
+} // namespace kernels
@@ -0,0 +1,73 @@
+#pragma once
+#include "common.hpp"
+
+// Skeletal animation evaluation on structure of arrays pose data.
+// Bones are processed four at a time with SSE when available, falling back to scalar code.
+namespace kernels {
+
+	// Local bone transforms of an animation clip, split into translation, rotation
+	// and scale channels. Each channel of a frame holds `stride` floats: the bone
+	// count rounded up to a multiple of four, with identity transforms as padding.
+	struct AnimationPoses {
+		enum Channel { TX, TY, TZ, RX, RY, RZ, RW, SX, SY, SZ, NUM_CHANNELS };
+		uint numBones = 0;
+		uint stride = 0;
+		uint numFrames = 0;
+		std::vector<float> data;
+
+		void resize(uint bones, uint frames);
+		float* frame(uint index) { return &data[index * stride * NUM_CHANNELS]; }
+		const float* frame(uint index) const { return &data[index * stride * NUM_CHANNELS]; }
+	};
+
+	// Extracts local poses from skinning matrices laid out like Geometry::animFrames
+	// (parent bind pose * local * inverse bind pose, one matrix per bone per frame)
+	void decomposeAnimation(const mat3x4* frames, uint numFrames, const mat3x4* bindPose,
+		const int* parents, uint numBones, AnimationPoses& out);
+
+	// Interpolates two frames (rotations with normalized lerp) into local bone
+	// matrices, `local` needs room for poses.stride matrices
+	void blendPoses(const AnimationPoses& poses, uint frameA, uint frameB, float alpha, mat3x4* local);
+
+	// Builds local bone matrices from a single pose in AnimationPoses frame layout,
+	// normalizing the rotations
+	void composePoses(const float* channels, uint stride, mat3x4* local);
+
+	// Concatenates local matrices down the hierarchy in place (parents must come
+	// before children) and writes model space pose * inverse bind pose to `out`.
+	// With depths given, bones deeper than maxDepth follow their parent rigidly.
+	void concatenateBones(mat3x4* pose, const int* parents, const mat3x4* inverseBindPose,
+		uint numBones, mat3x4* out, const uint8* depths = nullptr, uint maxDepth = 0);
+
+	// Keyframe reduced animation clip with quantized values. Each bone has a
+	// translation, rotation and scale track. Rotations are stored as 48-bit
+	// smallest three quaternions, translations and scales with 16 bits per
+	// component within the range of the track.
+	struct CompressedAnimation {
+		enum TrackType { TRANSLATION, ROTATION, SCALE, NUM_TRACK_TYPES };
+		struct Track {
+			uint firstKey = 0;
+			uint numKeys = 0;
+			vec3 min = vec3(0.f); // Quantization range, unused for rotations
+			vec3 step = vec3(0.f);
+		};
+		uint numBones = 0;
+		uint numFrames = 0;
+		std::vector<Track> tracks; // NUM_TRACK_TYPES per bone
+		std::vector<ushort> keyFrames;
+		std::vector<ushort> keyValues; // Three per key
+
+		size_t memoryUsage() const;
+	};
+
+	// Drops keys that linear interpolation reproduces within the tolerance
+	// (in units for translation and scale, quaternion components for rotation)
+	void compressAnimation(const AnimationPoses& poses, float tolerance, CompressedAnimation& out);
+
+	// Samples the clip at a fractional frame into the AnimationPoses frame layout.
+	// `cursors` hold the current key of each track so that playback does not have
+	// to search for keys, they start over by themselves when time goes backwards.
+	// Bones deeper than maxDepth in the hierarchy are left as they are if depths are given.
+	void sampleAnimation(const CompressedAnimation& clip, float frame, ushort* cursors, float* channels, uint stride,
+		const uint8* depths = nullptr, uint maxDepth = 0);
+}
@@ -58,7 +58,7 @@ void AudioSystem::update(Entities& entities, const Transform& listener)
 	// Contact sounds
 	entities.for_each<ContactSound, Transform>([&](Entity e, ContactSound& sound, Transform& trans) {
 		ASSERT(e.has<ContactTracker>());
-		if (e.get<ContactTracker>().hadContact) {
+		if (e.get<ContactTracker>().began) {
 			play(sound.event, trans.position);
 		}
 	});
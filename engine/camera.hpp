@@ -96,7 +96,7 @@ struct Frustum {
 	}
 
 	bool visible(const Transform& transform, const Bounds& bounds) const {
-		return visible(transform.position, bounds.radius * glm::compMax(transform.scale));
+		return visible(bounds.worldCenter(transform), bounds.worldRadius(transform));
 	}
 
 	bool visible(vec3 position, float radius) const {
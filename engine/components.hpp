@@ -1,6 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include "material.hpp"
+#include <glm/gtx/component_wise.hpp>
 
 struct Transform
 {
@@ -31,7 +32,15 @@ struct Bounds
 {
 	vec3 min = vec3(INFINITY, INFINITY, INFINITY);
 	vec3 max = vec3(INFINITY, INFINITY, INFINITY);
+	vec3 center = vec3(0, 0, 0); // Bounding sphere center in model space
 	float radius = INFINITY;
+
+	vec3 worldCenter(const Transform& transform) const {
+		return transform.position + transform.rotation * (transform.scale * center);
+	}
+	float worldRadius(const Transform& transform) const {
+		return radius * glm::compMax(transform.scale);
+	}
 };
 
 enum class AnimationState : uint {
@@ -45,10 +54,15 @@ enum class AnimationMode : uint {
 struct BoneAnimation
 {
 	std::vector<mat3x4> bones;
+	std::vector<ushort> cursors; // Current keys when sampling compressed clips
  	AnimationState state = AnimationState::STOPPED;
 	uint animation = 0;
 	float time = 0.f;
 	float speed = 1.f;
+	// Significance from the previous frame's culling, written by the renderer
+	bool visible = true;
+	float screenSize = 1.f; // Bounding sphere radius relative to half the screen height
+	int skinningInstance = -1; // Bones in the renderer's palette for the current frame
 };
 
 struct PropertyAnimation
@@ -60,14 +74,24 @@ struct PropertyAnimation
 		T value = {};
 	};
 
+	// Keyframe times and values are kept in separate arrays so that seeking
+	// only touches the times
 	template<typename T>
 	struct Track
 	{
-		Track(uint id, const std::vector<Keyframe<T>>& keyframes): id(id), keyframes(keyframes) {}
+		Track(uint id, const std::vector<Keyframe<T>>& keyframes): id(id) {
+			for (const auto& keyframe : keyframes)
+				addKeyframe(keyframe.time, keyframe.value);
+		}
+		void addKeyframe(float time, const T& value) { times.push_back(time); values.push_back(value); }
+		float length() const { return times.empty() ? 0.f : times.back(); }
+
 		T currentValue = {};
 		uint id = 0;
-		std::vector<Keyframe<T>> keyframes;
-		float length() const { return keyframes.empty() ? 0.f : keyframes.back().time; }
+		uint cursor = 0; // Keyframe preceding the last evaluated time
+		int target = -1; // Bound field of the entity, resolved from id on first update
+		std::vector<float> times;
+		std::vector<T> values;
 	};
 
 	AnimationState state = AnimationState::STOPPED;
@@ -107,6 +131,18 @@ struct Model
 	std::vector<Material> materials;
 };
 
+// Heightmap terrain rendered and streamed by TerrainSystem, static after creation
+struct Terrain
+{
+	struct Image* heightmap = nullptr;
+	uint tileSize = 64; // Heightmap samples per tile side
+	uint lodLevels = 4; // Quadtree depth, node meshes have tileSize >> (lodLevels - 1) quads per side
+	float lodDistance = 32.f; // Range of the most detailed level, doubles for each coarser level
+	float streamDistance = 500.f; // Tiles further away are unloaded
+	float colliderDistance = 100.f; // Tiles closer than this get a heightfield collider
+	Material material;
+};
+
 struct Particles
 {
 	uint count = 0;
@@ -127,6 +163,8 @@ struct Particles
 struct RigidBody
 {
 	class btRigidBody* body = nullptr;
+	int collisionGroup = 0; // Broadphase filter bits, 0 for Bullet's defaults
+	int collisionMask = 0;
 };
 
 struct GroundTracker
@@ -136,14 +174,16 @@ struct GroundTracker
 
 struct ContactTracker
 {
-	bool hadContact = false;
+	uint touching = 0; // Bodies in contact
+	bool began = false; // New contacts during the last frame
+	float impulse = 0.f; // Strongest of the new contacts
 };
 
 struct TriggerVolume
 {
 	uint times = -1;
 	uint groups = 0;
-	Bounds bounds;
+	Bounds bounds; // Box if min and max are set, sphere of radius otherwise
 	uint receiverModule = 0;
 	uint enterMessage = 0;
 	uint exitMessage = 0;
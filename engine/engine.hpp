@@ -1,6 +1,7 @@
 #pragma once
 #include "common.hpp"
 #include "threadpool.hpp"
+#include "filewatcher.hpp"
 #include <json11/json11.hpp>
 
 
@@ -40,6 +41,10 @@ public:
 		ASSERT(s_singleton);
 		return s_singleton->m_threadpool;
 	}
+	static FileWatcher& fileWatcher() {
+		ASSERT(s_singleton);
+		return s_singleton->m_fileWatcher;
+	}
 
 	static json11::Json settings;
 
@@ -49,6 +54,7 @@ private:
 	int m_height = 0;
 	uint64 m_prevTime = 0;
 	thread_pool m_threadpool = {threads};
+	FileWatcher m_fileWatcher;
 #ifdef USE_PROFILER
 	Remotery* m_remotery = nullptr;
 #endif
@@ -0,0 +1,172 @@
+#include "filewatcher.hpp"
+#include "engine.hpp"
+#include "utils.hpp"
+#include <unordered_map>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+	const uint POLL_INTERVAL = 250; // Milliseconds, when inotify is not available
+
+	uint changeTime()
+	{
+		return std::max(Engine::timems(), 1u); // Zero means no change
+	}
+}
+
+FileWatcher::FileWatcher()
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+	if (!m_thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_thread.join();
+}
+
+void FileWatcher::watch(const string& path, Callback callback, uint owner, uint delay)
+{
+	Watch watch;
+	watch.path = path;
+	size_t slash = path.find_last_of("/\\");
+	watch.dir = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	watch.file = slash == string::npos ? path : path.substr(slash + 1);
+	watch.callback = callback;
+	watch.owner = owner;
+	watch.delay = delay;
+	watch.mtime = utils::timestamp(path);
+	watch.changed = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_watches.push_back(std::move(watch));
+		m_dirty = true;
+	}
+	if (!m_thread.joinable())
+		m_thread = std::thread(&FileWatcher::run, this);
+}
+
+void FileWatcher::unwatch(uint owner)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto end = std::remove_if(m_watches.begin(), m_watches.end(), [owner](const Watch& watch) { return watch.owner == owner; });
+	if (end == m_watches.end())
+		return;
+	m_watches.erase(end, m_watches.end());
+	m_dirty = true;
+}
+
+void FileWatcher::update()
+{
+	std::vector<std::pair<Callback, string>> changes;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		uint now = Engine::timems();
+		for (Watch& watch : m_watches) {
+			if (watch.changed && now - watch.changed >= watch.delay) {
+				watch.changed = 0;
+				changes.emplace_back(watch.callback, watch.path);
+			}
+		}
+	}
+	// Callbacks may add and remove watches
+	for (auto& change : changes)
+		change.first(change.second);
+}
+
+// Runs on the watcher thread
+void FileWatcher::run()
+{
+	int fd = -1;
+#ifdef __linux__
+	const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+	std::unordered_map<string, int> dirs; // Watch descriptors, aliases of a directory share one
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0)
+		logWarning("Could not initialize inotify, polling watched files instead");
+#endif
+	std::vector<std::pair<string, uint>> polled;
+
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_quit)
+				break;
+#ifdef __linux__
+			if (m_dirty && fd >= 0) {
+				std::unordered_map<string, int> used;
+				for (const Watch& watch : m_watches) {
+					if (used.count(watch.dir))
+						continue;
+					auto it = dirs.find(watch.dir);
+					int wd = it != dirs.end() ? it->second : inotify_add_watch(fd, watch.dir.c_str(), mask);
+					if (wd < 0)
+						logWarning("Could not watch directory %s", watch.dir.c_str());
+					used[watch.dir] = wd;
+				}
+				for (auto& it : dirs) {
+					bool alias = std::any_of(used.begin(), used.end(), [&](const std::pair<const string, int>& dir) { return dir.second == it.second; });
+					if (it.second >= 0 && !alias)
+						inotify_rm_watch(fd, it.second);
+				}
+				dirs.swap(used);
+			}
+#endif
+			m_dirty = false;
+			if (fd < 0) {
+				polled.clear();
+				for (const Watch& watch : m_watches)
+					polled.emplace_back(watch.path, watch.mtime);
+			}
+		}
+
+#ifdef __linux__
+		if (fd >= 0) {
+			pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+			alignas(inotify_event) char buf[4096];
+			ssize_t len;
+			while ((len = read(fd, buf, sizeof(buf))) > 0) {
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (char* ptr = buf; ptr < buf + len; ptr += sizeof(inotify_event) + ((inotify_event*)ptr)->len) {
+					const inotify_event& event = *(inotify_event*)ptr;
+					if (!event.len)
+						continue;
+					for (Watch& watch : m_watches) {
+						auto dir = dirs.find(watch.dir);
+						if (dir != dirs.end() && dir->second == event.wd && watch.file == event.name)
+							watch.changed = changeTime();
+					}
+				}
+			}
+			continue;
+		}
+#endif
+		utils::sleep(POLL_INTERVAL);
+		for (auto& file : polled) {
+			uint ts = utils::timestamp(file.first);
+			if (ts == file.second)
+				continue;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			for (Watch& watch : m_watches) {
+				if (watch.path == file.first) {
+					watch.mtime = ts;
+					watch.changed = changeTime();
+				}
+			}
+		}
+	}
+#ifdef __linux__
+	if (fd >= 0)
+		close(fd);
+#endif
+}
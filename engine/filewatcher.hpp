@@ -0,0 +1,44 @@
+#pragma once
+#include "common.hpp"
+#include <functional>
+#include <thread>
+#include <mutex>
+
+// Calls back when watched files change. A background thread detects the changes, with
+// inotify on Linux and by polling timestamps elsewhere, and update() delivers them on the
+// calling thread once a file has not changed for the watch's delay, so that half written
+// files are not picked up.
+class FileWatcher
+{
+public:
+	typedef std::function<void(const string& path)> Callback;
+
+	FileWatcher();
+	~FileWatcher();
+
+	// Watches are grouped by owner, e.g. a module id, for removing them together.
+	// Code that can be unloaded must remove its watches before that.
+	void watch(const string& path, Callback callback, uint owner = 0, uint delay = 100);
+	void unwatch(uint owner);
+	void update(); // Call at the start of a frame
+
+private:
+	struct Watch {
+		string path;
+		string dir;
+		string file;
+		Callback callback;
+		uint owner;
+		uint delay; // Milliseconds
+		uint mtime; // When polling
+		uint changed; // Time of the latest change, 0 if none
+	};
+
+	void run();
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::vector<Watch> m_watches; // Guarded by m_mutex
+	bool m_dirty = false; // Guarded by m_mutex
+	bool m_quit = false; // Guarded by m_mutex
+};
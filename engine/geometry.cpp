@@ -1,17 +1,26 @@
 #include "geometry.hpp"
+#include "geometrykernels.hpp"
 #include "image.hpp"
 #include "physics.hpp"
 #include "iqm/iqm.h"
 #include "glrenderer/glutil.hpp"
 #include <glm/gtc/matrix_inverse.hpp>
-#include <glm/gtx/normal.hpp>
 #include <sstream>
 #include <fstream>
 #include <cstring>
 #include <map>
 #include "utils.hpp"
+#include "engine.hpp"
+
+static CVar<int> cvar_geometryResidency("r.geometryResidency", Geometry::KEEP_ALL);
+static CVar<int> cvar_lazyAnimations("anim.lazyDecode", 0); // Keep IQM animations quantized until played
 
 namespace {
+	template<typename T>
+	void releaseVector(std::vector<T>& vec) {
+		std::vector<T>().swap(vec);
+	}
+
 	mat3x4 invert(mat3x4 mat) {
 		mat3 invrot(vec3(mat[0].x, mat[1].x, mat[2].x), vec3(mat[0].y, mat[1].y, mat[2].y), vec3(mat[0].z, mat[1].z, mat[2].z));
 		invrot[0] /= glm::length2(invrot[0]);
@@ -25,6 +34,146 @@ namespace {
 		return ret;
 	}
 
+	struct TangentCorner {
+		vec3 tangent;
+		float weight;
+		float sign; // Zero for degenerate triangles
+	};
+
+	vec3 anyPerpendicular(vec3 n) {
+		return glm::normalize(glm::cross(n, glm::abs(n.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0)));
+	}
+
+	// Corner tangents projected to the normal plane and weighted by corner angle
+	void triangleTangents(const vec3 p[3], const vec2 uv[3], const vec3 n[3], TangentCorner corners[3]) {
+		vec3 deltaPos1 = p[1] - p[0];
+		vec3 deltaPos2 = p[2] - p[0];
+		vec2 deltaUV1 = uv[1] - uv[0];
+		vec2 deltaUV2 = uv[2] - uv[0];
+		float det = deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x;
+		vec3 tangent = deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y;
+		vec3 bitangent = deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x;
+		if (det < 0.f) {
+			tangent = -tangent;
+			bitangent = -bitangent;
+		}
+		for (int j = 0; j < 3; ++j) {
+			TangentCorner& corner = corners[j];
+			corner = { vec3(), 0.f, 0.f };
+			if (glm::abs(det) < 1e-12f)
+				continue;
+			vec3 t = tangent - n[j] * glm::dot(n[j], tangent);
+			float lenSq = glm::length2(t);
+			if (lenSq < 1e-12f)
+				continue;
+			corner.tangent = t / glm::sqrt(lenSq);
+			corner.sign = glm::dot(glm::cross(n[j], corner.tangent), bitangent) < 0.f ? -1.f : 1.f;
+			vec3 e1 = p[(j + 1) % 3] - p[j];
+			vec3 e2 = p[(j + 2) % 3] - p[j];
+			float lenProd = glm::sqrt(glm::length2(e1) * glm::length2(e2));
+			corner.weight = lenProd > 0.f ? glm::acos(glm::clamp(glm::dot(e1, e2) / lenProd, -1.f, 1.f)) : 0.f;
+		}
+	}
+
+	template<class T>
+	void duplicateElement(std::vector<T>& vec, uint index) {
+		if (!vec.empty())
+			vec.push_back(vec[index]);
+	}
+
+	template<class T>
+	void reserveElements(std::vector<T>& vec, uint count) {
+		if (!vec.empty())
+			vec.reserve(count);
+	}
+
+	void reserveVertices(Batch& batch, uint count) {
+		reserveElements(batch.positions, count);
+		reserveElements(batch.texcoords, count);
+		reserveElements(batch.normals, count);
+		reserveElements(batch.boneindices, count);
+		reserveElements(batch.boneweights, count);
+		reserveElements(batch.colors, count);
+		reserveElements(batch.morphTargets, count);
+	}
+
+	// Tangents are not copied, the caller is expected to fill them in
+	uint duplicateVertex(Batch& batch, uint index) {
+		duplicateElement(batch.positions, index);
+		duplicateElement(batch.texcoords, index);
+		duplicateElement(batch.normals, index);
+		duplicateElement(batch.boneindices, index);
+		duplicateElement(batch.boneweights, index);
+		duplicateElement(batch.colors, index);
+		duplicateElement(batch.morphTargets, index);
+		return batch.positions.size() - 1;
+	}
+
+	// Native .wmesh format: a header followed by 16 byte aligned sections, with vertices
+	// already interleaved as described by the batch attributes so they can be uploaded as is.
+	// Everything is little endian and offsets are from the start of the file.
+	const char WMESH_MAGIC[8] = { 'W', 'E', 'E', 'P', 'M', 'S', 'H', '\0' };
+	const uint WMESH_VERSION = 1;
+	const uint WMESH_MAX_ATTRIBUTES = 16;
+	static_assert(ATTR_MAX <= WMESH_MAX_ATTRIBUTES, "Too many attributes for .wmesh");
+
+	struct WmeshHeader {
+		char magic[8];
+		uint version;
+		uint fileSize;
+		uint numBatches, numBones, numAnimFrames, numAnimations;
+		uint ofsBatches, ofsBones, ofsBoneParents, ofsAnimFrames, ofsAnimations, ofsText;
+		float boundsMin[3], boundsMax[3], boundsCenter[3], boundsRadius;
+	};
+
+	struct WmeshAttribute {
+		uint8 components;
+		uint8 normalized;
+		ushort type; // GL type enum
+		uint offset;
+	};
+
+	struct WmeshBatch {
+		uint name; // Offset into text
+		uint materialIndex;
+		uint numVertices, vertexSize, numIndices;
+		uint ofsVertices, ofsIndices;
+		uint padding;
+		WmeshAttribute attributes[WMESH_MAX_ATTRIBUTES];
+	};
+
+	struct WmeshAnimation {
+		uint name;
+		uint start, length;
+		float frameRate;
+	};
+
+	// Unused attributes have no components, used ones must lie within the vertex
+	bool attributeFits(const WmeshAttribute& attr, uint vertexSize)
+	{
+		if (!attr.components)
+			return true;
+		uint typeSize = 0;
+		switch (attr.type) {
+			case GL_BYTE: case GL_UNSIGNED_BYTE: typeSize = 1; break;
+			case GL_SHORT: case GL_UNSIGNED_SHORT: typeSize = 2; break;
+			case GL_FLOAT: case GL_INT: case GL_UNSIGNED_INT: typeSize = 4; break;
+			default: return false; // Not queried from glutil, which asserts on unknown types
+		}
+		return attr.components <= 4 && (size_t)attr.offset + attr.components * typeSize <= vertexSize;
+	}
+
+	template<typename T>
+	void unpackAttribute(std::vector<T>& dst, const Batch& batch, int index) {
+		const Batch::Attribute& attr = batch.attributes[index];
+		if (!attr.components)
+			return;
+		ASSERT(attr.components * glutil::getTypeSize(attr.type) == sizeof(T));
+		dst.resize(batch.numVertices);
+		for (uint i = 0; i < batch.numVertices; ++i)
+			std::memcpy(&dst[i], batch.mappedVertices + i * batch.vertexSize + attr.offset, sizeof(T));
+	}
+
 	mat3x4 jointToMatrix(quat rot, vec3 scale, vec3 transl) {
 		float x = rot.x, y = rot.y, z = rot.z, w = rot.w,
 			tx = 2*x, ty = 2*y, tz = 2*z,
@@ -36,27 +185,59 @@ namespace {
 		vec3 c = vec3(txz - twy, tyz + twx, 1 - (txx + tyy));
 		return mat3x4(vec4(a * scale, transl.x), vec4(b * scale, transl.y), vec4(c * scale, transl.z));
 	}
+
+	// Expands quantized IQM channels of frames [first, first + count) to skinning matrices
+	void decodeAnimationFrames(const Geometry::CompactAnimations& anims, const ushort* channels,
+		const std::vector<mat3x4>& bones, uint first, uint count, mat3x4* out)
+	{
+		uint numPoses = anims.poses.size();
+		for (uint i = 0; i < count; ++i) {
+			const ushort* frame = &channels[(first + i) * anims.channelsPerFrame];
+			for (uint j = 0; j < numPoses; ++j) {
+				const Geometry::CompactAnimations::Pose& p = anims.poses[j];
+				const ushort* c = &frame[p.firstChannel];
+				float values[10];
+				for (uint k = 0; k < 10; ++k) {
+					values[k] = p.offset[k];
+					if (p.mask & (1 << k))
+						values[k] += *c++ * p.scale[k];
+				}
+				vec3 translate(values[0], values[1], values[2]);
+				quat rotate(values[6], values[3], values[4], values[5]);
+				vec3 scale(values[7], values[8], values[9]);
+				mat3x4 matrix = jointToMatrix(rotate, scale, translate);
+				if (p.parent >= 0) out[i * numPoses + j] = multiplyBones(multiplyBones(bones[p.parent], matrix), anims.inverseBones[j]);
+				else out[i * numPoses + j] = multiplyBones(matrix, anims.inverseBones[j]);
+			}
+		}
+	}
 }
 
 Geometry::Geometry(const string& path)
 {
 	START_MEASURE(geomLoadTimeMs);
+	this->path = path;
+	residency = (Residency)glm::clamp(cvar_geometryResidency(), (int)KEEP_ALL, (int)GPU_ONLY);
 
+	bool precomputed = false; // Bounds and vertex data
 	if (utils::endsWith(path, ".obj")) loadObj(path);
 	else if (utils::endsWith(path, ".iqm")) loadIqm(path);
+	else if (utils::endsWith(path, ".wmesh")) precomputed = loadWmesh(path);
 	else {
 		END_CPU_SAMPLE()
 		logError("Unsupported file format for geometry %s", path.c_str());
 		return;
 	}
 
-	calculateBoundingSphere();
-	calculateBoundingBox();
-	if (!batches.empty() && batches.back().normals.empty())
-		calculateNormals();
-	else normalizeNormals();
-	for (auto& batch : batches)
-		batch.setupAttributes();
+	if (!precomputed) {
+		calculateBoundingSphere();
+		calculateBoundingBox();
+		if (!batches.empty() && batches.back().normals.empty())
+			calculateNormals();
+		else normalizeNormals();
+		for (auto& batch : batches)
+			batch.setupAttributes();
+	}
 	END_MEASURE(geomLoadTimeMs)
 	logDebug("Loaded mesh %s in %.1fms with %d batches, %d bones, %d anims, bound r: %f",
 		path.c_str(), geomLoadTimeMs, batches.size(), bones.size(), animations.size(), bounds.radius);
@@ -138,6 +319,7 @@ Geometry::Geometry(uint numParticleQuads)
 	// TODO: What should this be...?
 	bounds.min = { -10, -10, -10 };
 	bounds.max = { 10, 10, 10 };
+	bounds.center = { 0, 0, 0 };
 	bounds.radius = 10;
 }
 
@@ -242,7 +424,7 @@ bool Geometry::loadObj(const string& path)
 }
 
 template<class vector_t, class T = typename vector_t::value_type>
-static bool iqmAssign(vector_t& dst, uint8* data, uint wantedFormat, uint wantedSize, iqmvertexarray& va, iqmmesh& mesh)
+static bool iqmAssign(vector_t& dst, const uint8* data, uint wantedFormat, uint wantedSize, const iqmvertexarray& va, const iqmmesh& mesh)
 {
 	if (va.format != wantedFormat || va.size != wantedSize) {
 		logWarning("Unsupported iqm vertex array type");
@@ -252,21 +434,21 @@ static bool iqmAssign(vector_t& dst, uint8* data, uint wantedFormat, uint wanted
 	uint compSize = wantedFormat == IQM_UBYTE ? sizeof(uint8) : sizeof(float);
 	uint start = va.offset + va.size * compSize * mesh.first_vertex;
 	uint end = start + va.size * compSize * mesh.num_vertexes;
-	dst.assign((T*)&data[start], (T*)&data[end]);
+	dst.assign((const T*)&data[start], (const T*)&data[end]);
 	ASSERT(dst.size() == mesh.num_vertexes);
 	return true;
 }
 
 bool Geometry::loadIqm(const string& path)
 {
-	std::ifstream file(path, std::ios::binary);
-	if (!file) {
+	utils::MappedFile file(path);
+	if (!file.valid()) {
 		logError("Failed to open file %s", path.c_str());
 		return false;
 	}
-	iqmheader header;
-	file.read(reinterpret_cast<char*>(&header), sizeof(header));
-	if (file.fail() || memcmp(header.magic, IQM_MAGIC, sizeof(header.magic))) {
+	const uint8* data = (const uint8*)file.data();
+	const iqmheader& header = *(const iqmheader*)data;
+	if (file.size() < sizeof(header) || memcmp(header.magic, IQM_MAGIC, sizeof(header.magic))) {
 		logError("File %s is not in IQM format", path.c_str());
 		return false;
 	}
@@ -274,28 +456,25 @@ bool Geometry::loadIqm(const string& path)
 		logError("Unsupported IQM version %u (expected %d) in %s", header.version, IQM_VERSION, path.c_str());
 		return false;
 	}
-	std::vector<uint8> data;
-	data.resize(header.filesize);
-	file.read(reinterpret_cast<char*>(&data[sizeof(header)]), header.filesize - sizeof(header));
-	if (file.fail()) {
+	if (header.filesize > file.size()) {
 		logError("Failed to read data from %s", path.c_str());
 		return false;
 	}
 
-	iqmvertexarray* vas = (iqmvertexarray*)&data[header.ofs_vertexarrays];
-	iqmmesh* meshes = (iqmmesh*)&data[header.ofs_meshes];
-	iqmtriangle* tris = (iqmtriangle*)&data[header.ofs_triangles];
-	iqmjoint* joints = (iqmjoint*)&data[header.ofs_joints];
-	const char *str = header.ofs_text ? (char*)&data[header.ofs_text] : "";
+	const iqmvertexarray* vas = (const iqmvertexarray*)&data[header.ofs_vertexarrays];
+	const iqmmesh* meshes = (const iqmmesh*)&data[header.ofs_meshes];
+	const iqmtriangle* tris = (const iqmtriangle*)&data[header.ofs_triangles];
+	const iqmjoint* joints = (const iqmjoint*)&data[header.ofs_joints];
+	const char *str = header.ofs_text ? (const char*)&data[header.ofs_text] : "";
 	ASSERT(header.num_triangles);
 	std::map<string, uint> mtlMap;
 
 	for (uint m = 0; m < header.num_meshes; ++m) {
 		batches.emplace_back();
 		Batch& batch = batches.back();
-		iqmmesh& mesh = meshes[m];
+		const iqmmesh& mesh = meshes[m];
 		batch.name = &str[mesh.name];
-		batch.indices.assign((uint*)&tris[mesh.first_triangle], (uint*)&tris[mesh.first_triangle + mesh.num_triangles]);
+		batch.indices.assign((const uint*)&tris[mesh.first_triangle], (const uint*)&tris[mesh.first_triangle + mesh.num_triangles]);
 		string materialName = &str[mesh.material];
 		if (mtlMap.empty()) {
 			mtlMap[materialName] = 0;
@@ -314,79 +493,81 @@ bool Geometry::loadIqm(const string& path)
 			index -= mesh.first_vertex;
 		// Assign vertices
 		for (uint i = 0; i < header.num_vertexarrays; ++i) {
-			iqmvertexarray &va = vas[i];
+			const iqmvertexarray &va = vas[i];
 			switch (va.type) {
 				case IQM_POSITION:
-					iqmAssign(batch.positions, &data[0], IQM_FLOAT, 3, va, mesh);
+					iqmAssign(batch.positions, data, IQM_FLOAT, 3, va, mesh);
 					break;
 				case IQM_TEXCOORD:
-					iqmAssign(batch.texcoords, &data[0], IQM_FLOAT, 2, va, mesh);
+					iqmAssign(batch.texcoords, data, IQM_FLOAT, 2, va, mesh);
 					break;
 				case IQM_NORMAL:
-					iqmAssign(batch.normals, &data[0], IQM_FLOAT, 3, va, mesh);
+					iqmAssign(batch.normals, data, IQM_FLOAT, 3, va, mesh);
 					break;
 				case IQM_TANGENT:
-					iqmAssign(batch.tangents, &data[0], IQM_FLOAT, 3, va, mesh);
+					iqmAssign(batch.tangents, data, IQM_FLOAT, 4, va, mesh);
 					break;
 				case IQM_BLENDINDEXES:
-					iqmAssign(batch.boneindices, &data[0], IQM_UBYTE, 4, va, mesh);
+					iqmAssign(batch.boneindices, data, IQM_UBYTE, 4, va, mesh);
 					break;
 				case IQM_BLENDWEIGHTS:
-					iqmAssign(batch.boneweights, &data[0], IQM_UBYTE, 4, va, mesh);
+					iqmAssign(batch.boneweights, data, IQM_UBYTE, 4, va, mesh);
 					break;
 				case IQM_COLOR:
-					iqmAssign(batch.colors, &data[0], IQM_UBYTE, 4, va, mesh);
+					iqmAssign(batch.colors, data, IQM_UBYTE, 4, va, mesh);
 					break;
 			}
 		}
 	}
 
-	std::vector<mat3x4> inverseBones;
+	CompactAnimations anims;
 	bones.resize(header.num_joints);
 	boneParents.resize(header.num_joints);
-	inverseBones.resize(header.num_joints);
+	anims.inverseBones.resize(header.num_joints);
 	for (uint i = 0; i < header.num_joints; ++i) {
-		iqmjoint &j = joints[i];
+		const iqmjoint &j = joints[i];
 		boneParents[i] = j.parent;
 		quat rot = normalize(quat(j.rotate[3], j.rotate[0], j.rotate[1], j.rotate[2]));
 		vec3 scale(j.scale[0], j.scale[1], j.scale[2]);
 		vec3 transl(j.translate[0], j.translate[1], j.translate[2]);
 		bones[i] = jointToMatrix(rot, scale, transl);
-		inverseBones[i] = invert(bones[i]);
+		anims.inverseBones[i] = invert(bones[i]);
 		if (j.parent >= 0) {
 			bones[i] = multiplyBones(bones[j.parent], bones[i]);
-			inverseBones[i] = multiplyBones(inverseBones[i], inverseBones[j.parent]);
+			anims.inverseBones[i] = multiplyBones(anims.inverseBones[i], anims.inverseBones[j.parent]);
 		}
 	}
 
-	iqmanim* anims = (iqmanim*)&data[header.ofs_anims];
-	iqmpose* poses = (iqmpose*)&data[header.ofs_poses];
-	ushort* framedata = (ushort*)&data[header.ofs_frames];
-	animFrames.resize(header.num_frames * header.num_poses);
-
-	for (uint i = 0; i < header.num_frames; ++i) {
-		for (uint j = 0; j < header.num_poses; ++j) {
-			iqmpose &p = poses[j];
-			quat rotate;
-			vec3 translate, scale;
-			translate.x = p.channeloffset[0]; if (p.mask&0x01) translate.x += *framedata++ * p.channelscale[0];
-			translate.y = p.channeloffset[1]; if (p.mask&0x02) translate.y += *framedata++ * p.channelscale[1];
-			translate.z = p.channeloffset[2]; if (p.mask&0x04) translate.z += *framedata++ * p.channelscale[2];
-			rotate.x = p.channeloffset[3]; if (p.mask&0x08) rotate.x += *framedata++ * p.channelscale[3];
-			rotate.y = p.channeloffset[4]; if (p.mask&0x10) rotate.y += *framedata++ * p.channelscale[4];
-			rotate.z = p.channeloffset[5]; if (p.mask&0x20) rotate.z += *framedata++ * p.channelscale[5];
-			rotate.w = p.channeloffset[6]; if (p.mask&0x40) rotate.w += *framedata++ * p.channelscale[6];
-			scale.x = p.channeloffset[7]; if (p.mask&0x80) scale.x += *framedata++ * p.channelscale[7];
-			scale.y = p.channeloffset[8]; if (p.mask&0x100) scale.y += *framedata++ * p.channelscale[8];
-			scale.z = p.channeloffset[9]; if (p.mask&0x200) scale.z += *framedata++ * p.channelscale[9];
-			mat3x4 matrix = jointToMatrix(rotate, scale, translate);
-			if (p.parent >= 0) animFrames[i * header.num_poses + j] = multiplyBones(multiplyBones(bones[p.parent], matrix), inverseBones[j]);
-			else animFrames[i * header.num_poses + j] = multiplyBones(matrix, inverseBones[j]);
-		}
+	const iqmanim* iqmAnims = (const iqmanim*)&data[header.ofs_anims];
+	const iqmpose* poses = (const iqmpose*)&data[header.ofs_poses];
+	const ushort* framedata = (const ushort*)&data[header.ofs_frames];
+	// Every frame has the same channels, so frames can be decoded independently
+	anims.poses.resize(header.num_poses);
+	for (uint i = 0; i < header.num_poses; ++i) {
+		CompactAnimations::Pose& pose = anims.poses[i];
+		pose.parent = poses[i].parent;
+		pose.mask = poses[i].mask;
+		pose.firstChannel = anims.channelsPerFrame;
+		memcpy(pose.offset, poses[i].channeloffset, sizeof(pose.offset));
+		memcpy(pose.scale, poses[i].channelscale, sizeof(pose.scale));
+		for (uint c = 0; c < 10; ++c)
+			if (pose.mask & (1 << c))
+				++anims.channelsPerFrame;
+	}
+	ASSERT(header.num_frames * anims.channelsPerFrame == header.num_framechannels);
+
+	if (cvar_lazyAnimations() && header.num_frames) {
+		anims.channels.assign(framedata, framedata + header.num_frames * anims.channelsPerFrame);
+		m_compactAnims.reset(new CompactAnimations(std::move(anims)));
+	} else {
+		animFrames.resize(header.num_frames * header.num_poses);
+		Engine::threadpool().parallel_for(header.num_frames, 16, [&](uint begin, uint end) {
+			decodeAnimationFrames(anims, framedata, bones, begin, end - begin, animFrames.data() + begin * header.num_poses);
+		});
 	}
 
 	for (uint i = 0; i < header.num_anims; ++i) {
-		iqmanim &a = anims[i];
+		const iqmanim &a = iqmAnims[i];
 		Animation anim;
 		anim.frameRate = a.framerate;
 		anim.start = a.first_frame;
@@ -398,34 +579,385 @@ bool Geometry::loadIqm(const string& path)
 	return true;
 }
 
+const mat3x4* Geometry::animationFrames(uint index)
+{
+	ASSERT(index < animations.size());
+	Animation& anim = animations[index];
+	if (!animFrames.empty())
+		return animFrames.data() + anim.start * bones.size();
+	if (anim.frames.empty()) {
+		anim.frames.resize(anim.length * bones.size());
+		decodeAnimation(index, anim.frames.data());
+	}
+	return anim.frames.data();
+}
+
+void Geometry::decodeAnimation(uint index, mat3x4* out) const
+{
+	const Animation& anim = animations[index];
+	const uint numBones = bones.size();
+	// Compact data is kept until every clip has been compressed
+	if (m_compactAnims) {
+		const CompactAnimations& anims = *m_compactAnims;
+		Engine::threadpool().parallel_for(anim.length, 16, [&](uint begin, uint end) {
+			decodeAnimationFrames(anims, anims.channels.data(), bones, anim.start + begin, end - begin, out + begin * numBones);
+		});
+		return;
+	}
+	ASSERT(anim.compressed.numFrames == anim.length && m_inverseBones.size() == numBones);
+	kernels::AnimationPoses pose;
+	pose.resize(numBones, 1);
+	std::vector<ushort> cursors(anim.compressed.tracks.size());
+	std::vector<mat3x4> local(pose.stride);
+	for (uint f = 0; f < anim.length; ++f) {
+		kernels::sampleAnimation(anim.compressed, f, cursors.data(), pose.frame(0), pose.stride);
+		kernels::composePoses(pose.frame(0), pose.stride, local.data());
+		for (uint i = 0; i < numBones; ++i) {
+			mat3x4 frame = multiplyBones(local[i], m_inverseBones[i]);
+			out[f * numBones + i] = boneParents[i] >= 0 ? multiplyBones(bones[boneParents[i]], frame) : frame;
+		}
+	}
+}
+
+const kernels::AnimationPoses& Geometry::animationPoses(uint index)
+{
+	ASSERT(index < animations.size());
+	if (m_inverseBones.size() != bones.size()) {
+		m_inverseBones.resize(bones.size());
+		m_boneDepths.resize(bones.size());
+		for (uint i = 0; i < bones.size(); ++i) {
+			m_inverseBones[i] = invert(bones[i]);
+			m_boneDepths[i] = boneParents[i] >= 0 ? glm::min(m_boneDepths[boneParents[i]] + 1, 255) : 0;
+		}
+	}
+	Animation& anim = animations[index];
+	if (anim.poses.numFrames != anim.length)
+		kernels::decomposeAnimation(animationFrames(index), anim.length, bones.data(), boneParents.data(), bones.size(), anim.poses);
+	return anim.poses;
+}
+
+const kernels::CompressedAnimation& Geometry::compressedAnimation(uint index, float tolerance)
+{
+	ASSERT(index < animations.size());
+	Animation& anim = animations[index];
+	if (anim.compressed.numFrames != anim.length) {
+		const kernels::AnimationPoses& poses = animationPoses(index);
+		kernels::compressAnimation(poses, tolerance, anim.compressed);
+		logDebug("Compressed animation %s from %u to %u bytes", anim.name.c_str(),
+			(uint)(anim.length * bones.size() * sizeof(mat3x4)), (uint)anim.compressed.memoryUsage());
+		// Dense versions are decoded again from the compressed clip if something asks for them
+		std::vector<mat3x4>().swap(anim.frames);
+		anim.poses = kernels::AnimationPoses();
+		if (++m_compressedClips == animations.size()) {
+			std::vector<mat3x4>().swap(animFrames);
+			m_compactAnims.reset();
+		}
+	}
+	return anim.compressed;
+}
+
+bool Geometry::loadWmesh(const string& path)
+{
+	m_file.reset(new utils::MappedFile());
+	if (!m_file->open(path)) {
+		logError("Failed to open file %s", path.c_str());
+		m_file.reset();
+		return false;
+	}
+	const char* data = m_file->data();
+	size_t size = m_file->size();
+	auto inFile = [size](uint offset, size_t bytes) { return offset <= size && bytes <= size - offset; };
+	const WmeshHeader& header = *(const WmeshHeader*)data;
+	if (!inFile(0, sizeof(header)) || memcmp(header.magic, WMESH_MAGIC, sizeof(header.magic))) {
+		logError("File %s is not in wmesh format", path.c_str());
+		m_file.reset();
+		return false;
+	}
+	if (header.version != WMESH_VERSION || header.fileSize != size) {
+		logError("Unsupported wmesh version %u (expected %u) or truncated file %s", header.version, WMESH_VERSION, path.c_str());
+		m_file.reset();
+		return false;
+	}
+	const WmeshBatch* wbatches = (const WmeshBatch*)&data[header.ofsBatches];
+	const WmeshAnimation* wanims = (const WmeshAnimation*)&data[header.ofsAnimations];
+	bool valid = inFile(header.ofsBatches, header.numBatches * sizeof(WmeshBatch))
+		&& inFile(header.ofsBones, header.numBones * sizeof(mat3x4))
+		&& inFile(header.ofsBoneParents, header.numBones * sizeof(int))
+		&& inFile(header.ofsAnimFrames, header.numAnimFrames * sizeof(mat3x4))
+		&& inFile(header.ofsAnimations, header.numAnimations * sizeof(WmeshAnimation))
+		&& inFile(header.ofsText, 1) && data[size - 1] == '\0';
+	for (uint i = 0; valid && i < header.numBatches; ++i) {
+		const WmeshBatch& wb = wbatches[i];
+		valid = inFile(wb.ofsVertices, (size_t)wb.numVertices * wb.vertexSize)
+			&& inFile(wb.ofsIndices, (size_t)wb.numIndices * sizeof(uint))
+			&& wb.ofsIndices % sizeof(uint) == 0
+			&& inFile(header.ofsText, (size_t)wb.name + 1);
+		for (uint a = 0; valid && a < ATTR_MAX; ++a)
+			valid = attributeFits(wb.attributes[a], wb.vertexSize);
+		// Unpacking, collision meshes and tangents use the indices without checks
+		const uint* indices = (const uint*)&data[wb.ofsIndices];
+		for (uint j = 0; valid && j < wb.numIndices; ++j)
+			valid = indices[j] < wb.numVertices;
+	}
+	for (uint i = 0; valid && i < header.numAnimations; ++i) {
+		const WmeshAnimation& wa = wanims[i];
+		valid = inFile(header.ofsText, (size_t)wa.name + 1)
+			&& ((size_t)wa.start + wa.length) * header.numBones <= header.numAnimFrames;
+	}
+	if (!valid) {
+		logError("Corrupted wmesh file %s", path.c_str());
+		m_file.reset();
+		return false;
+	}
+	const char* text = &data[header.ofsText];
+
+	batches.resize(header.numBatches);
+	for (uint i = 0; i < header.numBatches; ++i) {
+		const WmeshBatch& wb = wbatches[i];
+		Batch& batch = batches[i];
+		batch.name = &text[wb.name];
+		batch.materialIndex = wb.materialIndex;
+		batch.numVertices = wb.numVertices;
+		batch.vertexSize = wb.vertexSize;
+		for (uint a = 0; a < ATTR_MAX; ++a) {
+			const WmeshAttribute& wa = wb.attributes[a];
+			batch.attributes[a].components = wa.components;
+			batch.attributes[a].type = wa.type;
+			batch.attributes[a].offset = wa.offset;
+			batch.attributes[a].normalized = wa.normalized;
+		}
+		batch.mappedVertices = &data[wb.ofsVertices];
+		if (wb.numIndices) {
+			batch.mappedIndices = (const uint*)&data[wb.ofsIndices];
+			batch.numIndices = wb.numIndices;
+		}
+	}
+
+	const mat3x4* wbones = (const mat3x4*)&data[header.ofsBones];
+	const int* wparents = (const int*)&data[header.ofsBoneParents];
+	const mat3x4* wframes = (const mat3x4*)&data[header.ofsAnimFrames];
+	bones.assign(wbones, wbones + header.numBones);
+	boneParents.assign(wparents, wparents + header.numBones);
+	animFrames.assign(wframes, wframes + header.numAnimFrames);
+	for (uint i = 0; i < header.numAnimations; ++i) {
+		Animation anim;
+		anim.start = wanims[i].start;
+		anim.length = wanims[i].length;
+		anim.frameRate = wanims[i].frameRate;
+		anim.name = &text[wanims[i].name];
+		animations.push_back(std::move(anim));
+	}
+
+	bounds.min = vec3(header.boundsMin[0], header.boundsMin[1], header.boundsMin[2]);
+	bounds.max = vec3(header.boundsMax[0], header.boundsMax[1], header.boundsMax[2]);
+	bounds.center = vec3(header.boundsCenter[0], header.boundsCenter[1], header.boundsCenter[2]);
+	bounds.radius = header.boundsRadius;
+	return true;
+}
+
+bool Geometry::saveWmesh(const string& path) const
+{
+	std::vector<char> data(sizeof(WmeshHeader));
+	string text(1, '\0'); // Offset 0 is the empty string
+	auto addString = [&text](const string& str) {
+		uint offset = text.size();
+		text.append(str.c_str(), str.size() + 1);
+		return offset;
+	};
+	auto addSection = [&data](const void* src, size_t bytes) {
+		data.resize((data.size() + 15) & ~size_t(15));
+		uint offset = data.size();
+		data.insert(data.end(), (const char*)src, (const char*)src + bytes);
+		return offset;
+	};
+
+	WmeshHeader header = {};
+	memcpy(header.magic, WMESH_MAGIC, sizeof(header.magic));
+	header.version = WMESH_VERSION;
+	header.numBatches = batches.size();
+	header.numBones = bones.size();
+	// Lazily decoded or compressed animations are written out in full so that loading stays a plain mapping
+	std::vector<mat3x4> decodedFrames;
+	if (animFrames.empty()) {
+		for (uint i = 0; i < animations.size(); ++i) {
+			const Animation& anim = animations[i];
+			decodedFrames.resize(std::max<size_t>(decodedFrames.size(), (anim.start + anim.length) * bones.size()));
+			decodeAnimation(i, &decodedFrames[anim.start * bones.size()]);
+		}
+	}
+	const std::vector<mat3x4>& frames = animFrames.empty() ? decodedFrames : animFrames;
+	header.numAnimFrames = frames.size();
+	header.numAnimations = animations.size();
+	memcpy(header.boundsMin, &bounds.min[0], sizeof(header.boundsMin));
+	memcpy(header.boundsMax, &bounds.max[0], sizeof(header.boundsMax));
+	memcpy(header.boundsCenter, &bounds.center[0], sizeof(header.boundsCenter));
+	header.boundsRadius = bounds.radius;
+
+	std::vector<WmeshBatch> wbatches(batches.size());
+	for (uint i = 0; i < batches.size(); ++i) {
+		const Batch& batch = batches[i];
+		WmeshBatch& wb = wbatches[i];
+		ASSERT(batch.vertexBufferSize() && "Batch attributes need to be set up before saving");
+		wb.name = addString(batch.name);
+		wb.materialIndex = batch.materialIndex;
+		wb.numVertices = batch.numVertices;
+		wb.vertexSize = batch.vertexSize;
+		wb.numIndices = batch.indexCount();
+		for (uint a = 0; a < ATTR_MAX; ++a) {
+			wb.attributes[a].components = batch.attributes[a].components;
+			wb.attributes[a].normalized = batch.attributes[a].normalized;
+			wb.attributes[a].type = batch.attributes[a].type;
+			wb.attributes[a].offset = batch.attributes[a].offset;
+		}
+		wb.ofsVertices = addSection(batch.vertexBuffer(), batch.vertexBufferSize());
+		wb.ofsIndices = addSection(batch.indexBuffer(), batch.indexCount() * sizeof(uint));
+	}
+	std::vector<WmeshAnimation> wanims(animations.size());
+	for (uint i = 0; i < animations.size(); ++i) {
+		wanims[i].name = addString(animations[i].name);
+		wanims[i].start = animations[i].start;
+		wanims[i].length = animations[i].length;
+		wanims[i].frameRate = animations[i].frameRate;
+	}
+	header.ofsBatches = addSection(wbatches.data(), wbatches.size() * sizeof(WmeshBatch));
+	header.ofsBones = addSection(bones.data(), bones.size() * sizeof(mat3x4));
+	header.ofsBoneParents = addSection(boneParents.data(), boneParents.size() * sizeof(int));
+	header.ofsAnimFrames = addSection(frames.data(), frames.size() * sizeof(mat3x4));
+	header.ofsAnimations = addSection(wanims.data(), wanims.size() * sizeof(WmeshAnimation));
+	header.ofsText = addSection(text.data(), text.size());
+	header.fileSize = data.size();
+	memcpy(&data[0], &header, sizeof(header));
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file.write(data.data(), data.size());
+	if (!file) {
+		logError("Failed to write %s", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void Geometry::releaseCpuData()
+{
+	// Procedural geometry could not be restored
+	if (residency == KEEP_ALL || path.empty() || m_released)
+		return;
+	for (auto& batch : batches) {
+		if (residency == KEEP_POSITIONS) {
+			batch.unpack();
+		} else {
+			releaseVector(batch.positions);
+			releaseVector(batch.positions2d);
+			releaseVector(batch.indices);
+		}
+		releaseVector(batch.texcoords);
+		releaseVector(batch.normals);
+		releaseVector(batch.tangents);
+		releaseVector(batch.boneindices);
+		releaseVector(batch.boneweights);
+		releaseVector(batch.colors);
+		releaseVector(batch.morphTargets);
+		releaseVector(batch.vertexData);
+		batch.mappedVertices = nullptr;
+		batch.mappedIndices = nullptr;
+	}
+	m_file.reset();
+	m_released = true;
+}
+
+bool Geometry::restoreCpuData()
+{
+	if (!m_released)
+		return true;
+	Geometry source(path);
+	if (source.batches.size() != batches.size()) {
+		logError("Failed to restore geometry data from %s", path.c_str());
+		return false;
+	}
+	for (uint i = 0; i < batches.size(); ++i) {
+		Batch& dst = batches[i];
+		Batch& src = source.batches[i];
+		dst.positions.swap(src.positions);
+		dst.positions2d.swap(src.positions2d);
+		dst.texcoords.swap(src.texcoords);
+		dst.normals.swap(src.normals);
+		dst.tangents.swap(src.tangents);
+		dst.boneindices.swap(src.boneindices);
+		dst.boneweights.swap(src.boneweights);
+		dst.colors.swap(src.colors);
+		dst.morphTargets.swap(src.morphTargets);
+		dst.indices.swap(src.indices);
+		dst.vertexData.swap(src.vertexData);
+		dst.mappedVertices = src.mappedVertices;
+		dst.mappedIndices = src.mappedIndices;
+	}
+	m_file.swap(source.m_file);
+	m_released = false;
+	return true;
+}
+
 void Geometry::calculateBoundingSphere()
 {
-	float maxRadiusSq = 0;
+	// Ritter's algorithm seeded with the most distant pair of axis extreme points
+	// (EPOS-6), compared against the box centered sphere as that is sometimes tighter
+	vec3 boxMin(INFINITY), boxMax(-INFINITY);
+	vec3 minPoints[3], maxPoints[3];
+	vec3 seedA(0.f), seedB(0.f);
+	float seedDistSq = -1.f;
+	for (auto& batch : batches) {
+		if (batch.positions.empty())
+			continue;
+		kernels::boundingBox(&batch.positions[0], batch.positions.size(), boxMin, boxMax);
+		kernels::extremePoints(&batch.positions[0], batch.positions.size(), minPoints, maxPoints);
+		for (int axis = 0; axis < 3; ++axis) {
+			float distSq = glm::distance2(minPoints[axis], maxPoints[axis]);
+			if (distSq > seedDistSq) {
+				seedDistSq = distSq;
+				seedA = minPoints[axis];
+				seedB = maxPoints[axis];
+			}
+		}
+	}
+	if (seedDistSq < 0) {
+		bounds.center = vec3(0, 0, 0);
+		bounds.radius = 0;
+		return;
+	}
+
+	vec3 center = (seedA + seedB) * 0.5f;
+	float radius = glm::sqrt(seedDistSq) * 0.5f;
 	for (auto& batch : batches)
-		for (auto& pos : batch.positions)
-			maxRadiusSq = glm::max(maxRadiusSq, glm::length2(pos));
-	bounds.radius = glm::sqrt(maxRadiusSq);
+		if (!batch.positions.empty())
+			kernels::growSphere(&batch.positions[0], batch.positions.size(), center, radius);
+
+	vec3 boxCenter = (boxMin + boxMax) * 0.5f;
+	float boxRadiusSq = 0;
+	for (auto& batch : batches)
+		if (!batch.positions.empty())
+			boxRadiusSq = glm::max(boxRadiusSq, kernels::maxDistanceSq(&batch.positions[0], batch.positions.size(), boxCenter));
+	float boxRadius = glm::sqrt(boxRadiusSq);
+
+	if (boxRadius < radius) {
+		center = boxCenter;
+		radius = boxRadius;
+	}
+	bounds.center = center;
+	bounds.radius = radius;
 }
 
 void Geometry::calculateBoundingBox()
 {
 	Bounds& bb = bounds;
-	bb.min = vec3();
-	bb.max = vec3();
+	bb.min = vec3(INFINITY, INFINITY, INFINITY);
+	bb.max = vec3(-INFINITY, -INFINITY, -INFINITY);
 
-	for (auto& batch : batches) {
-		auto& positions = batch.positions;
-		for (uint i = 0, len = positions.size(); i < len; ++i) {
-			float x = positions[i].x;
-			float y = positions[i].y;
-			float z = positions[i].z;
-			if (x < bb.min.x) bb.min.x = x;
-			else if ( x > bb.max.x ) bb.max.x = x;
-			if (y < bb.min.y) bb.min.y = y;
-			else if ( y > bb.max.y ) bb.max.y = y;
-			if (z < bb.min.z) bb.min.z = z;
-			else if (z > bb.max.z) bb.max.z = z;
-		}
+	for (auto& batch : batches)
+		if (!batch.positions.empty())
+			kernels::boundingBox(&batch.positions[0], batch.positions.size(), bb.min, bb.max);
+
+	if (bb.min.x > bb.max.x) {
+		bb.min = vec3(0, 0, 0);
+		bb.max = vec3(0, 0, 0);
 	}
 }
 
@@ -435,29 +967,132 @@ void Geometry::calculateNormals()
 		auto& indices = batch.indices;
 		auto& positions = batch.positions;
 		auto& normals = batch.normals;
-		// Indexed elements
-		if (!indices.empty()) {
-			// Reset existing normals
-			normals.clear();
-			normals.resize(positions.size());
-			for (uint i = 0, len = indices.size(); i < len; i += 3) {
-				vec3 normal = glm::triangleNormal(positions[indices[i]], positions[indices[i+1]], positions[indices[i+2]]);
-				normals[indices[i+0]] += normal;
-				normals[indices[i+1]] += normal;
-				normals[indices[i+2]] += normal;
-			}
-			normalizeNormals();
+		if (positions.empty())
+			continue;
+		// Reset existing normals
+		normals.clear();
+		normals.resize(positions.size());
+		// Indexed elements, area weighted average of adjacent face normals
+		if (!indices.empty())
+			kernels::accumulateFaceNormals(&positions[0], &indices[0], indices.size(), &normals[0]);
 		// Non-indexed elements
-		} else {
-			normals.resize(positions.size());
-			for (uint i = 0, len = positions.size(); i < len; i += 3) {
-				vec3 normal = glm::triangleNormal(positions[i], positions[i+1], positions[i+2]);
-				normals[i+0] = normal;
-				normals[i+1] = normal;
-				normals[i+2] = normal;
+		else kernels::faceNormals(&positions[0], positions.size(), &normals[0]);
+		kernels::normalize(&normals[0], normals.size());
+	}
+}
+
+// MikkTSpace style generation: corner tangents are angle weighted, orthogonalized against
+// the vertex normal and averaged per vertex. A vertex is only split when its corners
+// disagree on handedness or their tangent directions diverge too much.
+static void calculateIndexedTangents(Batch& batch)
+{
+	const float splitThresholdCos = 0.f; // Corners more than 90 degrees apart get their own vertex
+	const uint chunkSize = 4096;
+	auto& indices = batch.indices;
+	auto& positions = batch.positions;
+	auto& texcoords = batch.texcoords;
+	auto& normals = batch.normals;
+	uint numCorners = indices.size() - indices.size() % 3;
+	uint numVertices = positions.size();
+	thread_pool& pool = Engine::threadpool();
+
+	// Per corner tangents, triangles are independent
+	std::vector<TangentCorner> corners(numCorners);
+	pool.parallel_for(numCorners / 3, chunkSize, [&](uint begin, uint end) {
+		for (uint tri = begin; tri < end; ++tri) {
+			const uint* idx = &indices[tri * 3];
+			vec3 p[3] = { positions[idx[0]], positions[idx[1]], positions[idx[2]] };
+			vec2 uv[3] = { texcoords[idx[0]], texcoords[idx[1]], texcoords[idx[2]] };
+			vec3 n[3] = { normals[idx[0]], normals[idx[1]], normals[idx[2]] };
+			triangleTangents(p, uv, n, &corners[tri * 3]);
+		}
+	});
+
+	// Group corners by vertex
+	std::vector<uint> vertexStart(numVertices + 1, 0);
+	for (uint i = 0; i < numCorners; ++i)
+		vertexStart[indices[i] + 1]++;
+	for (uint v = 0; v < numVertices; ++v)
+		vertexStart[v + 1] += vertexStart[v];
+	std::vector<uint> slotCorner(numCorners);
+	{
+		std::vector<uint> fill(vertexStart.begin(), vertexStart.end() - 1);
+		for (uint i = 0; i < numCorners; ++i)
+			slotCorner[fill[indices[i]]++] = i;
+	}
+
+	// Cluster each vertex's corners, cluster sums are kept in the slot of their first corner
+	std::vector<uint> slotCluster(numCorners);
+	std::vector<vec4> clusterTangent(numCorners);
+	std::vector<uint> vertexClusters(numVertices, 0);
+	pool.parallel_for(numVertices, chunkSize, [&](uint begin, uint end) {
+		for (uint v = begin; v < end; ++v) {
+			uint first = vertexStart[v], last = vertexStart[v + 1];
+			uint firstCluster = last;
+			for (uint s = first; s < last; ++s) {
+				const TangentCorner& corner = corners[slotCorner[s]];
+				if (corner.sign == 0.f)
+					continue;
+				uint cluster = s;
+				for (uint c = first; c < s; ++c) {
+					if (slotCluster[c] != c || corners[slotCorner[c]].sign != corner.sign)
+						continue;
+					if (glm::dot(corners[slotCorner[c]].tangent, corner.tangent) > splitThresholdCos) {
+						cluster = c;
+						break;
+					}
+				}
+				slotCluster[s] = cluster;
+				if (cluster == s) {
+					clusterTangent[s] = vec4(0, 0, 0, corner.sign);
+					firstCluster = glm::min(firstCluster, s);
+					vertexClusters[v]++;
+				}
+				clusterTangent[cluster] += vec4(corner.tangent * corner.weight, 0);
+			}
+			// Degenerate UVs don't define a frame, let them join the first one
+			if (firstCluster == last && first != last) {
+				firstCluster = first;
+				clusterTangent[first] = vec4(anyPerpendicular(normals[v]), 1);
+				vertexClusters[v] = 1;
 			}
+			for (uint s = first; s < last; ++s)
+				if (corners[slotCorner[s]].sign == 0.f)
+					slotCluster[s] = firstCluster;
+		}
+	});
+
+	// Assign output vertices, first cluster keeps the original vertex
+	uint numSplits = 0;
+	for (uint v = 0; v < numVertices; ++v)
+		numSplits += glm::max(vertexClusters[v], 1u) - 1;
+	reserveVertices(batch, numVertices + numSplits);
+	batch.tangents.resize(numVertices + numSplits);
+	std::vector<uint> clusterVertex(numCorners);
+	for (uint v = 0; v < numVertices; ++v) {
+		if (vertexStart[v] == vertexStart[v + 1]) {
+			batch.tangents[v] = vec4(anyPerpendicular(normals[v]), 1);
+			continue;
+		}
+		bool firstCluster = true;
+		for (uint s = vertexStart[v], last = vertexStart[v + 1]; s < last; ++s) {
+			if (slotCluster[s] != s)
+				continue;
+			uint vertex = firstCluster ? v : duplicateVertex(batch, v);
+			firstCluster = false;
+			vec3 n = normals[v];
+			vec3 t = vec3(clusterTangent[s]);
+			t -= n * glm::dot(n, t);
+			float lenSq = glm::length2(t);
+			t = lenSq > 1e-12f ? t / glm::sqrt(lenSq) : anyPerpendicular(n);
+			batch.tangents[vertex] = vec4(t, clusterTangent[s].w);
+			clusterVertex[s] = vertex;
 		}
 	}
+	for (uint s = 0; s < numCorners; ++s)
+		indices[slotCorner[s]] = clusterVertex[slotCluster[s]];
+	if (numSplits)
+		logDebug("Split %d vertices for tangents in batch %s", numSplits, batch.name.c_str());
 }
 
 void Geometry::calculateTangents()
@@ -468,66 +1103,55 @@ void Geometry::calculateTangents()
 		auto& texcoords = batch.texcoords;
 		auto& normals = batch.normals;
 		auto& tangents = batch.tangents;
+		if (texcoords.size() != positions.size() || normals.size() != positions.size()) {
+			logWarning("Can't calculate tangents for batch %s without texcoords and normals", batch.name.c_str());
+			continue;
+		}
 		// Indexed elements
 		if (!indices.empty()) {
-			// Reset existing tangents
-			//tangents.clear();
-			//tangents.resize(positions.size());
-			ASSERT(!"Indexed tangents not implemented");
+			calculateIndexedTangents(batch);
 		// Non-indexed elements
 		} else {
-			std::vector<vec3> bitangents;
-			bitangents.resize(positions.size());
 			tangents.resize(positions.size());
 			for (uint i = 0, len = positions.size(); i < len; i += 3) {
-				// Edges of the triangle : postion delta
-				vec3 deltaPos1 = positions[i+1] - positions[i];
-				vec3 deltaPos2 = positions[i+2] - positions[i];
-
-				// UV delta
-				vec2 deltaUV1 = texcoords[i+1] - texcoords[i];
-				vec2 deltaUV2 = texcoords[i+2] - texcoords[i];
-
-				float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x);
-				vec3 tangent = (deltaPos1 * deltaUV2.y - deltaPos2 * deltaUV1.y) * r;
-				vec3 bitangent = (deltaPos2 * deltaUV1.x - deltaPos1 * deltaUV2.x) * r;
-
+				TangentCorner corners[3];
+				triangleTangents(&positions[i], &texcoords[i], &normals[i], corners);
 				for (int j = 0; j < 3; ++j) {
 					vec3 n = normals[i+j];
-					// Gram-Schmidt orthogonalize
-					vec3 t = glm::normalize(tangent - n * glm::dot(n, tangent));
-					// Calculate handedness
-					if (glm::dot(glm::cross(n, t), bitangent) < 0.0f)
-						t = t * -1.0f;
-					tangents[i+j] = t;
+					vec3 t = corners[j].sign != 0.f ? corners[j].tangent : anyPerpendicular(n);
+					tangents[i+j] = vec4(t, corners[j].sign < 0.f ? -1.f : 1.f);
 				}
 			}
 		}
 	}
-
 }
 
 void Geometry::normalizeNormals()
 {
 	for (auto& batch : batches)
-		for (auto& normal : batch.normals)
-			normal = glm::normalize(normal);
+		if (!batch.normals.empty())
+			kernels::normalize(&batch.normals[0], batch.normals.size());
 }
 
 void Geometry::applyMatrix(mat4 transform)
 {
 	mat3 normalTransform = mat3(glm::inverseTranspose(transform));
 	for (auto& batch : batches) {
-		for (auto& pos : batch.positions)
-			pos = vec3(transform * vec4(pos, 1.0f));
-		for (auto& normal : batch.normals)
-			normal = normalTransform * normal;
+		if (!batch.positions.empty())
+			kernels::transformPoints(&batch.positions[0], batch.positions.size(), transform);
+		if (!batch.normals.empty())
+			kernels::transformVectors(&batch.normals[0], batch.normals.size(), normalTransform);
 	}
 }
 
 void Geometry::generateCollisionTriMesh(bool deduplicateVertices)
 {
 	ASSERT(!collisionMesh);
+	bool release = m_released && residency == GPU_ONLY;
+	if (release)
+		restoreCpuData();
+	for (auto& batch : batches)
+		batch.unpack();
 	uint numVerts = 0;
 	for (auto& batch : batches) {
 		if (!batch.indices.empty()) numVerts += batch.indices.size();
@@ -555,6 +1179,8 @@ void Geometry::generateCollisionTriMesh(bool deduplicateVertices)
 			}
 		}
 	}
+	if (release)
+		releaseCpuData();
 }
 
 void Geometry::merge(const Geometry& geometry, vec3 offset, int materialIndexOffset)
@@ -576,6 +1202,74 @@ Batch::~Batch()
 	ASSERT(renderId == -1);
 }
 
+void Batch::append(const Batch& batch, const mat4& transform)
+{
+	ASSERT(positions2d.empty() && batch.positions2d.empty());
+	ASSERT(batch.boneindices.empty() && batch.boneweights.empty() && batch.morphTargets.empty());
+	ASSERT(positions.empty() || (texcoords.empty() == batch.texcoords.empty() && normals.empty() == batch.normals.empty()
+		&& tangents.empty() == batch.tangents.empty() && colors.empty() == batch.colors.empty()));
+	uint base = positions.size();
+	uint count = batch.positions.size();
+	if (!count)
+		return;
+	if (indices.empty() && base > 0) {
+		indices.resize(base);
+		for (uint i = 0; i < base; ++i)
+			indices[i] = i;
+	}
+
+	positions.insert(positions.end(), batch.positions.begin(), batch.positions.end());
+	kernels::transformPoints(&positions[base], count, transform);
+	texcoords.insert(texcoords.end(), batch.texcoords.begin(), batch.texcoords.end());
+	colors.insert(colors.end(), batch.colors.begin(), batch.colors.end());
+	if (!batch.normals.empty()) {
+		normals.insert(normals.end(), batch.normals.begin(), batch.normals.end());
+		kernels::transformVectors(&normals[base], count, mat3(glm::inverseTranspose(transform)));
+		kernels::normalize(&normals[base], count);
+	}
+	// Mirroring flips both the triangle winding and the bitangent
+	bool mirrored = glm::determinant(mat3(transform)) < 0.f;
+	if (!batch.tangents.empty()) {
+		mat3 tangentTransform(transform);
+		float sign = mirrored ? -1.f : 1.f;
+		tangents.reserve(tangents.size() + count);
+		for (const vec4& t : batch.tangents)
+			tangents.push_back(vec4(glm::normalize(tangentTransform * vec3(t)), t.w * sign));
+	}
+
+	uint first = indices.size();
+	if (batch.indices.empty()) {
+		indices.resize(first + count);
+		for (uint i = 0; i < count; ++i)
+			indices[first + i] = base + i;
+	} else {
+		indices.resize(first + batch.indices.size());
+		for (uint i = 0; i < batch.indices.size(); ++i)
+			indices[first + i] = base + batch.indices[i];
+	}
+	if (mirrored)
+		for (uint i = first; i + 2 < indices.size(); i += 3)
+			std::swap(indices[i + 1], indices[i + 2]);
+}
+
+void Batch::unpack()
+{
+	if (!mappedVertices || !positions.empty() || !positions2d.empty())
+		return;
+	if (attributes[ATTR_POSITION].components == 2)
+		unpackAttribute(positions2d, *this, ATTR_POSITION);
+	else unpackAttribute(positions, *this, ATTR_POSITION);
+	unpackAttribute(texcoords, *this, ATTR_TEXCOORD);
+	unpackAttribute(normals, *this, ATTR_NORMAL);
+	unpackAttribute(tangents, *this, ATTR_TANGENT);
+	unpackAttribute(colors, *this, ATTR_COLOR);
+	unpackAttribute(boneindices, *this, ATTR_BONE_INDEX);
+	unpackAttribute(boneweights, *this, ATTR_BONE_WEIGHT);
+	unpackAttribute(morphTargets, *this, ATTR_MORPH);
+	if (mappedIndices)
+		indices.assign(mappedIndices, mappedIndices + numIndices);
+}
+
 void Batch::setupAttributes()
 {
 	ASSERT(positions.empty() || positions2d.empty());
@@ -617,7 +1311,7 @@ void Batch::setupAttributes()
 	}
 	if (!tangents.empty()) {
 		Attribute& attr = attributes[ATTR_TANGENT];
-		attr.components = 3;
+		attr.components = 4;
 		attr.type = GL_FLOAT;
 		attr.offset = offset;
 		offset += sizeof(tangents[0]);
@@ -640,7 +1334,16 @@ void Batch::setupAttributes()
 		offset += sizeof(boneweights[0]);
 		dataArrays[ATTR_BONE_WEIGHT] = (char*)&boneweights[0];
 	}
+	if (!morphTargets.empty()) {
+		Attribute& attr = attributes[ATTR_MORPH];
+		attr.components = 4;
+		attr.type = GL_FLOAT;
+		attr.offset = offset;
+		offset += sizeof(morphTargets[0]);
+		dataArrays[ATTR_MORPH] = (char*)&morphTargets[0];
+	}
 	vertexSize = offset;
+	numIndices = indices.size();
 	vertexData.resize(numVertices * vertexSize);
 	for (uint i = 0; i < numVertices; ++i) {
 		char* dst = &vertexData[i * vertexSize];
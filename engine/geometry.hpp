@@ -1,6 +1,9 @@
 #pragma once
 #include "common.hpp"
 #include "components.hpp"
+#include "utils.hpp"
+#include "animationkernels.hpp"
+#include <memory>
 
 struct Image;
 
@@ -13,6 +16,7 @@ enum GeometryAttributeIndex {
 	ATTR_COLOR,
 	ATTR_BONE_INDEX,
 	ATTR_BONE_WEIGHT,
+	ATTR_MORPH,
 	ATTR_MAX
 };
 
@@ -22,6 +26,9 @@ struct Batch
 	~Batch();
 
 	void setupAttributes();
+	void unpack(); // Fills the attribute arrays from mapped vertex data
+	// Bakes the transform into a copy of the batch's vertices and appends them, result is indexed
+	void append(const Batch& batch, const mat4& transform);
 
 	struct Attribute {
 		int components = 0;
@@ -31,20 +38,30 @@ struct Batch
 	} attributes[ATTR_MAX];
 	int vertexSize = 0;
 	uint numVertices = 0;
+	uint numIndices = 0; // Counts remain valid after the CPU data has been released
 
 	std::vector<vec3> positions;
 	std::vector<vec2> positions2d;
 	std::vector<vec2> texcoords;
 	std::vector<vec3> normals;
-	std::vector<vec3> tangents;
+	std::vector<vec4> tangents; // w is bitangent sign: bitangent = w * cross(normal, tangent)
 	std::vector<u8vec4> boneindices;
 	std::vector<u8vec4> boneweights;
 	std::vector<u8vec4> colors;
+	std::vector<vec4> morphTargets; // Terrain LOD morph offset in xyz, LOD range in w
 	std::vector<uint> indices;
 	std::vector<char> vertexData;
+	// Interleaved vertices and indices mapped straight from a .wmesh file instead of the arrays above
+	const char* mappedVertices = nullptr;
+	const uint* mappedIndices = nullptr;
 	uint materialIndex = 0;
 	int renderId = -1;
 	string name;
+
+	const char* vertexBuffer() const { return mappedVertices ? mappedVertices : vertexData.data(); }
+	uint vertexBufferSize() const { return numVertices * vertexSize; }
+	const uint* indexBuffer() const { return mappedIndices ? mappedIndices : indices.data(); }
+	uint indexCount() const { return numIndices; }
 };
 
 
@@ -59,25 +76,63 @@ struct Geometry
 	void calculateBoundingSphere();
 	void calculateBoundingBox();
 	void calculateNormals();
-	void calculateTangents();
+	void calculateTangents(); // Indexed batches run on the engine thread pool, so an Engine must exist
 	void normalizeNormals();
 	void applyMatrix(mat4 transform);
 	void generateCollisionTriMesh(bool deduplicateVertices = true);
 	void merge(const Geometry& geometry, vec3 offset, int materialIndexOffset = 0);
+	bool saveWmesh(const string& path) const;
+
+	// What is kept in system memory after the geometry has been uploaded to the GPU
+	enum Residency {
+		KEEP_ALL,
+		KEEP_POSITIONS, // Positions and indices for physics and picking
+		GPU_ONLY
+	} residency = KEEP_ALL;
+	void releaseCpuData(); // Applies the residency policy, only for geometry loaded from a file
+	bool restoreCpuData(); // Reloads released data from the file
+	bool cpuDataReleased() const { return m_released; }
 
 	std::vector<Batch> batches;
+	string path; // Source file, empty for procedural geometry
 
 	struct Animation {
 		uint start = 0;
 		uint length = 0;
 		float frameRate = 1.f;
 		string name;
+		std::vector<mat3x4> frames; // Decoded on first use from compact animations
+		kernels::AnimationPoses poses; // Built on first use for the SoA evaluator
+		kernels::CompressedAnimation compressed; // Replaces the dense data once built
+	};
+
+	// Quantized IQM animation channels, kept instead of animFrames when decoding lazily
+	struct CompactAnimations {
+		struct Pose {
+			int parent;
+			uint mask;
+			uint firstChannel; // Within a frame
+			float offset[10];
+			float scale[10];
+		};
+		std::vector<Pose> poses;
+		std::vector<ushort> channels;
+		std::vector<mat3x4> inverseBones;
+		uint channelsPerFrame = 0;
 	};
 
 	std::vector<mat3x4> bones;
 	std::vector<mat3x4> animFrames;
 	std::vector<int> boneParents;
 	std::vector<Animation> animations;
+	// Skinning matrices for each bone of each frame of the animation
+	const mat3x4* animationFrames(uint index);
+	// Local bone poses of the animation, also sets up inverseBindPose() and boneDepths()
+	const kernels::AnimationPoses& animationPoses(uint index);
+	const std::vector<mat3x4>& inverseBindPose() const { return m_inverseBones; }
+	const std::vector<uint8>& boneDepths() const { return m_boneDepths; }
+	// Compresses the animation on first use and releases its dense frames and poses
+	const kernels::CompressedAnimation& compressedAnimation(uint index, float tolerance);
 
 	Bounds bounds;
 
@@ -86,6 +141,15 @@ struct Geometry
 private:
 	bool loadObj(const string& path);
 	bool loadIqm(const string& path);
+	bool loadWmesh(const string& path);
+	void decodeAnimation(uint index, mat3x4* out) const;
+
+	std::unique_ptr<utils::MappedFile> m_file; // Backs mapped batch data
+	bool m_released = false;
+	std::unique_ptr<CompactAnimations> m_compactAnims;
+	std::vector<mat3x4> m_inverseBones;
+	std::vector<uint8> m_boneDepths;
+	uint m_compressedClips = 0;
 };
 
 
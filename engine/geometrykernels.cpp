@@ -0,0 +1,240 @@
+#include "geometrykernels.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE_KERNELS 1
+#include <emmintrin.h>
+#endif
+
+namespace kernels {
+
+#ifdef USE_SSE_KERNELS
+namespace {
+	// Loads 4 packed vec3s (12 floats) and transposes them into x, y and z lanes
+	inline void load4(const vec3* p, __m128& x, __m128& y, __m128& z) {
+		const float* f = &p[0].x;
+		__m128 a = _mm_loadu_ps(f);     // x0 y0 z0 x1
+		__m128 b = _mm_loadu_ps(f + 4); // y1 z1 x2 y2
+		__m128 c = _mm_loadu_ps(f + 8); // z2 x3 y3 z3
+		__m128 t0 = _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 1, 3, 2)); // x2 y2 x3 y3
+		__m128 t1 = _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 0, 2, 1)); // y0 z0 y1 z1
+		x = _mm_shuffle_ps(a, t0, _MM_SHUFFLE(2, 0, 3, 0));
+		y = _mm_shuffle_ps(t1, t0, _MM_SHUFFLE(3, 1, 2, 0));
+		z = _mm_shuffle_ps(t1, c, _MM_SHUFFLE(3, 0, 3, 1));
+	}
+
+	// Inverse of load4
+	inline void store4(vec3* p, __m128 x, __m128 y, __m128 z) {
+		float* f = &p[0].x;
+		__m128 xy0 = _mm_unpacklo_ps(x, y); // x0 y0 x1 y1
+		__m128 xy1 = _mm_unpackhi_ps(x, y); // x2 y2 x3 y3
+		__m128 zx = _mm_shuffle_ps(z, x, _MM_SHUFFLE(1, 0, 0, 0)); // z0 z0 x0 x1
+		__m128 yz = _mm_shuffle_ps(y, z, _MM_SHUFFLE(1, 1, 1, 1)); // y1 y1 z1 z1
+		__m128 zx3 = _mm_shuffle_ps(z, x, _MM_SHUFFLE(3, 3, 2, 2)); // z2 z2 x3 x3
+		__m128 yz3 = _mm_shuffle_ps(y, z, _MM_SHUFFLE(3, 3, 3, 3)); // y3 y3 z3 z3
+		_mm_storeu_ps(f, _mm_shuffle_ps(xy0, zx, _MM_SHUFFLE(3, 0, 1, 0)));
+		_mm_storeu_ps(f + 4, _mm_shuffle_ps(yz, xy1, _MM_SHUFFLE(1, 0, 2, 0)));
+		_mm_storeu_ps(f + 8, _mm_shuffle_ps(zx3, yz3, _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+
+	inline float hmin(__m128 v) {
+		v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+		v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_cvtss_f32(v);
+	}
+
+	inline float hmax(__m128 v) {
+		v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+		v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+		return _mm_cvtss_f32(v);
+	}
+
+	inline __m128 distanceSq4(__m128 x, __m128 y, __m128 z, __m128 cx, __m128 cy, __m128 cz) {
+		__m128 dx = _mm_sub_ps(x, cx);
+		__m128 dy = _mm_sub_ps(y, cy);
+		__m128 dz = _mm_sub_ps(z, cz);
+		return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+	}
+}
+#endif
+
+void boundingBox(const vec3* points, uint count, vec3& min, vec3& max)
+{
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	if (count >= 4) {
+		__m128 minx = _mm_set1_ps(min.x), miny = _mm_set1_ps(min.y), minz = _mm_set1_ps(min.z);
+		__m128 maxx = _mm_set1_ps(max.x), maxy = _mm_set1_ps(max.y), maxz = _mm_set1_ps(max.z);
+		for (; i + 4 <= count; i += 4) {
+			__m128 x, y, z;
+			load4(&points[i], x, y, z);
+			minx = _mm_min_ps(minx, x); maxx = _mm_max_ps(maxx, x);
+			miny = _mm_min_ps(miny, y); maxy = _mm_max_ps(maxy, y);
+			minz = _mm_min_ps(minz, z); maxz = _mm_max_ps(maxz, z);
+		}
+		min = vec3(hmin(minx), hmin(miny), hmin(minz));
+		max = vec3(hmax(maxx), hmax(maxy), hmax(maxz));
+	}
+#endif
+	for (; i < count; ++i) {
+		min = glm::min(min, points[i]);
+		max = glm::max(max, points[i]);
+	}
+}
+
+void extremePoints(const vec3* points, uint count, vec3 minPoints[3], vec3 maxPoints[3])
+{
+	if (!count)
+		return;
+	uint minIndex[3] = { 0, 0, 0 };
+	uint maxIndex[3] = { 0, 0, 0 };
+	for (uint i = 1; i < count; ++i) {
+		const vec3& p = points[i];
+		for (int axis = 0; axis < 3; ++axis) {
+			if (p[axis] < points[minIndex[axis]][axis]) minIndex[axis] = i;
+			if (p[axis] > points[maxIndex[axis]][axis]) maxIndex[axis] = i;
+		}
+	}
+	for (int axis = 0; axis < 3; ++axis) {
+		minPoints[axis] = points[minIndex[axis]];
+		maxPoints[axis] = points[maxIndex[axis]];
+	}
+}
+
+void growSphere(const vec3* points, uint count, vec3& center, float& radius)
+{
+	auto grow = [&](const vec3& p) {
+		float distSq = glm::distance2(p, center);
+		if (distSq > radius * radius) {
+			float dist = glm::sqrt(distSq);
+			float newRadius = (radius + dist) * 0.5f;
+			center += (p - center) * ((newRadius - radius) / dist);
+			radius = newRadius;
+		}
+	};
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	// Quick reject of whole groups that are already inside, the actual growing is sequential
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		load4(&points[i], x, y, z);
+		__m128 distSq = distanceSq4(x, y, z, _mm_set1_ps(center.x), _mm_set1_ps(center.y), _mm_set1_ps(center.z));
+		if (!_mm_movemask_ps(_mm_cmpgt_ps(distSq, _mm_set1_ps(radius * radius))))
+			continue;
+		for (uint j = 0; j < 4; ++j)
+			grow(points[i + j]);
+	}
+#endif
+	for (; i < count; ++i)
+		grow(points[i]);
+}
+
+float maxDistanceSq(const vec3* points, uint count, vec3 center)
+{
+	float ret = 0;
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	if (count >= 4) {
+		__m128 cx = _mm_set1_ps(center.x), cy = _mm_set1_ps(center.y), cz = _mm_set1_ps(center.z);
+		__m128 maxDist = _mm_setzero_ps();
+		for (; i + 4 <= count; i += 4) {
+			__m128 x, y, z;
+			load4(&points[i], x, y, z);
+			maxDist = _mm_max_ps(maxDist, distanceSq4(x, y, z, cx, cy, cz));
+		}
+		ret = hmax(maxDist);
+	}
+#endif
+	for (; i < count; ++i)
+		ret = glm::max(ret, glm::distance2(points[i], center));
+	return ret;
+}
+
+void transformPoints(vec3* points, uint count, const mat4& transform)
+{
+	const mat4& m = transform;
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	__m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]), m02 = _mm_set1_ps(m[0][2]);
+	__m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]);
+	__m128 m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]), m22 = _mm_set1_ps(m[2][2]);
+	__m128 m30 = _mm_set1_ps(m[3][0]), m31 = _mm_set1_ps(m[3][1]), m32 = _mm_set1_ps(m[3][2]);
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		load4(&points[i], x, y, z);
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)), _mm_add_ps(_mm_mul_ps(m20, z), m30));
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)), _mm_add_ps(_mm_mul_ps(m21, z), m31));
+		__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, x), _mm_mul_ps(m12, y)), _mm_add_ps(_mm_mul_ps(m22, z), m32));
+		store4(&points[i], rx, ry, rz);
+	}
+#endif
+	for (; i < count; ++i)
+		points[i] = vec3(m * vec4(points[i], 1.0f));
+}
+
+void transformVectors(vec3* vectors, uint count, const mat3& transform)
+{
+	const mat3& m = transform;
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	__m128 m00 = _mm_set1_ps(m[0][0]), m01 = _mm_set1_ps(m[0][1]), m02 = _mm_set1_ps(m[0][2]);
+	__m128 m10 = _mm_set1_ps(m[1][0]), m11 = _mm_set1_ps(m[1][1]), m12 = _mm_set1_ps(m[1][2]);
+	__m128 m20 = _mm_set1_ps(m[2][0]), m21 = _mm_set1_ps(m[2][1]), m22 = _mm_set1_ps(m[2][2]);
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		load4(&vectors[i], x, y, z);
+		__m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m10, y)), _mm_mul_ps(m20, z));
+		__m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m01, x), _mm_mul_ps(m11, y)), _mm_mul_ps(m21, z));
+		__m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m02, x), _mm_mul_ps(m12, y)), _mm_mul_ps(m22, z));
+		store4(&vectors[i], rx, ry, rz);
+	}
+#endif
+	for (; i < count; ++i)
+		vectors[i] = m * vectors[i];
+}
+
+void normalize(vec3* vectors, uint count)
+{
+	uint i = 0;
+#ifdef USE_SSE_KERNELS
+	__m128 zero = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4) {
+		__m128 x, y, z;
+		load4(&vectors[i], x, y, z);
+		__m128 lenSq = distanceSq4(x, y, z, zero, zero, zero);
+		__m128 nonZero = _mm_cmpgt_ps(lenSq, zero);
+		// Full precision sqrt + div, rsqrt is not accurate enough for normals
+		__m128 invLen = _mm_and_ps(nonZero, _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(lenSq)));
+		invLen = _mm_or_ps(invLen, _mm_andnot_ps(nonZero, _mm_set1_ps(1.0f)));
+		store4(&vectors[i], _mm_mul_ps(x, invLen), _mm_mul_ps(y, invLen), _mm_mul_ps(z, invLen));
+	}
+#endif
+	for (; i < count; ++i) {
+		float lenSq = glm::length2(vectors[i]);
+		if (lenSq > 0)
+			vectors[i] /= glm::sqrt(lenSq);
+	}
+}
+
+void faceNormals(const vec3* positions, uint count, vec3* normals)
+{
+	for (uint i = 0; i + 2 < count; i += 3) {
+		vec3 normal = glm::cross(positions[i+1] - positions[i], positions[i+2] - positions[i]);
+		normals[i+0] = normal;
+		normals[i+1] = normal;
+		normals[i+2] = normal;
+	}
+}
+
+void accumulateFaceNormals(const vec3* positions, const uint* indices, uint numIndices, vec3* normals)
+{
+	// Scattered writes dominate here, so plain scalar code is as fast as it gets
+	for (uint i = 0; i + 2 < numIndices; i += 3) {
+		uint a = indices[i], b = indices[i+1], c = indices[i+2];
+		vec3 normal = glm::cross(positions[b] - positions[a], positions[c] - positions[a]);
+		normals[a] += normal;
+		normals[b] += normal;
+		normals[c] += normal;
+	}
+}
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "common.hpp"
+
+// Bulk vertex processing routines used by Geometry.
+// They work on tightly packed vec3 arrays (as stored in Batch) and process
+// four vertices at a time with SSE when available, falling back to scalar code.
+namespace kernels {
+
+	// Grows min / max to contain the points (initialize to +-INFINITY)
+	void boundingBox(const vec3* points, uint count, vec3& min, vec3& max);
+	// Points with smallest and largest coordinate on each axis (for sphere fitting)
+	void extremePoints(const vec3* points, uint count, vec3 minPoints[3], vec3 maxPoints[3]);
+	// Ritter's growing pass: enlarges the sphere until it contains all points
+	void growSphere(const vec3* points, uint count, vec3& center, float& radius);
+	float maxDistanceSq(const vec3* points, uint count, vec3 center);
+
+	void transformPoints(vec3* points, uint count, const mat4& transform);
+	void transformVectors(vec3* vectors, uint count, const mat3& transform);
+	void normalize(vec3* vectors, uint count); // Zero length vectors are left untouched
+
+	// Unnormalized face normals (length is twice the triangle area)
+	void faceNormals(const vec3* positions, uint count, vec3* normals);
+	void accumulateFaceNormals(const vec3* positions, const uint* indices, uint numIndices, vec3* normals);
+}
@@ -72,7 +72,8 @@ enum ShaderFeature {
 	USE_TANGENT = 1 << 19,
 	USE_VERTEX_COLOR = 1 << 20,
 	USE_PBR = 1 << 21,
-	NUM_SHADER_FEATURES = 22
+	USE_TERRAIN_MORPH = 1 << 22,
+	NUM_SHADER_FEATURES = 23
 };
 
 RenderDevice::RenderDevice(Resources& resources)
@@ -126,6 +127,7 @@ RenderDevice::RenderDevice(Resources& resources)
 	glGetIntegerv(GL_MAX_VARYING_VECTORS, &caps.maxVaryingVectors);
 	glGetIntegerv(GL_MAX_UNIFORM_BUFFER_BINDINGS, &caps.maxUniformBufferBindings);
 	glGetIntegerv(GL_MAX_SHADER_STORAGE_BUFFER_BINDINGS, &caps.maxShaderStorageBufferBindings);
+	glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &caps.maxVertexShaderStorageBlocks);
 	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &caps.maxComputeWorkGroupCount.x);
 	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 1, &caps.maxComputeWorkGroupCount.y);
 	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 2, &caps.maxComputeWorkGroupCount.z);
@@ -140,6 +142,10 @@ RenderDevice::RenderDevice(Resources& resources)
 		logInfo("No geometry shader support.");
 	if (!caps.tessellationShaders)
 		logInfo("No tessellation shader support.");
+	// Both stay zero without shader storage buffer support
+	caps.bonePalette = caps.maxVertexShaderStorageBlocks >= 3 && caps.maxShaderStorageBufferBindings > BINDING_SSBO_SKINNED_DRAW;
+	if (!caps.bonePalette)
+		logInfo("No bone palette support, skinned models are drawn one by one.");
 	if (!caps.computeShaders)
 		logInfo("No compute shader support.");
 	else logInfo("Compute limits: count %d %d %d; size %d %d %d; invocations %d",
@@ -225,6 +231,11 @@ RenderDevice::RenderDevice(Resources& resources)
 	m_cubeMatrixBlock.create();
 	m_skinningBlock.create();
 	m_postProcessBlock.create();
+	if (caps.bonePalette) {
+		m_bonePalette.create(true);
+		m_skinnedInstances.create(true);
+		m_skinnedDraw.create(true);
+	}
 }
 
 void RenderDevice::resizeRenderTargets(int mask)
@@ -428,7 +439,10 @@ int RenderDevice::generateShader(uint tags)
 	HANDLE_FEATURE(USE_TANGENT)
 	HANDLE_FEATURE(USE_VERTEX_COLOR)
 	HANDLE_FEATURE(USE_PBR)
+	HANDLE_FEATURE(USE_TERRAIN_MORPH)
 #undef HANDLE_FEATURE
+	if ((tags & USE_ANIMATION) && caps.bonePalette)
+		defineText += "#define USE_BONE_PALETTE 1\n";
 
 	defineText += m_resources.getText("shaders/uniforms.glsl", Resources::USE_CACHE);
 	defineText += "#line 1 1\n";
@@ -530,11 +544,11 @@ void RenderDevice::uploadBatch(const Batch& batch, GPUGeometry& outGeom)
 {
 	if (!outGeom.vao) glGenVertexArrays(1, &outGeom.vao);
 	if (!outGeom.vbo) glGenBuffers(1, &outGeom.vbo);
-	if (!outGeom.ebo && !batch.indices.empty()) glGenBuffers(1, &outGeom.ebo);
+	if (!outGeom.ebo && batch.indexCount()) glGenBuffers(1, &outGeom.ebo);
 	ASSERT(outGeom.vao && outGeom.vbo);
 	glBindVertexArray(outGeom.vao);
 	glBindBuffer(GL_ARRAY_BUFFER, outGeom.vbo);
-	glBufferData(GL_ARRAY_BUFFER, batch.vertexData.size(), &batch.vertexData.front(), GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, batch.vertexBufferSize(), batch.vertexBuffer(), GL_STATIC_DRAW);
 	// Setup attributes
 	for (int i = 0; i < ATTR_MAX; ++i) {
 		const Batch::Attribute& attr = batch.attributes[i];
@@ -548,7 +562,7 @@ void RenderDevice::uploadBatch(const Batch& batch, GPUGeometry& outGeom)
 	// Elements
 	if (outGeom.ebo) {
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, outGeom.ebo);
-		glBufferData(GL_ELEMENT_ARRAY_BUFFER, batch.indices.size() * sizeof(uint), &batch.indices.front(), GL_STATIC_DRAW);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, batch.indexCount() * sizeof(uint), batch.indexBuffer(), GL_STATIC_DRAW);
 	}
 	glBindVertexArray(0);
 }
@@ -559,6 +573,9 @@ bool RenderDevice::uploadGeometry(Geometry& geometry)
 		logError("Cannot upload empty geometry");
 		return false;
 	}
+	// Released after a previous upload, e.g. before the renderer was reset
+	if (!geometry.restoreCpuData())
+		return false;
 
 	for (auto& batch : geometry.batches) {
 		ASSERT(batch.renderId == -1);
@@ -567,6 +584,7 @@ bool RenderDevice::uploadGeometry(Geometry& geometry)
 		GPUGeometry& mesh = m_geometries.back();
 		uploadBatch(batch, mesh);
 	}
+	geometry.releaseCpuData();
 	return true;
 }
 
@@ -630,6 +648,8 @@ bool RenderDevice::uploadMaterial(Material& mat)
 		tag |= USE_SHADOW_MAP;
 	if (mat.flags & Material::ANIMATED)
 		tag |= USE_ANIMATION;
+	if (mat.flags & Material::TERRAIN_MORPH)
+		tag |= USE_TERRAIN_MORPH;
 	if (mat.alphaTest > 0.f)
 		tag |= USE_ALPHA_TEST;
 	if (mat.blendFunc != Material::BLEND_NONE)
@@ -686,6 +706,8 @@ bool RenderDevice::uploadMaterial(Material& mat)
 		tag = USE_DEPTH;
 		if (mat.flags & Material::ANIMATED)
 			tag |= USE_ANIMATION;
+		if (mat.flags & Material::TERRAIN_MORPH)
+			tag |= USE_TERRAIN_MORPH;
 		if (mat.alphaTest > 0.f)
 			tag |= USE_ALPHA_TEST | USE_DIFFUSE_MAP;
 		mat.shaderId[TECH_DEPTH] = generateShader(tag);
@@ -786,16 +808,16 @@ void RenderDevice::useMaterial(Material& mat)
 	m_materialBlock.upload();
 }
 
-void RenderDevice::drawSetup(const Transform& transform, const BoneAnimation* animation, int reflectionIndex)
+void RenderDevice::drawSetup(const mat4& modelMatrix, const BoneAnimation* animation, int reflectionIndex)
 {
-	m_objectBlock.uniforms.modelMatrix = transform.matrix;
+	m_objectBlock.uniforms.modelMatrix = modelMatrix;
 	mat4 modelView = m_commonBlock.uniforms.viewMatrix * m_objectBlock.uniforms.modelMatrix;
 	m_objectBlock.uniforms.modelViewMatrix = modelView;
 	m_objectBlock.uniforms.modelViewProjMatrix = m_commonBlock.uniforms.projectionMatrix * modelView;
 	m_objectBlock.uniforms.normalMatrix = glm::inverseTranspose(modelView);
 	if (m_tech == TECH_COLOR) {
 		for (int i = 0; i < MAX_SHADOW_MAPS; ++i) {
-			m_objectBlock.uniforms.shadowMatrices[i] = s_shadowBiasMatrix * (m_shadowProj[i] * (m_shadowView[i] * transform.matrix));
+			m_objectBlock.uniforms.shadowMatrices[i] = s_shadowBiasMatrix * (m_shadowProj[i] * (m_shadowView[i] * modelMatrix));
 		}
 	}
 	m_objectBlock.upload();
@@ -866,7 +888,12 @@ void RenderDevice::setupShadowPass(const Camera& camera, const Light& light)
 
 void RenderDevice::renderShadow(Model& model, Transform& transform, BoneAnimation* animation)
 {
-	drawSetup(transform, animation);
+	if (animation && animation->skinningInstance >= 0 && caps.bonePalette) {
+		uint instance = animation->skinningInstance;
+		renderSkinned(model, &instance, 1);
+		return;
+	}
+	drawSetup(transform.matrix, animation);
 
 	Geometry& geom = *model.geometry;
 	for (auto& batch : geom.batches) {
@@ -962,7 +989,12 @@ void RenderDevice::endTransparency()
 
 void RenderDevice::render(Model& model, Transform& transform, BoneAnimation* animation, int reflectionIndex)
 {
-	drawSetup(transform, animation, reflectionIndex);
+	if (animation && animation->skinningInstance >= 0 && caps.bonePalette) {
+		uint instance = animation->skinningInstance;
+		renderSkinned(model, &instance, 1, reflectionIndex);
+		return;
+	}
+	drawSetup(transform.matrix, animation, reflectionIndex);
 
 	bool refl = m_tech == TECH_REFLECTION;
 	Geometry& geom = *model.geometry;
@@ -979,10 +1011,76 @@ void RenderDevice::render(Model& model, Transform& transform, BoneAnimation* ani
 	glBindVertexArray(0);
 }
 
+void RenderDevice::beginSkinning()
+{
+	m_bonePalette.buffer.clear();
+	m_skinnedInstances.buffer.clear();
+}
+
+int RenderDevice::addSkinnedInstance(const mat4& modelMatrix, const mat3x4* bones, uint numBones)
+{
+	ASSERT(caps.bonePalette);
+	SkinnedInstanceData instance = {};
+	instance.modelMatrix = mat3x4(glm::transpose(modelMatrix));
+	instance.normalMatrix = mat3x4(glm::transpose(mat4(glm::inverseTranspose(mat3(modelMatrix)))));
+	instance.boneOffset = m_bonePalette.buffer.size();
+	if (bones)
+		m_bonePalette.buffer.insert(m_bonePalette.buffer.end(), bones, bones + numBones);
+	else m_bonePalette.buffer.resize(m_bonePalette.buffer.size() + numBones, mat3x4(1));
+	m_skinnedInstances.buffer.push_back(instance);
+	return m_skinnedInstances.buffer.size() - 1;
+}
+
+void RenderDevice::endSkinning()
+{
+	m_bonePalette.upload(true);
+	m_skinnedInstances.upload(true);
+}
+
+void RenderDevice::renderSkinned(Model& model, const uint* instances, uint count, int reflectionIndex)
+{
+	ASSERT(caps.bonePalette);
+	ASSERT(count);
+	m_skinnedDraw.buffer.assign(instances, instances + count);
+	m_skinnedDraw.upload(true);
+	bool shadow = m_tech == TECH_DEPTH || m_tech == TECH_DEPTH_CUBE;
+	bool refl = m_tech == TECH_REFLECTION;
+	bool identity = false;
+	Geometry& geom = *model.geometry;
+	for (auto& batch : geom.batches) {
+
+		ASSERT(batch.materialIndex < model.materials.size());
+		Material& mat = model.materials[batch.materialIndex];
+		if (shadow && !(mat.flags & Material::CAST_SHADOW))
+			continue;
+		if (refl && !(mat.flags & Material::DRAW_REFLECTION))
+			continue;
+
+		useMaterial(mat);
+		bool tessellate = m_tech == TECH_COLOR && (mat.flags & Material::TESSELLATE);
+		if (mat.flags & Material::ANIMATED) {
+			// Instance transforms are applied by the vertex shader
+			if (!identity)
+				drawSetup(mat4(1.f), nullptr, reflectionIndex);
+			identity = true;
+			drawBatch(batch, tessellate, count);
+		} else {
+			// Static parts of an animated model are drawn one at a time
+			for (uint i = 0; i < count; ++i) {
+				const mat3x4& m = m_skinnedInstances.buffer[instances[i]].modelMatrix;
+				drawSetup(glm::transpose(mat4(m[0], m[1], m[2], vec4(0, 0, 0, 1))), nullptr, reflectionIndex);
+				drawBatch(batch, tessellate);
+			}
+			identity = false;
+		}
+	}
+	glBindVertexArray(0);
+}
+
 void RenderDevice::renderParticles(Particles& particles, Transform& transform)
 {
 	ASSERT(particles.count);
-	drawSetup(transform);
+	drawSetup(transform.matrix);
 	useMaterial(particles.material);
 	bindParticleBuffers(particles);
 	ASSERT(m_particleRenderBuffer.vao);
@@ -999,7 +1097,7 @@ void RenderDevice::computeParticles(Particles& particles, Transform& transform)
 	const ShaderProgram& compShader = getProgram(particles.computeId);
 	compShader.use();
 
-	drawSetup(transform);
+	drawSetup(transform.matrix);
 
 	m_particleBlock.uniforms.emit = particles.emit ? 1.f : 0.f;
 	m_particleBlock.uniforms.emitRadiusMinMax = particles.emitRadiusMinMax;
@@ -1014,18 +1112,22 @@ void RenderDevice::computeParticles(Particles& particles, Transform& transform)
 	compShader.compute(particles.count / PARTICLE_GROUP_SIZE);
 }
 
-void RenderDevice::drawBatch(const Batch& batch, bool tessellate)
+void RenderDevice::drawBatch(const Batch& batch, bool tessellate, uint instances)
 {
 	ASSERT(batch.renderId >= 0);
 	GPUGeometry& gpuData = m_geometries[batch.renderId];
 	glBindVertexArray(gpuData.vao);
 	uint mode = tessellate ? GL_PATCHES : GL_TRIANGLES;
 	if (gpuData.ebo) {
-		glDrawElements(mode, batch.indices.size(), GL_UNSIGNED_INT, 0);
-		stats.triangles += batch.indices.size() / 3;
+		if (instances > 1)
+			glDrawElementsInstanced(mode, batch.indexCount(), GL_UNSIGNED_INT, 0, instances);
+		else glDrawElements(mode, batch.indexCount(), GL_UNSIGNED_INT, 0);
+		stats.triangles += batch.indexCount() / 3 * instances;
 	} else {
-		glDrawArrays(mode, 0, batch.numVertices);
-		stats.triangles += batch.numVertices / 3;
+		if (instances > 1)
+			glDrawArraysInstanced(mode, 0, batch.numVertices, instances);
+		else glDrawArrays(mode, 0, batch.numVertices);
+		stats.triangles += batch.numVertices / 3 * instances;
 	}
 	++stats.drawCalls;
 }
@@ -39,6 +39,16 @@ public:
 
 	void setupRenderPass(const Camera& camera, const std::vector<Light>& lights, Technique tech = TECH_COLOR, int fboIndex = 0);
 	void render(Model& model, Transform& transform, BoneAnimation* animation = nullptr, int reflectionIndex = 0);
+
+	// With caps.bonePalette, the bones of all animated models are uploaded once per frame
+	// and models sharing geometry and materials can be drawn with instancing.
+	// Instances are added between beginSkinning() and endSkinning(), without bones the
+	// bind pose is used. The index is stored in BoneAnimation::skinningInstance.
+	void beginSkinning();
+	int addSkinnedInstance(const mat4& modelMatrix, const mat3x4* bones, uint numBones);
+	void endSkinning();
+	// Draws instances in the current pass (shadow, reflection or color)
+	void renderSkinned(Model& model, const uint* instances, uint count, int reflectionIndex = 0);
 	void renderSkybox();
 	void postRender();
 
@@ -66,6 +76,7 @@ public:
 		bool computeShaders = false;
 		bool cubeFboAttachment = false;
 		bool gles = false;
+		bool bonePalette = false; // Shader storage buffers in vertex shaders
 		float maxAnisotropy = 0;
 		int maxSamples = 0;
 		int maxSamplers = 0;
@@ -73,6 +84,7 @@ public:
 		int maxVaryingVectors = 0;
 		int maxUniformBufferBindings = 0;
 		int maxShaderStorageBufferBindings = 0;
+		int maxVertexShaderStorageBlocks = 0;
 		ivec3 maxComputeWorkGroupCount = {0, 0, 0};
 		ivec3 maxComputeWorkGroupSize = {0, 0, 0};
 		int maxComputeWorkGroupInvocations = 0;
@@ -113,8 +125,8 @@ private:
 
 	int generateShader(uint tags);
 	void setupCubeMatrices(mat4 proj, vec3 pos);
-	void drawSetup(const Transform& transform, const BoneAnimation* animation = nullptr, int reflectionIndex = 0);
-	void drawBatch(const Batch& batch, bool tessellate = false);
+	void drawSetup(const mat4& modelMatrix, const BoneAnimation* animation = nullptr, int reflectionIndex = 0);
+	void drawBatch(const Batch& batch, bool tessellate = false, uint instances = 1);
 	void renderFullscreenQuad();
 
 	FBO m_msaaFbo = { "fbo_msaa" };
@@ -143,6 +155,9 @@ private:
 	UBO<UniformCubeMatrixBlock> m_cubeMatrixBlock;
 	UBO<UniformSkinningBlock> m_skinningBlock;
 	UBO<UniformPostProcessBlock> m_postProcessBlock;
+	SSBO<mat3x4> m_bonePalette = { BINDING_SSBO_BONE_PALETTE };
+	SSBO<SkinnedInstanceData> m_skinnedInstances = { BINDING_SSBO_SKINNED_INSTANCES };
+	SSBO<uint> m_skinnedDraw = { BINDING_SSBO_SKINNED_DRAW };
 	std::vector<ShaderProgram> m_shaders;
 	std::unordered_map<uint, int> m_shaderNames;
 	std::unordered_map<uint, int> m_shaderTags;
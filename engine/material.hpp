@@ -67,9 +67,30 @@ struct Material
 		RECEIVE_SHADOW = 1 << 3,
 		ANIMATED = 1 << 4,
 		DRAW_REFLECTION = 1 << 5,
+		TERRAIN_MORPH = 1 << 6,
 	};
 	uint flags = DIRTY_MAPS | CAST_SHADOW | RECEIVE_SHADOW | DRAW_REFLECTION;
 
 	int shaderId[NUM_TECHNIQUES] = { -1, -1, -1, -1, -1 }; // Automatic
 	string shaderName = "";
 };
+
+// Materials that render identically, so geometry using them can be drawn together
+inline bool sameMaterial(const Material& a, const Material& b) {
+	if (a.ambient != b.ambient || a.diffuse != b.diffuse || a.specular != b.specular || a.emissive != b.emissive)
+		return false;
+	if (a.metalness != b.metalness || a.roughness != b.roughness || a.shininess != b.shininess
+		|| a.reflectivity != b.reflectivity || a.parallax != b.parallax || a.alphaTest != b.alphaTest)
+		return false;
+	if (a.uvOffset != b.uvOffset || a.uvRepeat != b.uvRepeat || a.particleSize != b.particleSize)
+		return false;
+	if (a.blendFunc != b.blendFunc || a.lightingModel != b.lightingModel || a.flags != b.flags || a.shaderName != b.shaderName)
+		return false;
+	for (int i = 0; i < Material::MAX_MAPS; ++i)
+		if (a.map[i] != b.map[i] || a.tex[i] != b.tex[i])
+			return false;
+	for (int i = 0; i < NUM_TECHNIQUES; ++i)
+		if (a.shaderId[i] != b.shaderId[i])
+			return false;
+	return true;
+}
@@ -10,12 +10,12 @@ using json11::Json;
 using namespace utils;
 using namespace ecs;
 
+static CVar<int> cvar_reloadDelay("modules.reloadDelay", 500);
+
 #if (defined(_WIN32) && !defined(SHIPPING_BUILD))
 #define COPY_MODULE_DLLS 1
 #endif
-#ifdef COPY_MODULE_DLLS
-constexpr static char* s_hotloadFileSuffix = ".hotload.tmp.";
-#endif
+static const char* s_hotloadFileSuffix = ".hotload.tmp.";
 
 static inline string getPath(const string& moduleName)
 {
@@ -28,23 +28,20 @@ static inline string getPath(const string& moduleName)
 #endif
 }
 
-Module::Module(const string& moduleName)
+// A copy of the library is loaded if it needs to stay replaceable, e.g. while the old one is still in use
+static void* loadLibrary(const string& moduleName, bool copy, string& path)
 {
-	name = moduleName;
-
-#ifndef SHIPPING_BUILD
+	void* handle = nullptr;
 	int retries = 5;
-	string path = getPath(moduleName);
 
 	while (retries--) {
-
-#ifdef COPY_MODULE_DLLS
 		path = getPath(moduleName); // Reset
-		string runtimePath = path + s_hotloadFileSuffix + std::to_string(Engine::timems());
-		if (utils::copyFiles(path, runtimePath)) {
-			path = runtimePath;
-		} else logWarning("Failed to copy %s for loading as %s. Hotload will not work.", path.c_str(), runtimePath.c_str());
-#endif
+		if (copy) {
+			string runtimePath = path + s_hotloadFileSuffix + std::to_string(Engine::timems());
+			if (utils::copyFiles(path, runtimePath)) {
+				path = runtimePath;
+			} else logWarning("Failed to copy %s for loading as %s. Hotload will not work.", path.c_str(), runtimePath.c_str());
+		}
 
 		handle = SDL_LoadObject(path.c_str());
 		if (!handle && retries > 0) {
@@ -53,6 +50,20 @@ Module::Module(const string& moduleName)
 			utils::sleep(1000);
 		} else break;
 	}
+	return handle;
+}
+
+Module::Module(const string& moduleName)
+{
+	name = moduleName;
+	string path = getPath(moduleName);
+
+#ifndef SHIPPING_BUILD
+#ifdef COPY_MODULE_DLLS
+	handle = loadLibrary(moduleName, true, path);
+#else
+	handle = loadLibrary(moduleName, false, path);
+#endif
 #endif // SHIPPING_BUILD
 
 	if (!handle) {
@@ -79,6 +90,15 @@ Module::Module(const string& moduleName, ModuleFunc embeddedFunc)
 	logDebug("Loaded embedded module %s", moduleName.c_str());
 }
 
+Module::Module(const string& moduleName, void* loadedHandle, ModuleFunc loadedFunc, uint loadedMtime)
+{
+	name = moduleName;
+	handle = loadedHandle;
+	func = loadedFunc;
+	mtime = loadedMtime;
+	logDebug("Swapped in module %s", moduleName.c_str());
+}
+
 Module::~Module()
 {
 	if (handle) {
@@ -88,9 +108,34 @@ Module::~Module()
 	} else if (!embedded) logWarning("Invalid module handle when destructing %s", name.c_str());
 }
 
+ModuleSystem::~ModuleSystem()
+{
+	for (auto& it : modules)
+		unwatch(it.first);
+	if (m_loader.joinable()) {
+		Engine::fileWatcher().unwatch($id(ModuleSystem));
+		{
+			std::lock_guard<std::mutex> lock(m_loadMutex);
+			m_loaderQuit = true;
+		}
+		m_loadCondition.notify_all();
+		m_loader.join();
+	}
+	for (PreparedModule& prepared : m_prepared)
+		SDL_UnloadObject(prepared.handle);
+}
+
+// File watches of a module use its id as the owner, and must go before its code does
+void ModuleSystem::unwatch(uint module)
+{
+	auto it = modules.find(module);
+	if (it != modules.end() && !it->second.embedded)
+		Engine::fileWatcher().unwatch(module);
+}
+
 void ModuleSystem::cleanUpHotloadFiles()
 {
-#ifdef COPY_MODULE_DLLS
+#ifndef SHIPPING_BUILD
 	auto files = utils::findFiles(".", s_hotloadFileSuffix);
 	for (auto& file : files) {
 		if (!utils::deleteFile(file)) {
@@ -108,9 +153,13 @@ void ModuleSystem::registerEmbeddedModule(const std::string name, Module::Module
 void ModuleSystem::load(const Json& modulesDef, bool clear)
 {
 	if (clear) {
+		for (auto& it : modules)
+			unwatch(it.first);
 		modules.clear();
 		canReloadAnything = false;
+		updateSubscribers();
 	}
+	m_watchDirty = true;
 	if (modulesDef.is_array()) {
 		for (auto& it : modulesDef.array_items()) {
 			uint hash = id::hash(it.string_value());
@@ -118,11 +167,13 @@ void ModuleSystem::load(const Json& modulesDef, bool clear)
 			if (embedIt != embeddedModules.end()) {
 				if (modules.find(hash) == modules.end()) {
 					modules.emplace(hash, Module(it.string_value(), embedIt->second));
+					subscribe(hash);
 				} else logWarning("Module %s already loaded", it.string_value().c_str());
 				continue;
 			}
 			if (modules.emplace(hash, it.string_value()).second) {
 				canReloadAnything = true;
+				subscribe(hash);
 			} else logWarning("Module %s already loaded", it.string_value().c_str());
 		}
 	}
@@ -133,32 +184,141 @@ void ModuleSystem::reload(uint module, void* callbackParam)
 	const auto it = modules.find(module);
 	if (it != modules.end() && !it->second.embedded) {
 		string name = it->second.name;
+		unwatch(module);
 		modules.erase(it);
 		modules.emplace(module, name);
+		m_watchDirty = true;
+		subscribe(module);
 		call(module, $id(RELOAD), callbackParam);
 	}
 }
 
 bool ModuleSystem::autoReload(void* callbackParam)
 {
+#ifndef SHIPPING_BUILD
+	if (canReloadAnything && !m_loader.joinable()) {
+		m_loader = std::thread([this] {
+			std::unique_lock<std::mutex> lock(m_loadMutex);
+			while (true) {
+				m_loadCondition.wait(lock, [this]{ return m_loaderQuit || !m_loadQueue.empty(); });
+				if (m_loaderQuit)
+					return;
+				auto request = m_loadQueue.front();
+				m_loadQueue.erase(m_loadQueue.begin());
+				lock.unlock();
+				prepare(request.first, request.second);
+				lock.lock();
+			}
+		});
+	}
+	if (m_watchDirty && m_loader.joinable())
+		watchLibraries();
+#endif
+
+	std::vector<PreparedModule> prepared;
+	{
+		std::lock_guard<std::mutex> lock(m_loadMutex);
+		prepared.swap(m_prepared);
+	}
+	bool reloaded = false;
+	for (PreparedModule& it : prepared) {
+		auto old = modules.find(it.module);
+		if (old == modules.end() || old->second.embedded || it.mtime < old->second.mtime) {
+			SDL_UnloadObject(it.handle); // Unloaded or replaced meanwhile
+			continue;
+		}
+		string name = old->second.name;
+		unwatch(it.module);
+		modules.erase(old);
+		modules.emplace(std::piecewise_construct, std::forward_as_tuple(it.module),
+			std::forward_as_tuple(name, it.handle, it.func, it.mtime));
+		subscribe(it.module);
+		call(it.module, $id(RELOAD), callbackParam);
+		reloaded = true;
+	}
+	return reloaded;
+}
+
+void ModuleSystem::watchLibraries()
+{
+	FileWatcher& watcher = Engine::fileWatcher();
+	watcher.unwatch($id(ModuleSystem));
 	for (auto& it : modules) {
 		if (it.second.embedded)
 			continue;
-		string path = getPath(it.second.name);
-		if (timestamp(path) > it.second.mtime) {
-			sleep(500);
-			reload(it.first, callbackParam);
-			return true; // Iterators are now invalid
-		}
+		uint module = it.first;
+		string name = it.second.name;
+		watcher.watch(getPath(name), [this, module, name](const string&) {
+			{
+				std::lock_guard<std::mutex> lock(m_loadMutex);
+				m_loadQueue.emplace_back(module, name);
+			}
+			m_loadCondition.notify_one();
+		}, $id(ModuleSystem), cvar_reloadDelay());
+	}
+	m_watchDirty = false;
+}
+
+// Runs on the loader thread, loads a changed library while the old one is still in use
+// so that the main thread only needs to swap the function
+void ModuleSystem::prepare(uint module, const string& name)
+{
+	logDebug("Module %s change detected, loading...", name.c_str());
+	uint mtime = timestamp(getPath(name));
+	string path;
+	void* handle = loadLibrary(name, true, path);
+	if (!handle) {
+		logError("%s", SDL_GetError()); // SDL already produces a descriptive error
+		return;
+	}
+#ifndef COPY_MODULE_DLLS
+	if (path != getPath(name))
+		utils::deleteFile(path); // The loaded copy is not needed on disk
+#endif
+	Module::ModuleFunc func = (Module::ModuleFunc)SDL_LoadFunction(handle, "ModuleFunc");
+	if (!func) {
+		logError("%s (%s)", SDL_GetError(), path.c_str());
+		SDL_UnloadObject(handle);
+		return;
+	}
+	std::lock_guard<std::mutex> lock(m_loadMutex);
+	m_prepared.push_back({ module, handle, func, mtime });
+}
+
+void ModuleSystem::subscribe(uint module)
+{
+	Module& mod = modules.find(module)->second;
+	mod.subscriptions.clear();
+	if (mod.func) {
+		ModuleSubscriptions subs;
+		mod.func($id(SUBSCRIBE), &subs);
+		mod.subscriptions.assign(subs.messages, subs.messages + subs.count);
+	}
+	updateSubscribers();
+}
+
+void ModuleSystem::updateSubscribers()
+{
+	m_subscribers.clear();
+	m_unfiltered.clear();
+	for (auto& it : modules) {
+		if (it.second.subscriptions.empty())
+			m_unfiltered.push_back(it.first);
+		for (uint msg : it.second.subscriptions)
+			m_subscribers[msg].push_back(it.first);
 	}
-	return false;
 }
 
 void ModuleSystem::call(uint msg, void* param)
 {
-	for (auto& it : modules)
-		if (it.second.func && it.second.enabled)
-			it.second.func(msg, param);
+	// Modules are looked up by id, as a module might reload others
+	auto subscribers = m_subscribers.find(msg);
+	if (subscribers != m_subscribers.end()) {
+		for (uint i = 0; i < subscribers->second.size(); ++i)
+			call(subscribers->second[i], msg, param);
+	}
+	for (uint i = 0; i < m_unfiltered.size(); ++i)
+		call(m_unfiltered[i], msg, param);
 }
 
 void ModuleSystem::call(uint module, uint msg, void* param)
@@ -167,3 +327,48 @@ void ModuleSystem::call(uint module, uint msg, void* param)
 	if (it != modules.end() && it->second.func && it->second.enabled)
 		it->second.func(msg, param);
 }
+
+void ModuleSystem::enqueue(uint module, uint msg, const void* events, uint stride, uint count)
+{
+	if (!count)
+		return;
+	if (module ? !modules.count(module) : !m_subscribers.count(msg) && m_unfiltered.empty())
+		return; // Nobody to receive them
+	EventQueue* queue = nullptr;
+	for (EventQueue& q : m_queues) {
+		if (q.module == module && q.msg == msg) {
+			queue = &q;
+			break;
+		}
+	}
+	if (!queue) {
+		m_queues.push_back({ module, msg, stride, 0, {} });
+		queue = &m_queues.back();
+	}
+	ASSERT(queue->stride == stride && "Events of a message must be of the same type");
+	const char* bytes = static_cast<const char*>(events);
+	queue->data.insert(queue->data.end(), bytes, bytes + stride * count);
+	queue->count += count;
+}
+
+void ModuleSystem::dispatch()
+{
+	m_dispatching.swap(m_queues);
+	for (EventQueue& queue : m_dispatching) {
+		if (!queue.count)
+			continue;
+		ModuleEvents events;
+		events.count = queue.count;
+		events.stride = queue.stride;
+		events.data = queue.data.data();
+		if (queue.module)
+			call(queue.module, queue.msg, &events);
+		else call(queue.msg, &events);
+		queue.count = 0;
+		queue.data.clear();
+	}
+	// Reuse the emptied queues unless new events arrived during the dispatch
+	if (m_queues.empty())
+		m_queues.swap(m_dispatching);
+	else m_dispatching.clear();
+}
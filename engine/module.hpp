@@ -1,17 +1,46 @@
 #pragma once
 #include "common.hpp"
 #include <ecs/ecs.hpp>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace json11 {
 	class Json;
 }
 
 
+// Filled in by a module in response to $id(SUBSCRIBE), which is sent when it is loaded.
+// Broadcast messages only go to modules subscribed to them, modules subscribing to
+// nothing get all of them.
+struct ModuleSubscriptions {
+	enum { MAX_MESSAGES = 32 };
+	uint messages[MAX_MESSAGES];
+	uint count = 0;
+
+	void add(uint msg) { ASSERT(count < MAX_MESSAGES); messages[count++] = msg; }
+};
+
+// Param of messages queued with ModuleSystem::post(), holding all the events posted
+// with the message since the last dispatch in order
+struct ModuleEvents {
+	uint count = 0;
+	uint stride = 0;
+	const char* data = nullptr;
+
+	template<typename T> const T& get(uint index) const {
+		ASSERT(sizeof(T) == stride && index < count);
+		return *reinterpret_cast<const T*>(data + index * stride);
+	}
+};
+
 struct Module {
 	typedef void (*ModuleFunc)(uint msg, void* param);
 
 	Module(const string& name);
 	Module(const string& name, ModuleFunc embeddedFunc);
+	Module(const string& name, void* loadedHandle, ModuleFunc loadedFunc, uint loadedMtime); // Takes ownership of the handle
 	~Module();
 
 	ModuleFunc func = nullptr;
@@ -20,23 +49,78 @@ struct Module {
 	void* handle = nullptr;
 	uint mtime = 0;
 	string name;
+	std::vector<uint> subscriptions;
 };
 
 
 class ModuleSystem : public ecs::System
 {
 public:
+	~ModuleSystem();
+
 	static void cleanUpHotloadFiles();
 	void registerEmbeddedModule(const std::string name, Module::ModuleFunc func); // Only adds it to "search path", does not automatically "load" it so is not callable out-of-the-box (use "load" function as normal)
 	void load(const json11::Json& modules, bool clear = true);
 	void reload(uint module, void* callbackParam);
+	// Changed libraries are reported by the engine's FileWatcher and loaded on a loader
+	// thread, this only swaps in the ones that are ready and never waits for them
 	bool autoReload(void* callbackParam);
 
+	// Broadcasts to the modules subscribed to the message
 	void call(uint msg, void* param = nullptr);
+	// Calls one module whether it has subscribed to the message or not
 	void call(uint module, uint msg, void* param = nullptr);
 
+	// Queues events of a trivially copyable type for dispatch(), which delivers all events
+	// of a message in one call with ModuleEvents as the param. Events without a module are
+	// broadcast and dropped right away if nobody has subscribed to them.
+	template<typename T> void post(uint msg, const T& event) { post(0, msg, &event, 1); }
+	template<typename T> void post(uint module, uint msg, const T& event) { post(module, msg, &event, 1); }
+	template<typename T> void post(uint module, uint msg, const T* events, uint count) {
+		static_assert(std::is_trivially_copyable<T>::value, "Module events are copied as bytes");
+		enqueue(module, msg, events, sizeof(T), count);
+	}
+	// Events posted by the receivers wait for the next dispatch
+	void dispatch();
+
 	bool canReloadAnything = false;
 
 	std::unordered_map<uint, Module> modules = {};
 	std::unordered_map<uint, Module::ModuleFunc> embeddedModules = {};
+
+private:
+	struct EventQueue {
+		uint module;
+		uint msg;
+		uint stride;
+		uint count;
+		std::vector<char> data;
+	};
+
+	struct PreparedModule {
+		uint module;
+		void* handle;
+		Module::ModuleFunc func;
+		uint mtime;
+	};
+
+	void watchLibraries();
+	void unwatch(uint module);
+	void prepare(uint module, const string& name);
+	void subscribe(uint module);
+	void updateSubscribers();
+	void enqueue(uint module, uint msg, const void* events, uint stride, uint count);
+
+	std::unordered_map<uint, std::vector<uint>> m_subscribers; // Modules by message
+	std::vector<uint> m_unfiltered; // Modules that did not subscribe to anything
+	std::vector<EventQueue> m_queues;
+	std::vector<EventQueue> m_dispatching;
+
+	std::thread m_loader;
+	std::mutex m_loadMutex;
+	std::condition_variable m_loadCondition;
+	std::vector<std::pair<uint, string>> m_loadQueue; // Guarded by m_loadMutex
+	std::vector<PreparedModule> m_prepared; // Guarded by m_loadMutex
+	bool m_loaderQuit = false; // Guarded by m_loadMutex
+	bool m_watchDirty = true; // Main thread only
 };
@@ -3,34 +3,501 @@
 #include "geometry.hpp"
 #include "scene.hpp"
 #include "engine.hpp"
+#include "utils.hpp"
 #include "bullet/btBulletCollisionCommon.h"
 #include "bullet/btBulletDynamicsCommon.h"
+#include "bullet/BulletCollision/CollisionDispatch/btCollisionDispatcherMt.h"
+#include "bullet/BulletDynamics/Dynamics/btDiscreteDynamicsWorldMt.h"
+#include "bullet/BulletDynamics/ConstraintSolver/btSequentialImpulseConstraintSolverMt.h"
+#include "bullet/BulletCollision/CollisionShapes/btShapeHull.h"
+#include "bullet/LinearMath/btConvexHullComputer.h"
 
 using namespace ecs;
 
+static CVar<int> cvar_threaded("physics.threaded", 0);
+static CVar<float> cvar_rate("physics.rate", 60.f);
+static CVar<int> cvar_maxSteps("physics.maxSteps", 5);
+static CVar<int> cvar_interpolate("physics.interpolate", 1);
+static CVar<int> cvar_parallel("physics.parallel", 0);
+static CVar<int> cvar_bvhCache("physics.bvhCache", 0); // Writes next to the geometry files
+static CVar<int> cvar_hullCache("physics.hullCache", 0); // Writes next to the geometry files
+static CVar<float> cvar_hullConcavity("physics.hullConcavity", 0.02f); // Relative to the mesh size
+
+// Bullet's own bookkeeping for its task schedulers, not in the public headers
+void btPushThreadsAreRunning();
+void btPopThreadsAreRunning();
+
+namespace {
+
+	// Runs Bullet's parallel loops on the engine thread pool instead of threads of its own
+	class PoolTaskScheduler : public btITaskScheduler
+	{
+	public:
+		PoolTaskScheduler(): btITaskScheduler("ThreadPool") {}
+
+		// Bullet gives every thread entering its code an index of its own and sizes per thread
+		// data by this, so the pool size is not enough once the pool has been resized or
+		// steps run on the physics thread
+		int getMaxNumThreads() const override { return BT_MAX_THREAD_COUNT; }
+		int getNumThreads() const override { return BT_MAX_THREAD_COUNT; }
+		void setNumThreads(int) override {} // Follows Engine::threads
+
+		void parallelFor(int begin, int end, int grainSize, const btIParallelForBody& body) override {
+			if (end <= begin)
+				return;
+			btPushThreadsAreRunning();
+			Engine::threadpool().parallel_for(end - begin, grainSize, [&](uint first, uint last) {
+				body.forLoop(begin + first, begin + last);
+			});
+			btPopThreadsAreRunning();
+		}
+
+		btScalar parallelSum(int begin, int end, int grainSize, const btIParallelSumBody& body) override {
+			if (end <= begin)
+				return 0;
+			// Partial sums by chunk keep the result independent of scheduling
+			uint chunk = glm::max(grainSize, 1);
+			std::vector<btScalar> sums((end - begin + chunk - 1) / chunk, 0);
+			btPushThreadsAreRunning();
+			Engine::threadpool().parallel_for(end - begin, chunk, [&](uint first, uint last) {
+				sums[first / chunk] = body.sumLoop(begin + first, begin + last);
+			});
+			btPopThreadsAreRunning();
+			btScalar sum = 0;
+			for (btScalar s : sums)
+				sum += s;
+			return sum;
+		}
+	};
+
+	PoolTaskScheduler s_taskScheduler;
+
+	// Bodies store their entity in the user indices, the index in the first one
+	// and the version and world in the second, so that stale handles can be told apart
+	void setEntity(btCollisionObject& obj, Entity entity)
+	{
+		obj.setUserIndex(entity.get_index());
+		obj.setUserIndex2(entity.get_version() | entity.entities().get_world_index() << 16);
+	}
+
+	Entity entityOf(const btCollisionObject* obj)
+	{
+		int index = obj ? obj->getUserIndex() : -1;
+		if (index < 0)
+			return Entity();
+		uint bits = obj->getUserIndex2();
+		return Entity((Entity::Id)index, (Entity::Version)(bits & 0xffff), (Entity::WorldIndex)(bits >> 16));
+	}
+
+	// Marks bodies whose contacts are reported, a flag Bullet itself does not act on
+	const int CF_TRACK_CONTACTS = btCollisionObject::CF_HAS_COLLISION_SOUND_TRIGGER;
+
+	// System owning the bodies of the manifold if either of them tracks contacts
+	PhysicsSystem* trackingSystem(const btPersistentManifold& manifold)
+	{
+		const btCollisionObject* objA = manifold.getBody0();
+		const btCollisionObject* objB = manifold.getBody1();
+		if (!((objA->getCollisionFlags() | objB->getCollisionFlags()) & CF_TRACK_CONTACTS))
+			return nullptr;
+		return static_cast<PhysicsSystem*>(objA->getUserPointer() ? objA->getUserPointer() : objB->getUserPointer());
+	}
+
+	ContactEvent contactEvent(ContactEvent::Type type, const btPersistentManifold& manifold)
+	{
+		ContactEvent event;
+		event.type = type;
+		event.entityA = entityOf(manifold.getBody0());
+		event.entityB = entityOf(manifold.getBody1());
+		btScalar deepest = BT_LARGE_FLOAT;
+		for (int i = 0; i < manifold.getNumContacts(); ++i) {
+			const btManifoldPoint& pt = manifold.getContactPoint(i);
+			event.impulse += pt.getAppliedImpulse();
+			if (pt.getDistance() < deepest) {
+				deepest = pt.getDistance();
+				event.position = convert(pt.getPositionWorldOnB());
+				event.normal = convert(pt.m_normalWorldOnB);
+			}
+		}
+		return event;
+	}
+
+	struct QueryRayCallback : public btCollisionWorld::ClosestRayResultCallback
+	{
+		QueryRayCallback(const btVector3& from, const btVector3& to, const btCollisionObject* ignore)
+			: ClosestRayResultCallback(from, to), ignore(ignore) {}
+		bool needsCollision(btBroadphaseProxy* proxy) const override {
+			return proxy->m_clientObject != ignore && ClosestRayResultCallback::needsCollision(proxy);
+		}
+		const btCollisionObject* ignore;
+	};
+
+	struct QuerySweepCallback : public btCollisionWorld::ClosestConvexResultCallback
+	{
+		QuerySweepCallback(const btVector3& from, const btVector3& to, const btCollisionObject* ignore)
+			: ClosestConvexResultCallback(from, to), ignore(ignore) {}
+		bool needsCollision(btBroadphaseProxy* proxy) const override {
+			return proxy->m_clientObject != ignore && ClosestConvexResultCallback::needsCollision(proxy);
+		}
+		const btCollisionObject* ignore;
+	};
+
+	struct QueryOverlapCallback : public btCollisionWorld::ContactResultCallback
+	{
+		QueryOverlapCallback(const btCollisionObject* self, const btCollisionObject* ignore)
+			: self(self), ignore(ignore) {}
+		bool needsCollision(btBroadphaseProxy* proxy) const override {
+			return !object && proxy->m_clientObject != ignore && ContactResultCallback::needsCollision(proxy);
+		}
+		btScalar addSingleResult(btManifoldPoint& cp, const btCollisionObjectWrapper* wrap0, int, int,
+			const btCollisionObjectWrapper* wrap1, int, int) override
+		{
+			if (object || cp.getDistance() > 0.f)
+				return 0;
+			// The normal points from B to A
+			if (wrap0->getCollisionObject() == self) {
+				object = wrap1->getCollisionObject();
+				point = cp.getPositionWorldOnB();
+				normal = cp.m_normalWorldOnB;
+			} else {
+				object = wrap0->getCollisionObject();
+				point = cp.getPositionWorldOnA();
+				normal = -cp.m_normalWorldOnB;
+			}
+			return 0;
+		}
+		const btCollisionObject* self;
+		const btCollisionObject* ignore;
+		const btCollisionObject* object = nullptr;
+		btVector3 point, normal;
+	};
+
+	void runQuery(const btCollisionWorld& world, PhysicsQueryBatch& batch, uint i)
+	{
+		typedef PhysicsQueryBatch Q;
+		btTransform from(convert(batch.rotation[i]), convert(batch.from[i]));
+		btTransform to(convert(batch.rotation[i]), convert(batch.to[i]));
+		const btCollisionObject* hitObject = nullptr;
+		switch (batch.type[i]) {
+			case Q::RAY: {
+				QueryRayCallback res(from.getOrigin(), to.getOrigin(), batch.ignore[i]);
+				world.rayTest(from.getOrigin(), to.getOrigin(), res);
+				if ((hitObject = res.m_collisionObject)) {
+					batch.fraction[i] = res.m_closestHitFraction;
+					batch.point[i] = convert(res.m_hitPointWorld);
+					batch.normal[i] = convert(res.m_hitNormalWorld);
+				}
+				break;
+			}
+			case Q::SPHERE_SWEEP:
+			case Q::BOX_SWEEP: {
+				btSphereShape sphere(batch.extents[i].x);
+				btBoxShape box(convert(batch.extents[i]));
+				const btConvexShape* shape = batch.type[i] == Q::BOX_SWEEP ? (btConvexShape*)&box : &sphere;
+				QuerySweepCallback res(from.getOrigin(), to.getOrigin(), batch.ignore[i]);
+				world.convexSweepTest(shape, from, to, res);
+				if ((hitObject = res.m_hitCollisionObject)) {
+					batch.fraction[i] = res.m_closestHitFraction;
+					batch.point[i] = convert(res.m_hitPointWorld);
+					batch.normal[i] = convert(res.m_hitNormalWorld);
+				}
+				break;
+			}
+			case Q::SPHERE_OVERLAP:
+			case Q::BOX_OVERLAP: {
+				btSphereShape sphere(batch.extents[i].x);
+				btBoxShape box(convert(batch.extents[i]));
+				btCollisionObject obj;
+				obj.setCollisionShape(batch.type[i] == Q::BOX_OVERLAP ? (btCollisionShape*)&box : &sphere);
+				obj.setWorldTransform(from);
+				QueryOverlapCallback res(&obj, batch.ignore[i]);
+				// Adds and removes manifolds of the world's dispatcher, so never run in parallel
+				const_cast<btCollisionWorld&>(world).contactTest(&obj, res);
+				if ((hitObject = res.object)) {
+					batch.fraction[i] = 0.f;
+					batch.point[i] = convert(res.point);
+					batch.normal[i] = convert(res.normal);
+				}
+				break;
+			}
+		}
+		batch.hit[i] = hitObject != nullptr;
+		batch.object[i] = hitObject;
+		batch.entity[i] = entityOf(hitObject);
+	}
+
+	struct BvhCacheHeader {
+		char magic[4] = { 'W', 'B', 'V', 'H' };
+		uint version = 1;
+		uint meshHash = 0;
+		uint dataSize = 0;
+	};
+
+	// Identifies the triangles a saved BVH was built from
+	uint hashMesh(const btStridingMeshInterface& mesh)
+	{
+		uint h = 2166136261u;
+		auto hashBytes = [&h](const unsigned char* data, uint size) {
+			for (uint i = 0; i < size; ++i)
+				h = (h ^ data[i]) * 16777619u;
+		};
+		for (int part = 0; part < mesh.getNumSubParts(); ++part) {
+			const unsigned char* vertices;
+			const unsigned char* indices;
+			int numVertices, vertexStride, numFaces, indexStride;
+			PHY_ScalarType vertexType, indexType;
+			mesh.getLockedReadOnlyVertexIndexBase(&vertices, numVertices, vertexType, vertexStride,
+				&indices, indexStride, numFaces, indexType, part);
+			hashBytes(vertices, numVertices * vertexStride);
+			hashBytes(indices, numFaces * indexStride);
+			mesh.unLockReadOnlyVertexBase(part);
+		}
+		return h;
+	}
+
+	// Cached shapes own the children of their compounds
+	void deleteShape(const btCollisionShape* shape)
+	{
+		if (shape->isCompound()) {
+			const btCompoundShape* compound = static_cast<const btCompoundShape*>(shape);
+			for (int i = 0; i < compound->getNumChildShapes(); ++i)
+				delete compound->getChildShape(i);
+		}
+		delete shape;
+	}
+
+	struct TriangleCollector : public btInternalTriangleIndexCallback
+	{
+		void internalProcessTriangleIndex(btVector3* triangle, int, int) override {
+			points.push_back(triangle[0]);
+			points.push_back(triangle[1]);
+			points.push_back(triangle[2]);
+		}
+		btAlignedObjectArray<btVector3> points; // Three per triangle
+	};
+
+	struct ConvexPart {
+		std::vector<uint> triangles;
+		btAlignedObjectArray<btVector3> hull; // Simplified, relative to center
+		btVector3 center;
+		float concavity = 0.f;
+		bool splittable = true;
+	};
+
+	// Builds the simplified hull of the triangles and measures how far inside it the
+	// deepest triangle lies, which is zero for convex parts
+	void evaluatePart(const btAlignedObjectArray<btVector3>& points, ConvexPart& part)
+	{
+		btAlignedObjectArray<btVector3> partPoints;
+		partPoints.reserve(part.triangles.size() * 3);
+		for (uint t : part.triangles)
+			for (uint k = 0; k < 3; ++k)
+				partPoints.push_back(points[t * 3 + k]);
+		// The exact hull tells flat parts apart, as they have no volume to simplify
+		btConvexHullComputer exact;
+		exact.compute(&partPoints[0].x(), sizeof(btVector3), partPoints.size(), 0.f, 0.f);
+		// Without a margin, as it would inflate the hull and no part could get convex enough
+		btConvexHullShape full(&exact.vertices[0].x(), exact.vertices.size());
+		full.setMargin(0.f);
+		btShapeHull simplified(&full);
+		if (exact.faces.size() < 4 || !simplified.buildHull(0.f) || simplified.numVertices() == 0) {
+			// Flat, keep the corners of its outline
+			part.center.setZero();
+			for (int i = 0; i < exact.vertices.size(); ++i)
+				part.center += exact.vertices[i];
+			part.center /= btScalar(exact.vertices.size());
+			part.hull.resize(exact.vertices.size());
+			for (int i = 0; i < exact.vertices.size(); ++i)
+				part.hull[i] = exact.vertices[i] - part.center;
+			part.concavity = 0.f;
+			return;
+		}
+		const btVector3* vertices = simplified.getVertexPointer();
+		part.center.setZero();
+		for (int i = 0; i < simplified.numVertices(); ++i)
+			part.center += vertices[i];
+		part.center /= btScalar(glm::max(simplified.numVertices(), 1));
+		part.hull.resize(simplified.numVertices());
+		for (int i = 0; i < simplified.numVertices(); ++i)
+			part.hull[i] = vertices[i] - part.center;
+
+		btAlignedObjectArray<btVector4> planes;
+		const uint* indices = simplified.getIndexPointer();
+		for (int i = 0; i < simplified.numTriangles(); ++i) {
+			const btVector3& a = vertices[indices[i * 3]];
+			btVector3 normal = (vertices[indices[i * 3 + 1]] - a).cross(vertices[indices[i * 3 + 2]] - a);
+			if (normal.length2() < SIMD_EPSILON)
+				continue;
+			normal.normalize();
+			if (normal.dot(a - part.center) < 0)
+				normal = -normal;
+			planes.push_back(btVector4(normal.x(), normal.y(), normal.z(), normal.dot(a)));
+		}
+		// Distance from each triangle to the hull along its normal, taking the nearer direction
+		// as the winding is not known. Faces on the hull are at zero, those in dents are not.
+		part.concavity = 0.f;
+		for (int i = 0; i < partPoints.size(); i += 3) {
+			btVector3 center = (partPoints[i] + partPoints[i + 1] + partPoints[i + 2]) / 3;
+			btVector3 normal = (partPoints[i + 1] - partPoints[i]).cross(partPoints[i + 2] - partPoints[i]);
+			if (normal.length2() < SIMD_EPSILON)
+				continue;
+			normal.normalize();
+			btScalar front = BT_LARGE_FLOAT, back = BT_LARGE_FLOAT;
+			for (int j = 0; j < planes.size(); ++j) {
+				btScalar dist = btMax(planes[j].w() - planes[j].dot(center), btScalar(0));
+				btScalar cosine = planes[j].dot(normal);
+				if (cosine > SIMD_EPSILON)
+					front = btMin(front, dist / cosine);
+				else if (cosine < -SIMD_EPSILON)
+					back = btMin(back, dist / -cosine);
+			}
+			part.concavity = glm::max(part.concavity, (float)btMin(front, back));
+		}
+	}
+
+	// Halves the part at the mean triangle center along its longest axis
+	bool splitPart(const btAlignedObjectArray<btVector3>& points, const ConvexPart& part, ConvexPart& a, ConvexPart& b)
+	{
+		btVector3 bmin(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT), bmax = -bmin, mean(0, 0, 0);
+		for (uint t : part.triangles) {
+			btVector3 c = (points[t * 3] + points[t * 3 + 1] + points[t * 3 + 2]) / 3;
+			bmin.setMin(c);
+			bmax.setMax(c);
+			mean += c;
+		}
+		mean /= btScalar(part.triangles.size());
+		int axis = (bmax - bmin).maxAxis();
+		for (uint t : part.triangles) {
+			btScalar c = (points[t * 3][axis] + points[t * 3 + 1][axis] + points[t * 3 + 2][axis]) / 3;
+			(c < mean[axis] ? a : b).triangles.push_back(t);
+		}
+		return !a.triangles.empty() && !b.triangles.empty();
+	}
+
+	// Bullet rounds convex shapes by their collision margin, so the hull is shrunk by it
+	// to keep the surface where the mesh is. Flat hulls cannot shrink and keep the default.
+	btConvexHullShape* createHull(const btVector3* points, uint count)
+	{
+		btConvexHullComputer shrunk;
+		btScalar margin = shrunk.compute(&points[0].x(), sizeof(btVector3), count, CONVEX_DISTANCE_MARGIN, 0.25f);
+		if (margin <= 0.f || shrunk.vertices.size() == 0)
+			return new btConvexHullShape(&points[0].x(), count);
+		btConvexHullShape* hull = new btConvexHullShape(&shrunk.vertices[0].x(), shrunk.vertices.size());
+		hull->setMargin(margin);
+		return hull;
+	}
+
+	struct HullCacheHeader {
+		char magic[4] = { 'W', 'H', 'U', 'L' };
+		uint version = 2;
+		uint meshHash = 0;
+		uint maxHulls = 0;
+		float concavity = 0.f;
+		uint numHulls = 0;
+	};
+}
+
+uint PhysicsQueryBatch::add(Type t, vec3 a, vec3 b, vec3 ext, quat rot, const btCollisionObject* ign)
+{
+	type.push_back(t);
+	from.push_back(a);
+	to.push_back(b);
+	extents.push_back(ext);
+	rotation.push_back(rot);
+	ignore.push_back(ign);
+	return type.size() - 1;
+}
+
+uint PhysicsQueryBatch::addRay(vec3 from, vec3 to, const btCollisionObject* ignore)
+{
+	return add(RAY, from, to, vec3(0.f), quat_identity, ignore);
+}
+
+uint PhysicsQueryBatch::addSphereSweep(vec3 from, vec3 to, float radius, const btCollisionObject* ignore)
+{
+	return add(SPHERE_SWEEP, from, to, vec3(radius), quat_identity, ignore);
+}
+
+uint PhysicsQueryBatch::addBoxSweep(vec3 from, vec3 to, vec3 halfExtents, quat rotation, const btCollisionObject* ignore)
+{
+	return add(BOX_SWEEP, from, to, halfExtents, rotation, ignore);
+}
+
+uint PhysicsQueryBatch::addSphereOverlap(vec3 center, float radius, const btCollisionObject* ignore)
+{
+	return add(SPHERE_OVERLAP, center, center, vec3(radius), quat_identity, ignore);
+}
+
+uint PhysicsQueryBatch::addBoxOverlap(vec3 center, vec3 halfExtents, quat rotation, const btCollisionObject* ignore)
+{
+	return add(BOX_OVERLAP, center, center, halfExtents, rotation, ignore);
+}
+
+void PhysicsQueryBatch::clear()
+{
+	type.clear();
+	from.clear();
+	to.clear();
+	extents.clear();
+	rotation.clear();
+	ignore.clear();
+}
+
 PhysicsSystem::PhysicsSystem()
 {
+	createWorld();
+}
+
+PhysicsSystem::~PhysicsSystem()
+{
+	stopThread();
+	reset();
+	destroyWorld();
+}
+
+void PhysicsSystem::createWorld()
+{
+	m_parallel = cvar_parallel();
 	collisionConfiguration = new btDefaultCollisionConfiguration();
-	dispatcher = new btCollisionDispatcher(collisionConfiguration);
 	broadphase = new btDbvtBroadphase();
-	solver = new btSequentialImpulseConstraintSolver();
-	dynamicsWorld = new btDiscreteDynamicsWorld(dispatcher, broadphase, solver, collisionConfiguration);
+	if (m_parallel) {
+		// Must be in place before the dispatcher is created
+		btSetTaskScheduler(&s_taskScheduler);
+		dispatcher = new btCollisionDispatcherMt(collisionConfiguration);
+		solver = new btConstraintSolverPoolMt(Engine::threadpool().size() + 1);
+		m_solverMt = new btSequentialImpulseConstraintSolverMt();
+		dynamicsWorld = new btDiscreteDynamicsWorldMt(dispatcher, broadphase,
+			static_cast<btConstraintSolverPoolMt*>(solver), m_solverMt, collisionConfiguration);
+	} else {
+		dispatcher = new btCollisionDispatcher(collisionConfiguration);
+		solver = new btSequentialImpulseConstraintSolver();
+		dynamicsWorld = new btDiscreteDynamicsWorld(dispatcher, broadphase, solver, collisionConfiguration);
+	}
 	dynamicsWorld->setGravity(convert(-9.81f * up_axis));
+	gContactStartedCallback = contactStarted;
+	gContactEndedCallback = contactEnded;
+	logDebug("Created %s physics world", m_parallel ? "parallel" : "single threaded");
 }
 
-PhysicsSystem::~PhysicsSystem()
+void PhysicsSystem::destroyWorld()
 {
-	reset();
 	delete dynamicsWorld;
+	delete m_solverMt;
 	delete solver;
 	delete broadphase;
 	delete dispatcher;
 	delete collisionConfiguration;
+	dynamicsWorld = nullptr;
+	m_solverMt = nullptr;
 }
 
 void PhysicsSystem::reset()
 {
 	ASSERT(dynamicsWorld);
+	wait();
+	m_commands.clear();
+	m_moving.clear();
+	m_accumulator = 0.f;
+	m_stepped = false;
 	for (int i = dynamicsWorld->getNumConstraints() - 1; i >= 0; i--)
 	{
 		dynamicsWorld->removeConstraint(dynamicsWorld->getConstraint(i));
@@ -42,6 +509,7 @@ void PhysicsSystem::reset()
 		if (body && body->getMotionState())
 		{
 			delete body->getMotionState();
+			body->setMotionState(nullptr);
 		}
 		dynamicsWorld->removeCollisionObject(obj);
 	}
@@ -51,119 +519,681 @@ void PhysicsSystem::reset()
 		delete shape;
 	}
 	collisionShapes.clear();
+	clearShapes();
+	m_started.clear();
+	m_touching.clear();
+	m_pendingContacts.clear();
+	m_contacts.clear();
+	m_simulated = false;
+	if (m_parallel != (cvar_parallel() != 0)) {
+		destroyWorld();
+		createWorld();
+	}
 }
 
-void PhysicsSystem::step(Entities& entities, float dt, bool fixedStep)
+void PhysicsSystem::startThread()
 {
-	// Update manual transform changes to physics
-	entities.for_each<RigidBody, Transform>([](Entity, RigidBody& body, Transform& transform) {
-		if (transform.dirty) {
-			btTransform trans(convert(transform.rotation), convert(transform.position));
-			body.body->setCenterOfMassTransform(trans);
+	m_quit = false;
+	m_thread = std::thread([this] {
+		while (true) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]{ return m_quit || m_stepPending; });
+			if (m_quit)
+				return;
+			lock.unlock();
+			simulate(m_stepDt, m_stepCount);
+			lock.lock();
+			m_stepPending = false;
+			m_condition.notify_all();
 		}
 	});
-	entities.for_each<ContactTracker>([&](Entity, ContactTracker& tracker) {
-		tracker.hadContact = false;
-	});
+}
 
-	// Simulate
+void PhysicsSystem::stopThread()
+{
+	if (!m_thread.joinable())
+		return;
+	wait();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_condition.notify_all();
+	m_thread.join();
+}
+
+void PhysicsSystem::wait()
+{
+	if (!m_inFlight)
+		return;
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_condition.wait(lock, [this]{ return !m_stepPending; });
+	m_inFlight = false;
+}
+
+void PhysicsSystem::enqueue(Command command)
+{
+	if (m_inFlight)
+		m_commands.emplace_back(std::move(command));
+	else command(*this);
+}
+
+// Runs on the physics thread in threaded mode, must not touch entities
+void PhysicsSystem::simulate(float dt, int steps)
+{
 	ASSERT(dynamicsWorld);
-	int maxSteps = fixedStep ? 5 : 0;
-	dynamicsWorld->stepSimulation(dt, maxSteps);
-
-	// Sync physics results to entity transforms
-	entities.for_each<RigidBody, Transform>([](Entity, RigidBody& body, Transform& transform) {
-		const btTransform& trans = body.body->getCenterOfMassTransform();
-		transform.position = convert(trans.getOrigin());
-		transform.rotation = convert(trans.getRotation());
+	uint firstStep = m_clock + 1;
+	for (int i = 0; i < steps; ++i) {
+		++m_clock;
+		// Without substeps Bullet takes exactly one step of dt and
+		// passes the resulting poses to the motion states
+		dynamicsWorld->stepSimulation(dt, 0);
+		reportContacts();
+	}
+	if (steps > 0) {
+		// Pairs that began during an earlier frame and still touch
+		for (auto& it : m_touching) {
+			TouchingPair& pair = it.second;
+			if (!pair.reported || pair.since >= firstStep)
+				continue;
+			m_pendingContacts.push_back(contactEvent(ContactEvent::PERSIST, *it.first));
+			pair.position = m_pendingContacts.back().position;
+			pair.normal = m_pendingContacts.back().normal;
+		}
+		m_stepped = true;
+	}
+	m_simulated = true;
+}
+
+// Pairs that began during the step, now that the solver has given them impulses
+void PhysicsSystem::reportContacts()
+{
+	for (const btPersistentManifold* manifold : m_started) {
+		auto it = m_touching.find(manifold);
+		if (it == m_touching.end() || it->second.reported)
+			continue; // Already ended or a duplicate
+		TouchingPair& pair = it->second;
+		m_pendingContacts.push_back(contactEvent(ContactEvent::BEGIN, *manifold));
+		pair.position = m_pendingContacts.back().position;
+		pair.normal = m_pendingContacts.back().normal;
+		pair.reported = true;
+	}
+	m_started.clear();
+}
+
+void PhysicsSystem::contactStarted(btPersistentManifold* const& manifold)
+{
+	PhysicsSystem* system = trackingSystem(*manifold);
+	if (!system)
+		return;
+	std::lock_guard<std::mutex> lock(system->m_contactMutex);
+	TouchingPair& pair = system->m_touching[manifold];
+	pair = TouchingPair();
+	pair.since = system->m_clock;
+	system->m_started.push_back(manifold);
+}
+
+void PhysicsSystem::contactEnded(btPersistentManifold* const& manifold)
+{
+	PhysicsSystem* system = trackingSystem(*manifold);
+	if (!system)
+		return;
+	std::lock_guard<std::mutex> lock(system->m_contactMutex);
+	auto it = system->m_touching.find(manifold);
+	if (it == system->m_touching.end())
+		return;
+	if (it->second.reported) {
+		// The contact points are gone or about to be, so report where the pair last touched
+		ContactEvent event;
+		event.type = ContactEvent::END;
+		event.entityA = entityOf(manifold->getBody0());
+		event.entityB = entityOf(manifold->getBody1());
+		event.position = it->second.position;
+		event.normal = it->second.normal;
+		system->m_pendingContacts.push_back(event);
+	}
+	system->m_touching.erase(it);
+}
+
+void PhysicsSystem::step(Entities& entities, float dt, bool fixedStep)
+{
+	sync(entities);
+	int steps = 1;
+	if (fixedStep) {
+		float stepDt = 1.f / glm::max(cvar_rate(), 1.f);
+		m_accumulator += dt;
+		steps = (int)(m_accumulator / stepDt);
+		m_accumulator -= steps * stepDt;
+		if (steps > cvar_maxSteps()) {
+			// Drop the time we cannot catch up with instead of falling further behind
+			steps = glm::max(cvar_maxSteps(), 1);
+			m_accumulator = 0.f;
+		}
+		m_alpha = cvar_interpolate() ? m_accumulator / stepDt : 1.f;
+		dt = stepDt;
+	} else {
+		m_accumulator = 0.f;
+		m_alpha = 1.f;
+	}
+	if (!cvar_threaded()) {
+		stopThread();
+		simulate(dt, steps);
+		sync(entities);
+		return;
+	}
+	if (!m_thread.joinable())
+		startThread();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stepDt = dt;
+		m_stepCount = steps;
+		m_stepPending = true;
+	}
+	m_inFlight = true;
+	m_condition.notify_all();
+}
+
+void PhysicsSystem::sync(Entities& entities)
+{
+	wait();
+	for (Command& command : m_commands)
+		command(*this);
+	m_commands.clear();
+
+	// Update manual transform changes to physics
+	entities.for_each<RigidBody, Transform>([this](Entity, RigidBody& body, Transform& transform) {
+		if (!transform.dirty)
+			return;
+		btTransform trans(convert(transform.rotation), convert(transform.position));
+		body.body->setCenterOfMassTransform(trans);
+		if (PhysicsMotionState* state = static_cast<PhysicsMotionState*>(body.body->getMotionState()))
+			state->previous = state->current = trans; // Teleport, no interpolation
+		transform.dirty = false;
 	});
 
-	// ContactTracker
-	int numManifolds = dispatcher->getNumManifolds();
-	for (int i = 0;i < numManifolds; i++)
-	{
-		btPersistentManifold* contactManifold =  dispatcher->getManifoldByIndexInternal(i);
-		const btCollisionObject* objA = contactManifold->getBody0();
-		const btCollisionObject* objB = contactManifold->getBody1();
-		int numContacts = contactManifold->getNumContacts();
-		if (numContacts) {
-			Entity entityA((uint64_t)objA->getUserPointer());
-			Entity entityB((uint64_t)objB->getUserPointer());
-			// TODO: Figure out a way to filter what contacts to tracks
-			if (entityA.has<ContactTracker>() && entityB.has<ContactTracker>()) {
-				entityA.get<ContactTracker>().hadContact = true;
-				entityB.get<ContactTracker>().hadContact = true;
+	// Interpolated physics results to entity transforms, only for bodies that have moved.
+	// Those that did not move during the last step get their final pose and leave the list.
+	for (uint i = 0; i < m_moving.size(); ) {
+		PhysicsMotionState* state = m_moving[i];
+		bool moving = state->updated == m_clock;
+		if (state->entity.has<Transform>()) {
+			Transform& transform = state->entity.get<Transform>();
+			const btTransform& cur = state->current;
+			if (!moving || m_alpha >= 1.f) {
+				transform.position = convert(cur.getOrigin());
+				transform.rotation = convert(cur.getRotation());
+			} else {
+				const btTransform& prev = state->previous;
+				transform.position = glm::mix(convert(prev.getOrigin()), convert(cur.getOrigin()), m_alpha);
+				transform.rotation = glm::slerp(convert(prev.getRotation()), convert(cur.getRotation()), m_alpha);
+			}
+		}
+		if (moving) {
+			++i;
+			continue;
+		}
+		state->movingIndex = -1;
+		m_moving[i] = m_moving.back();
+		m_moving[i]->movingIndex = i;
+		m_moving.pop_back();
+	}
+	// Contact events of the new steps replace those of the previous frame
+	if (m_simulated) {
+		m_simulated = false;
+		// Events may outlive their bodies, and a handle of a destroyed entity could reach
+		// another one that reused its slot, so only live entities are touched
+		for (const ContactEvent& event : m_contacts) {
+			for (Entity e : { event.entityA, event.entityB }) {
+				if (e.is_alive() && e.has<ContactTracker>()) {
+					e.get<ContactTracker>().began = false;
+					e.get<ContactTracker>().impulse = 0.f;
+				}
 			}
 		}
-		/*for (int j = 0;j < numContacts; j++) {
-			btManifoldPoint& pt = contactManifold->getContactPoint(j);
-			if (pt.getDistance() < 0.f) {
-				const btVector3& ptA = pt.getPositionWorldOnA();
-				const btVector3& ptB = pt.getPositionWorldOnB();
-				const btVector3& normalOnB = pt.m_normalWorldOnB;
+		m_contacts.swap(m_pendingContacts);
+		m_pendingContacts.clear();
+		for (const ContactEvent& event : m_contacts) {
+			if (event.type == ContactEvent::PERSIST)
+				continue;
+			for (Entity e : { event.entityA, event.entityB }) {
+				if (!e.is_alive() || !e.has<ContactTracker>())
+					continue;
+				ContactTracker& tracker = e.get<ContactTracker>();
+				if (event.type == ContactEvent::BEGIN) {
+					tracker.touching++;
+					tracker.began = true;
+					tracker.impulse = glm::max(tracker.impulse, event.impulse);
+				} else if (tracker.touching > 0) {
+					tracker.touching--;
+				}
 			}
-		}*/
+		}
 	}
 
-	// GroundTracker
-	entities.for_each<GroundTracker, RigidBody>([&](Entity, GroundTracker& tracker, RigidBody& body) {
-		tracker.onGround = testGroundHit(body);
+	if (!m_stepped)
+		return;
+	m_stepped = false;
+
+	// GroundTracker, a body is on ground if something is right below its center
+	m_groundQueries.clear();
+	entities.for_each<GroundTracker, RigidBody>([&](Entity, GroundTracker&, RigidBody& rb) {
+		btVector3 aabbMin, aabbMax;
+		rb.body->getAabb(aabbMin, aabbMax);
+		vec3 from = convert(rb.body->getCenterOfMassPosition());
+		float d = (aabbMax.y() - aabbMin.y()) * 0.5f + 0.01f;
+		m_groundQueries.addRay(from, from - vec3(0, d, 0), rb.body);
+	});
+	query(m_groundQueries);
+	uint index = 0;
+	entities.for_each<GroundTracker, RigidBody>([&](Entity, GroundTracker& tracker, RigidBody&) {
+		tracker.onGround = m_groundQueries.hit[index++];
 	});
 }
 
-Entity PhysicsSystem::rayCast(Entities& entities, vec3 from_, vec3 to_)
+void PhysicsSystem::query(PhysicsQueryBatch& batch)
 {
-	btVector3 from = convert(from_);
-	btVector3 to = convert(to_);
-	btCollisionWorld::ClosestRayResultCallback res(from, to);
-	dynamicsWorld->rayTest(from, to, res);
-	if (res.hasHit()) {
-		return Entity((uint64_t)res.m_collisionObject->getUserPointer());
-	}
-	return {};
+	wait();
+	uint count = batch.size();
+	batch.hit.resize(count);
+	batch.fraction.resize(count);
+	batch.point.resize(count);
+	batch.normal.resize(count);
+	batch.object.resize(count);
+	batch.entity.resize(count);
+	const btCollisionWorld& world = *dynamicsWorld;
+	auto isOverlap = [&batch](uint i) {
+		return batch.type[i] == PhysicsQueryBatch::SPHERE_OVERLAP || batch.type[i] == PhysicsQueryBatch::BOX_OVERLAP;
+	};
+	Engine::threadpool().parallel_for(count, 32, [&](uint begin, uint end) {
+		for (uint i = begin; i < end; ++i)
+			if (!isOverlap(i))
+				runQuery(world, batch, i);
+	});
+	// Contact tests create their manifolds through the world's dispatcher, which is not thread safe
+	for (uint i = 0; i < count; ++i)
+		if (isOverlap(i))
+			runQuery(world, batch, i);
 }
 
-bool PhysicsSystem::testGroundHit(RigidBody& rb)
+Entity PhysicsSystem::rayCast(Entities& entities, vec3 from, vec3 to)
 {
-	btRigidBody& body = *rb.body;
-	btVector3 from = body.getCenterOfMassPosition();
-	btVector3 to(from.x(), from.y() - 10.0, from.z());
-	btCollisionWorld::ClosestRayResultCallback res(from, to);
-	dynamicsWorld->rayTest(from, to, res);
-	if (res.hasHit()) {
-		btVector3 aabbMin, aabbMax;
-		body.getAabb(aabbMin, aabbMax);
-		btScalar d = (aabbMax.y() - aabbMin.y()) * 0.5f + 0.01f;
-		return res.m_hitPointWorld.distance2(from) <= d * d;
-	}
-	return false;
+	PhysicsQueryBatch batch;
+	batch.addRay(from, to);
+	query(batch);
+	return batch.entity[0];
 }
 
 bool PhysicsSystem::add(Entity entity)
 {
 	if (!entity.has<RigidBody>()) return false;
+	wait();
 	RigidBody& rb = entity.get<RigidBody>();
 	ASSERT(rb.body);
 	btRigidBody& body = *rb.body;
 	ASSERT(!body.isInWorld());
-	collisionShapes.push_back(body.getCollisionShape());
-	dynamicsWorld->addRigidBody(rb.body);
+	ASSERT(!body.getMotionState());
+	body.setUserPointer(this); // For the contact callbacks
+	setEntity(body, entity);
+	if (entity.has<ContactTracker>())
+		body.setCollisionFlags(body.getCollisionFlags() | CF_TRACK_CONTACTS);
+	body.setMotionState(new PhysicsMotionState(body.getCenterOfMassTransform(), entity, m_clock, m_moving));
+	// The body takes over the reference to a shared shape
+	if (!m_sharedShapes.count(body.getCollisionShape()))
+		collisionShapes.push_back(body.getCollisionShape());
+	// Same defaults as Bullet unless the body has filter bits of its own
+	bool isStatic = body.isStaticOrKinematicObject();
+	int group = rb.collisionGroup ? rb.collisionGroup : isStatic ? btBroadphaseProxy::StaticFilter : btBroadphaseProxy::DefaultFilter;
+	int mask = rb.collisionMask ? rb.collisionMask : isStatic ? btBroadphaseProxy::AllFilter ^ btBroadphaseProxy::StaticFilter : btBroadphaseProxy::AllFilter;
+	dynamicsWorld->addRigidBody(rb.body, group, mask);
 	return true;
 }
 
+void PhysicsSystem::trackContacts(Entity entity)
+{
+	ASSERT(entity.has<RigidBody>());
+	wait();
+	if (!entity.has<ContactTracker>())
+		entity.add<ContactTracker>();
+	btRigidBody& body = *entity.get<RigidBody>().body;
+	body.setCollisionFlags(body.getCollisionFlags() | CF_TRACK_CONTACTS);
+}
+
 void PhysicsSystem::destroy(Entity entity)
 {
 	if (!entity.has<RigidBody>()) return;
+	wait();
 	RigidBody& rb = entity.get<RigidBody>();
 	btRigidBody& body = *rb.body;
 	ASSERT(body.isInWorld());
-	if (body.getMotionState())
-		delete body.getMotionState();
+	if (PhysicsMotionState* state = static_cast<PhysicsMotionState*>(body.getMotionState())) {
+		if (state->movingIndex >= 0) {
+			m_moving[state->movingIndex] = m_moving.back();
+			m_moving[state->movingIndex]->movingIndex = state->movingIndex;
+			m_moving.pop_back();
+		}
+		delete state;
+	}
 	dynamicsWorld->removeRigidBody(rb.body);
 	ASSERT(body.getCollisionShape());
-	collisionShapes.remove(body.getCollisionShape());
-	delete body.getCollisionShape();
+	if (m_sharedShapes.count(body.getCollisionShape())) {
+		releaseShape(body.getCollisionShape());
+	} else {
+		collisionShapes.remove(body.getCollisionShape());
+		delete body.getCollisionShape();
+	}
 	delete rb.body;
 	rb.body = nullptr;
+}
+
+bool PhysicsSystem::ShapeKey::operator<(const ShapeKey& other) const
+{
+	auto tie = [](const ShapeKey& k) {
+		return std::tie(k.type, k.source, k.params.x, k.params.y, k.params.z, k.params.w, k.scale.x, k.scale.y, k.scale.z);
+	};
+	return tie(*this) < tie(other);
+}
+
+btCollisionShape* PhysicsSystem::findShape(const ShapeKey& key)
+{
+	auto it = m_shapeCache.find(key);
+	return it != m_shapeCache.end() ? it->second : nullptr;
+}
 
+btCollisionShape* PhysicsSystem::addShape(const ShapeKey& key, btCollisionShape* shape, btCollisionShape* base, void* bvhData)
+{
+	m_shapeCache[key] = shape;
+	SharedShape& shared = m_sharedShapes[shape];
+	shared.key = key;
+	shared.base = base;
+	shared.bvhData = bvhData;
+	if (base)
+		m_sharedShapes[base].refs++;
+	return shape;
+}
+
+btCollisionShape* PhysicsSystem::acquireShape(btCollisionShape* shape)
+{
+	auto it = m_sharedShapes.find(shape);
+	ASSERT(it != m_sharedShapes.end());
+	it->second.refs++;
+	return shape;
+}
+
+void PhysicsSystem::releaseShape(btCollisionShape* shape)
+{
+	auto it = m_sharedShapes.find(shape);
+	ASSERT(it != m_sharedShapes.end() && it->second.refs > 0);
+	if (--it->second.refs > 0)
+		return;
+	SharedShape shared = it->second;
+	m_sharedShapes.erase(it);
+	m_shapeCache.erase(shared.key);
+	deleteShape(shape);
+	if (shared.bvhData)
+		btAlignedFree(shared.bvhData);
+	if (shared.base)
+		releaseShape(shared.base);
+}
+
+void PhysicsSystem::clearShapes()
+{
+	for (auto& it : m_sharedShapes) {
+		deleteShape(it.first);
+		if (it.second.bvhData)
+			btAlignedFree(it.second.bvhData);
+	}
+	m_sharedShapes.clear();
+	m_shapeCache.clear();
+}
+
+btCollisionShape* PhysicsSystem::getBoxShape(vec3 halfExtents, vec3 scale)
+{
+	ShapeKey key = { BOX_SHAPE, nullptr, vec4(halfExtents, 0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	btCollisionShape* shape = new btBoxShape(convert(halfExtents));
+	shape->setLocalScaling(convert(scale));
+	return acquireShape(addShape(key, shape));
+}
+
+btCollisionShape* PhysicsSystem::getSphereShape(float radius, vec3 scale)
+{
+	ShapeKey key = { SPHERE_SHAPE, nullptr, vec4(radius, 0.f, 0.f, 0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	btCollisionShape* shape = new btSphereShape(radius);
+	shape->setLocalScaling(convert(scale));
+	return acquireShape(addShape(key, shape));
+}
+
+btCollisionShape* PhysicsSystem::getCylinderShape(vec3 halfExtents, vec3 scale)
+{
+	ShapeKey key = { CYLINDER_SHAPE, nullptr, vec4(halfExtents, 0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	btCollisionShape* shape = new btCylinderShape(convert(halfExtents));
+	shape->setLocalScaling(convert(scale));
+	return acquireShape(addShape(key, shape));
+}
+
+btCollisionShape* PhysicsSystem::getCapsuleShape(float radius, float height, vec3 scale)
+{
+	ShapeKey key = { CAPSULE_SHAPE, nullptr, vec4(radius, height, 0.f, 0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	btCollisionShape* shape = new btCapsuleShape(radius, height);
+	shape->setLocalScaling(convert(scale));
+	return acquireShape(addShape(key, shape));
+}
+
+btCollisionShape* PhysicsSystem::getMeshShape(Geometry& geometry, vec3 scale)
+{
+	ShapeKey key = { MESH_SHAPE, &geometry, vec4(0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	// Scaled instances wrap the unscaled shape
+	ShapeKey baseKey = { MESH_SHAPE, &geometry, vec4(0.f), vec3(1.f) };
+	btCollisionShape* base = findShape(baseKey);
+	if (!base) {
+		void* bvhData = nullptr;
+		btBvhTriangleMeshShape* meshShape = loadMeshShape(geometry, bvhData);
+		base = addShape(baseKey, meshShape, nullptr, bvhData);
+	}
+	if (scale == vec3(1.f))
+		return acquireShape(base);
+	btCollisionShape* shape = new btScaledBvhTriangleMeshShape(static_cast<btBvhTriangleMeshShape*>(base), convert(scale));
+	return acquireShape(addShape(key, shape, base));
+}
+
+btBvhTriangleMeshShape* PhysicsSystem::loadMeshShape(Geometry& geometry, void*& bvhData)
+{
+	if (!geometry.collisionMesh)
+		geometry.generateCollisionTriMesh();
+	btTriangleMesh* mesh = geometry.collisionMesh;
+	bool cache = cvar_bvhCache() && !geometry.path.empty();
+	if (!cache)
+		return new btBvhTriangleMeshShape(mesh, true);
+
+	BvhCacheHeader expected;
+	expected.meshHash = hashMesh(*mesh);
+	string path = geometry.path + ".bvh";
+	if (utils::fileExists(path)) {
+		string file = utils::readFile(path, true);
+		BvhCacheHeader header;
+		if (file.size() >= sizeof(header))
+			memcpy(&header, file.data(), sizeof(header));
+		if (!memcmp(header.magic, expected.magic, sizeof(header.magic)) && header.version == expected.version
+			&& header.meshHash == expected.meshHash && file.size() == sizeof(header) + header.dataSize)
+		{
+			// Deserialized in place, so the buffer needs to live as long as the shape
+			bvhData = btAlignedAlloc(header.dataSize, 16);
+			memcpy(bvhData, file.data() + sizeof(header), header.dataSize);
+			btOptimizedBvh* bvh = btOptimizedBvh::deSerializeInPlace(bvhData, header.dataSize, false);
+			if (bvh) {
+				btBvhTriangleMeshShape* shape = new btBvhTriangleMeshShape(mesh, true, false);
+				shape->setOptimizedBvh(bvh);
+				return shape;
+			}
+			btAlignedFree(bvhData);
+			bvhData = nullptr;
+		}
+		logDebug("Rebuilding outdated %s", path.c_str());
+	}
+
+	btBvhTriangleMeshShape* shape = new btBvhTriangleMeshShape(mesh, true);
+	const btOptimizedBvh* bvh = shape->getOptimizedBvh();
+	expected.dataSize = bvh->calculateSerializeBufferSize();
+	void* buffer = btAlignedAlloc(expected.dataSize, 16);
+	if (bvh->serializeInPlace(buffer, expected.dataSize, false)) {
+		string file(sizeof(expected) + expected.dataSize, '\0');
+		memcpy(&file[0], &expected, sizeof(expected));
+		memcpy(&file[sizeof(expected)], buffer, expected.dataSize);
+		if (!utils::writeFile(path, file, true))
+			logDebug("Could not save %s", path.c_str());
+	}
+	btAlignedFree(buffer);
+	return shape;
+}
+
+btCollisionShape* PhysicsSystem::getHullShape(Geometry& geometry, uint maxHulls, vec3 scale)
+{
+	maxHulls = glm::max(maxHulls, 1u);
+	ShapeKey key = { HULL_SHAPE, &geometry, vec4(maxHulls, 0.f, 0.f, 0.f), scale };
+	if (btCollisionShape* shape = findShape(key))
+		return acquireShape(shape);
+	ShapeKey baseKey = { HULL_SHAPE, &geometry, vec4(maxHulls, 0.f, 0.f, 0.f), vec3(1.f) };
+	btCollisionShape* base = findShape(baseKey);
+	if (!base)
+		base = addShape(baseKey, loadHullShape(geometry, maxHulls));
+	if (scale == vec3(1.f))
+		return acquireShape(base);
+	// Scaling a compound scales its children, so scaled instances need hulls of their own
+	const btCompoundShape& hulls = *static_cast<btCompoundShape*>(base);
+	btCompoundShape* shape = new btCompoundShape();
+	for (int i = 0; i < hulls.getNumChildShapes(); ++i) {
+		const btConvexHullShape* hull = static_cast<const btConvexHullShape*>(hulls.getChildShape(i));
+		btConvexHullShape* copy = new btConvexHullShape(&hull->getUnscaledPoints()[0].x(), hull->getNumPoints());
+		copy->setMargin(hull->getMargin() * glm::compMin(glm::abs(scale)));
+		shape->addChildShape(hulls.getChildTransform(i), copy);
+	}
+	shape->setLocalScaling(convert(scale));
+	return acquireShape(addShape(key, shape));
+}
+
+btCompoundShape* PhysicsSystem::loadHullShape(Geometry& geometry, uint maxHulls)
+{
+	if (!geometry.collisionMesh)
+		geometry.generateCollisionTriMesh();
+	const btTriangleMesh& mesh = *geometry.collisionMesh;
+	btCompoundShape* shape = new btCompoundShape();
+	auto addHull = [&shape](const btVector3& center, const btVector3* points, uint count) {
+		shape->addChildShape(btTransform(btQuaternion::getIdentity(), center), createHull(points, count));
+	};
+
+	bool cache = cvar_hullCache() && !geometry.path.empty();
+	HullCacheHeader expected;
+	expected.meshHash = hashMesh(mesh);
+	expected.maxHulls = maxHulls;
+	expected.concavity = cvar_hullConcavity();
+	string path = geometry.path + ".hulls";
+	if (cache && utils::fileExists(path)) {
+		string file = utils::readFile(path, true);
+		HullCacheHeader header;
+		if (file.size() >= sizeof(header))
+			memcpy(&header, file.data(), sizeof(header));
+		if (!memcmp(header.magic, expected.magic, sizeof(header.magic)) && header.version == expected.version
+			&& header.meshHash == expected.meshHash && header.maxHulls == expected.maxHulls
+			&& header.concavity == expected.concavity)
+		{
+			// Each hull is its center, point count and points as floats
+			const char* data = file.data() + sizeof(header);
+			const char* end = file.data() + file.size();
+			btAlignedObjectArray<btVector3> points;
+			uint i = 0;
+			for (; i < header.numHulls && data + 4 * sizeof(float) <= end; ++i) {
+				float center[3];
+				uint count;
+				memcpy(center, data, sizeof(center));
+				memcpy(&count, data + sizeof(center), sizeof(count));
+				data += sizeof(center) + sizeof(count);
+				if (count < 1 || count > (size_t)(end - data) / (3 * sizeof(float)))
+					break;
+				points.resize(count);
+				for (uint j = 0; j < count; ++j, data += 3 * sizeof(float)) {
+					float p[3];
+					memcpy(p, data, sizeof(p));
+					points[j].setValue(p[0], p[1], p[2]);
+				}
+				addHull(btVector3(center[0], center[1], center[2]), &points[0], count);
+			}
+			if (i == header.numHulls && shape->getNumChildShapes() > 0)
+				return shape;
+			deleteShape(shape);
+			shape = new btCompoundShape();
+		}
+		logDebug("Rebuilding outdated %s", path.c_str());
+	}
+
+	START_MEASURE(decomposeTime)
+	TriangleCollector triangles;
+	btVector3 aabbMin(-BT_LARGE_FLOAT, -BT_LARGE_FLOAT, -BT_LARGE_FLOAT);
+	btVector3 aabbMax(BT_LARGE_FLOAT, BT_LARGE_FLOAT, BT_LARGE_FLOAT);
+	mesh.InternalProcessAllTriangles(&triangles, aabbMin, aabbMax);
+	const btAlignedObjectArray<btVector3>& points = triangles.points;
+	uint numTriangles = points.size() / 3;
+	if (!numTriangles) {
+		logError("No triangles to decompose in %s", geometry.path.c_str());
+		return shape;
+	}
+	btVector3 meshMin = points[0], meshMax = points[0];
+	for (int i = 1; i < points.size(); ++i) {
+		meshMin.setMin(points[i]);
+		meshMax.setMax(points[i]);
+	}
+	float threshold = cvar_hullConcavity() * (meshMax - meshMin).length();
+
+	std::vector<ConvexPart> parts(1);
+	parts[0].triangles.resize(numTriangles);
+	for (uint i = 0; i < numTriangles; ++i)
+		parts[0].triangles[i] = i;
+	evaluatePart(points, parts[0]);
+	while (parts.size() < maxHulls) {
+		int worst = -1;
+		for (uint i = 0; i < parts.size(); ++i)
+			if (parts[i].splittable && parts[i].concavity > threshold && (worst < 0 || parts[i].concavity > parts[worst].concavity))
+				worst = i;
+		if (worst < 0)
+			break;
+		ConvexPart a, b;
+		if (!splitPart(points, parts[worst], a, b)) {
+			parts[worst].splittable = false;
+			continue;
+		}
+		evaluatePart(points, a);
+		evaluatePart(points, b);
+		parts[worst] = std::move(a);
+		parts.push_back(std::move(b));
+	}
+	for (const ConvexPart& part : parts)
+		addHull(part.center, &part.hull[0], part.hull.size());
+	END_MEASURE(decomposeTime)
+	logDebug("Decomposed %s into %d hulls in %.1fms", geometry.path.c_str(), (int)parts.size(), decomposeTime);
+
+	if (cache) {
+		expected.numHulls = parts.size();
+		string file((const char*)&expected, sizeof(expected));
+		for (const ConvexPart& part : parts) {
+			float center[3] = { part.center.x(), part.center.y(), part.center.z() };
+			uint count = part.hull.size();
+			file.append((const char*)center, sizeof(center));
+			file.append((const char*)&count, sizeof(count));
+			for (int i = 0; i < part.hull.size(); ++i) {
+				float p[3] = { part.hull[i].x(), part.hull[i].y(), part.hull[i].z() };
+				file.append((const char*)p, sizeof(p));
+			}
+		}
+		if (!utils::writeFile(path, file, true))
+			logDebug("Could not save %s", path.c_str());
+	}
+	return shape;
 }
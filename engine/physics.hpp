@@ -4,23 +4,151 @@
 #include "bullet/btBulletDynamicsCommon.h"
 #include "bullet/BulletCollision/Gimpact/btGImpactShape.h"
 #include <ecs/ecs.hpp>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <unordered_map>
 
 struct RigidBody;
+struct Geometry;
+
+// Keeps the poses of the last two simulation steps so that rendering can interpolate
+// between them. Bodies get one when added to PhysicsSystem. Bullet only updates active
+// bodies, which join the moving list on their first update for sync() to pick up.
+struct PhysicsMotionState : public btMotionState
+{
+	PhysicsMotionState(const btTransform& trans, ecs::Entity entity, const uint& clock, std::vector<PhysicsMotionState*>& moving)
+		: previous(trans), current(trans), entity(entity), updated(clock), clock(clock), moving(moving) {}
+
+	void getWorldTransform(btTransform& trans) const override { trans = current; }
+	void setWorldTransform(const btTransform& trans) override {
+		previous = current;
+		current = trans;
+		updated = clock;
+		if (movingIndex < 0) {
+			movingIndex = moving.size();
+			moving.push_back(this);
+		}
+	}
+
+	btTransform previous;
+	btTransform current;
+	ecs::Entity entity;
+	uint updated; // Step during which the pose last changed
+	int movingIndex = -1;
+	const uint& clock;
+	std::vector<PhysicsMotionState*>& moving;
+};
+
+// Queries to run together with PhysicsSystem::query(). Inputs and results are kept in
+// arrays indexed by the number the add functions return. Sweeps report the closest hit
+// along from..to, overlaps the first object found. A body to ignore can be given per
+// query, e.g. the one casting it.
+struct PhysicsQueryBatch
+{
+	enum Type : uint8 { RAY, SPHERE_SWEEP, BOX_SWEEP, SPHERE_OVERLAP, BOX_OVERLAP };
+
+	uint addRay(vec3 from, vec3 to, const btCollisionObject* ignore = nullptr);
+	uint addSphereSweep(vec3 from, vec3 to, float radius, const btCollisionObject* ignore = nullptr);
+	uint addBoxSweep(vec3 from, vec3 to, vec3 halfExtents, quat rotation, const btCollisionObject* ignore = nullptr);
+	uint addSphereOverlap(vec3 center, float radius, const btCollisionObject* ignore = nullptr);
+	uint addBoxOverlap(vec3 center, vec3 halfExtents, quat rotation, const btCollisionObject* ignore = nullptr);
+	uint size() const { return type.size(); }
+	void clear(); // Keeps the memory
+
+	// Input
+	std::vector<Type> type;
+	std::vector<vec3> from;
+	std::vector<vec3> to; // Same as from for overlaps
+	std::vector<vec3> extents; // Half extents of boxes, radius of spheres in x
+	std::vector<quat> rotation;
+	std::vector<const btCollisionObject*> ignore;
+
+	// Results
+	std::vector<uint8> hit;
+	std::vector<float> fraction; // Along from..to, 0 for overlaps
+	std::vector<vec3> point;
+	std::vector<vec3> normal; // Away from the object hit
+	std::vector<const btCollisionObject*> object;
+	std::vector<ecs::Entity> entity;
+
+private:
+	uint add(Type t, vec3 a, vec3 b, vec3 ext, quat rot, const btCollisionObject* ign);
+};
+
+// Contact between two bodies, at least one of which tracks contacts. A pair begins when
+// its first contact point appears, persists while it has any and ends when the last one
+// is gone or either body is removed.
+struct ContactEvent
+{
+	enum Type : uint8 { BEGIN, PERSIST, END };
+	Type type = BEGIN;
+	ecs::Entity entityA;
+	ecs::Entity entityB;
+	vec3 position = vec3(0.f); // Deepest point, on B
+	vec3 normal = vec3(0.f); // On B, towards A
+	float impulse = 0.f; // Normal impulse of the last step, 0 for END
+};
 
 class PhysicsSystem : public ecs::System
 {
 public:
 	PhysicsSystem();
 	~PhysicsSystem();
+	// Also switches between the single and multithreaded world if physics.parallel has changed
 	void reset();
 
 	bool add(ecs::Entity entity);
 	void destroy(ecs::Entity entity) override;
 
+	// The simulation advances in fixed steps of 1 / physics.rate seconds, accumulating
+	// the frame time in between. Entity transforms are interpolated between the poses
+	// of the last two steps by the time left over, which delays them by at most one
+	// step. Without fixedStep, dt is simulated as a single step as is.
+	// With physics.threaded, step() hands the simulation over to a dedicated thread
+	// and returns, so that it runs while the frame renders. sync() waits for it and
+	// brings the results to the entities. It should be called at the start of the
+	// next frame, after which bodies can be accessed directly until step(). Code
+	// running in between, such as debug drawing, has to use enqueue() instead.
 	void step(ecs::Entities& entities, float dt, bool fixedStep);
+	void sync(ecs::Entities& entities);
+
+	// Adds a ContactTracker to the entity and reports the contacts of its body
+	void trackContacts(ecs::Entity entity);
+	// Contact events of the steps simulated since the previous ones were brought in, one
+	// BEGIN or END per change and a PERSIST per touching pair. Replaced by the sync()
+	// that brings in the next step, so they are meant to be consumed once per frame.
+	const std::vector<ContactEvent>& contacts() const { return m_contacts; }
+
+	// Runs at the next sync point, or right away if no step is in flight (main thread only)
+	typedef std::function<void(PhysicsSystem&)> Command;
+	void enqueue(Command command);
+
+	// Shapes shared by all bodies with the same parameters, created on first request. Each
+	// call returns a reference, which add() hands over to the body or releaseShape() gives
+	// back, and the shape is deleted with its last reference. Other shapes belong to their body.
+	btCollisionShape* getBoxShape(vec3 halfExtents, vec3 scale);
+	btCollisionShape* getSphereShape(float radius, vec3 scale);
+	btCollisionShape* getCylinderShape(vec3 halfExtents, vec3 scale);
+	btCollisionShape* getCapsuleShape(float radius, float height, vec3 scale);
+	// Static triangle mesh of the geometry's collision mesh, scaled instances share the BVH.
+	// With physics.bvhCache (off by default) the BVH is saved next to the geometry file and
+	// loaded from there as long as the mesh matches.
+	btCollisionShape* getMeshShape(Geometry& geometry, vec3 scale);
+	// Compound of at most maxHulls convex hulls approximating the geometry's collision mesh,
+	// for dynamic bodies. Parts of the mesh are split in two until they are convex enough
+	// (physics.hullConcavity) or the budget runs out. With physics.hullCache (off by default)
+	// the hulls are saved next to the geometry file and loaded from there as long as the
+	// mesh matches.
+	btCollisionShape* getHullShape(Geometry& geometry, uint maxHulls, vec3 scale);
+	void releaseShape(btCollisionShape* shape);
 
+	// Runs rays and sweeps in parallel on the thread pool and overlaps after them, as
+	// contact tests modify the dispatcher (main thread only)
+	void query(PhysicsQueryBatch& batch);
 	ecs::Entity rayCast(ecs::Entities& entities, vec3 from, vec3 to);
-	bool testGroundHit(RigidBody& body);
 
 	btAlignedObjectArray<btCollisionShape*> collisionShapes;
 	btBroadphaseInterface* broadphase;
@@ -28,6 +156,73 @@ public:
 	btConstraintSolver*	solver;
 	btDefaultCollisionConfiguration* collisionConfiguration;
 	btDiscreteDynamicsWorld* dynamicsWorld;
+
+private:
+	enum ShapeType { BOX_SHAPE, SPHERE_SHAPE, CYLINDER_SHAPE, CAPSULE_SHAPE, MESH_SHAPE, HULL_SHAPE };
+	struct ShapeKey {
+		ShapeType type;
+		const void* source; // Geometry of meshes
+		vec4 params;
+		vec3 scale;
+		bool operator<(const ShapeKey& other) const;
+	};
+	struct SharedShape {
+		ShapeKey key;
+		uint refs = 0; // Bodies and callers holding the shape, and scaled shapes wrapping it
+		btCollisionShape* base = nullptr; // Shared shape this one scales
+		void* bvhData = nullptr; // Holds a deserialized BVH
+	};
+	btCollisionShape* findShape(const ShapeKey& key);
+	btCollisionShape* addShape(const ShapeKey& key, btCollisionShape* shape, btCollisionShape* base = nullptr, void* bvhData = nullptr);
+	btCollisionShape* acquireShape(btCollisionShape* shape);
+	void clearShapes();
+	btBvhTriangleMeshShape* loadMeshShape(Geometry& geometry, void*& bvhData);
+	btCompoundShape* loadHullShape(Geometry& geometry, uint maxHulls);
+
+	struct TouchingPair {
+		uint since = 0; // Step during which the pair began
+		bool reported = false; // BEGIN has been sent
+		vec3 position = vec3(0.f);
+		vec3 normal = vec3(0.f);
+	};
+	// Bullet calls these when a manifold gets its first contact point and loses its last one
+	static void contactStarted(btPersistentManifold* const& manifold);
+	static void contactEnded(btPersistentManifold* const& manifold);
+	void reportContacts();
+
+	void createWorld();
+	void destroyWorld();
+	void simulate(float dt, int steps);
+	void wait();
+	void startThread();
+	void stopThread();
+
+	btConstraintSolver* m_solverMt = nullptr; // For large islands, with the parallel world
+	bool m_parallel = false;
+	std::vector<Command> m_commands;
+	std::vector<PhysicsMotionState*> m_moving;
+	PhysicsQueryBatch m_groundQueries;
+	std::mutex m_contactMutex; // The parallel world runs the narrowphase on many threads
+	std::vector<const btPersistentManifold*> m_started;
+	std::unordered_map<const btPersistentManifold*, TouchingPair> m_touching;
+	std::vector<ContactEvent> m_pendingContacts; // Written by simulate()
+	std::vector<ContactEvent> m_contacts;
+	std::map<ShapeKey, btCollisionShape*> m_shapeCache;
+	std::unordered_map<const btCollisionShape*, SharedShape> m_sharedShapes;
+	float m_accumulator = 0.f;
+	float m_alpha = 1.f; // Interpolation factor between the last two poses
+	uint m_clock = 0; // Number of steps taken, written by simulate()
+	bool m_stepped = false;
+	bool m_simulated = false; // simulate() has run since the last sync, even without steps
+	bool m_inFlight = false; // Main thread view of the step
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	bool m_stepPending = false;
+	bool m_quit = false;
+	float m_stepDt = 0.f;
+	int m_stepCount = 0;
 };
 
 vec3 inline convert(const btVector3& vector) {
@@ -44,7 +44,7 @@ struct NaiveFrustum
 	}
 
 	inline bool visible(const Transform& transform, const Bounds& bounds) const {
-		return visible(transform.position, bounds.radius * glm::compMax(transform.scale));
+		return visible(bounds.worldCenter(transform), bounds.worldRadius(transform));
 	}
 
 	inline bool visible(vec3 position, float radius) const {
@@ -168,6 +168,56 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 			sortedDrawCalls.back().model = &model;
 		}
 	});
+	// Animated models go to the bone palette in groups sharing geometry and materials,
+	// each pass then draws the visible instances of a group together
+	const bool bonePalette = m_device->caps.bonePalette;
+	static std::vector<Model*> skinnedGroups; // First model of each group
+	static std::vector<uint> skinnedInstanceGroups;
+	static std::vector<std::vector<uint>> skinnedDraws; // Per group and reflection index
+	skinnedGroups.clear();
+	skinnedInstanceGroups.clear();
+	if (bonePalette)
+		m_device->beginSkinning();
+	entities.for_each<BoneAnimation, Model, Transform>([&](Entity, BoneAnimation& anim, Model& model, Transform& transform) {
+		// Used by AnimationSystem to throttle characters that are hidden or small on screen
+		anim.visible = frustum.visible(transform, model.bounds);
+		anim.screenSize = model.bounds.worldRadius(transform) * camera.projection[1][1];
+		if (camera.fovy > 0.f)
+			anim.screenSize /= glm::max(glm::distance(camPos, model.bounds.worldCenter(transform)), camera.near);
+		anim.skinningInstance = -1;
+		if (!bonePalette || !model.geometry || model.materials.empty())
+			return;
+		uint numBones = anim.bones.empty() ? model.geometry->bones.size() : anim.bones.size();
+		anim.skinningInstance = m_device->addSkinnedInstance(transform.matrix, anim.bones.empty() ? nullptr : anim.bones.data(), numBones);
+		uint group = 0;
+		while (group < skinnedGroups.size() && !(skinnedGroups[group]->geometry == model.geometry
+			&& std::equal(model.materials.begin(), model.materials.end(), skinnedGroups[group]->materials.begin(), skinnedGroups[group]->materials.end(), sameMaterial)))
+			++group;
+		if (group == skinnedGroups.size())
+			skinnedGroups.push_back(&model);
+		skinnedInstanceGroups.push_back(group);
+	});
+	if (bonePalette)
+		m_device->endSkinning();
+	skinnedDraws.resize(std::max(skinnedDraws.size(), skinnedGroups.size() * MAX_REFLECTIONS));
+	// Returns false for models that are not drawn from the bone palette
+	auto queueSkinned = [&](Entity e, int reflectionIndex) {
+		if (!bonePalette || !e.has<BoneAnimation>() || e.get<BoneAnimation>().skinningInstance < 0)
+			return false;
+		uint instance = e.get<BoneAnimation>().skinningInstance;
+		skinnedDraws[skinnedInstanceGroups[instance] * MAX_REFLECTIONS + reflectionIndex].push_back(instance);
+		return true;
+	};
+	auto renderSkinned = [&]() {
+		for (uint i = 0; i < skinnedGroups.size() * MAX_REFLECTIONS; ++i) {
+			if (skinnedDraws[i].empty())
+				continue;
+			BEGIN_GPU_SAMPLE(SkinnedInstances)
+			m_device->renderSkinned(*skinnedGroups[i / MAX_REFLECTIONS], skinnedDraws[i].data(), skinnedDraws[i].size(), i % MAX_REFLECTIONS);
+			END_GPU_SAMPLE()
+			skinnedDraws[i].clear();
+		}
+	};
 	entities.for_each<Particles, Transform>([&](Entity e, Particles& particles, Transform& transform) {
 		transform.updateMatrix();
 		if (useTransparentPass(particles) && particles.count && frustum.visible(transform, particles.bounds)) {
@@ -318,12 +368,13 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 			FrustumType shadowFrustum(shadowCam);
 			m_device->setupShadowPass(shadowCam, light);
 			entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
-				if (!model.materials.empty() && model.geometry && shadowFrustum.visible(transform, model.bounds)) {
+				if (!model.materials.empty() && model.geometry && shadowFrustum.visible(transform, model.bounds) && !queueSkinned(e, 0)) {
 					BEGIN_ENTITY_GPU_SAMPLE("Shadow", e)
 					m_device->renderShadow(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
 					END_ENTITY_GPU_SAMPLE()
 				}
 			});
+			renderSkinned();
 			END_GPU_SAMPLE()
 			++usedShadowMaps;
 			++shadowIndex;
@@ -344,13 +395,14 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 				entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
 					if (model.materials.empty() || !model.geometry)
 						return;
-					float maxDist = model.bounds.radius * glm::compMax(transform.scale) + shadowCam.far;
-					if (glm::distance2(light.position, transform.position) < maxDist * maxDist) {
+					float maxDist = model.bounds.worldRadius(transform) + shadowCam.far;
+					if (glm::distance2(light.position, model.bounds.worldCenter(transform)) < maxDist * maxDist && !queueSkinned(e, 0)) {
 						BEGIN_ENTITY_GPU_SAMPLE("Cube shadow", e)
 						m_device->renderShadow(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
 						END_ENTITY_GPU_SAMPLE()
 					}
 				});
+				renderSkinned();
 				END_GPU_SAMPLE()
 				++usedCubeShadows;
 				++shadowIndex;
@@ -374,13 +426,14 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 			entities.for_each<Model, Transform>([&](Entity e, Model& model, Transform& transform) {
 				if (model.materials.empty() || !model.geometry)
 					return;
-				float maxDist = model.bounds.radius * glm::compMax(transform.scale) + reflCam.far;
-				if (glm::distance2(reflCamPos, transform.position) >= maxDist * maxDist)
+				float maxDist = model.bounds.worldRadius(transform) + reflCam.far;
+				if (glm::distance2(reflCamPos, model.bounds.worldCenter(transform)) >= maxDist * maxDist || queueSkinned(e, 0))
 					return;
 				BEGIN_ENTITY_GPU_SAMPLE("Reflection", e)
 				m_device->render(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr);
 				END_ENTITY_GPU_SAMPLE()
 			});
+			renderSkinned();
 			BEGIN_GPU_SAMPLE(ReflectionSkybox)
 			m_device->renderSkybox();
 			END_GPU_SAMPLE()
@@ -408,11 +461,14 @@ void RenderSystem::render(Entities& entities, Camera& camera, const Transform& c
 					}
 				}
 			}
+			if (queueSkinned(e, reflectionIndex))
+				return;
 			BEGIN_ENTITY_GPU_SAMPLE("Render", e)
 			m_device->render(model, transform, e.has<BoneAnimation>() ? &e.get<BoneAnimation>() : nullptr, reflectionIndex);
 			END_ENTITY_GPU_SAMPLE()
 		}
 	});
+	renderSkinned();
 	END_GPU_SAMPLE()
 	//BEGIN_GPU_SAMPLE(ShaderStorageBarrier)
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
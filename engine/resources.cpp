@@ -1,6 +1,7 @@
 #include "resources.hpp"
 #include "image.hpp"
 #include "geometry.hpp"
+#include "engine.hpp"
 #include <fstream>
 #include <sstream>
 #include <algorithm>
@@ -140,6 +141,11 @@ std::vector<string> Resources::listFiles(const string& path, const string& filte
 	return files;
 }
 
+void Resources::watch(const string& path, FileWatcher::Callback callback, uint owner, uint delay) const
+{
+	Engine::fileWatcher().watch(findPath(path), callback, owner, delay);
+}
+
 string Resources::getText(const string& path, CachePolicy cache)
 {
 	if (cache == USE_CACHE) {
@@ -209,6 +215,14 @@ Geometry* Resources::getHeightmap(const string& path)
 	return ptr.get();
 }
 
+Geometry* Resources::createGeometry(const string& name)
+{
+	auto& ptr = m_geoms[name];
+	ASSERT(!ptr && "Geometry name already in use");
+	ptr.reset(new Geometry());
+	return ptr.get();
+}
+
 void Resources::startAsyncLoading()
 {
 	if (m_loadQueue.empty())
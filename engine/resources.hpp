@@ -1,5 +1,6 @@
 #pragma once
 #include "common.hpp"
+#include "filewatcher.hpp"
 #include <thread>
 #include <map>
 
@@ -23,6 +24,8 @@ public:
 	void removePath(const string& path);
 	string findPath(const string& path) const;
 	std::vector<string> listFiles(const string& path, const string& filter = "") const;
+	// Watches the file found from the search paths with the engine's FileWatcher
+	void watch(const string& path, FileWatcher::Callback callback, uint owner = 0, uint delay = 100) const;
 
 	string getText(const string& path, CachePolicy cache);
 	std::vector<char>& getBinary(const string& path);
@@ -30,6 +33,7 @@ public:
 	Image* getImageAsync(const string& path);
 	Geometry* getGeometry(const string& path);
 	Geometry* getHeightmap(const string& path);
+	Geometry* createGeometry(const string& name); // Empty, procedurally filled geometry
 
 	void startAsyncLoading();
 
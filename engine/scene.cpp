@@ -25,8 +25,52 @@ using namespace ecs;
 using json11::Json;
 using utils::endsWith;
 
+static CVar<int> cvar_staticBatching("scene.staticBatching", 1);
+static CVar<float> cvar_staticBatchChunkSize("scene.staticBatchChunkSize", 32.f);
+
 namespace {
 
+	// Batches can only be merged if they have the same vertex attributes
+	uint attributeMask(const Batch& batch) {
+		return (batch.texcoords.empty() ? 0 : 1) | (batch.normals.empty() ? 0 : 2)
+			| (batch.tangents.empty() ? 0 : 4) | (batch.colors.empty() ? 0 : 8);
+	}
+
+	bool canBatch(Entity e) {
+		if (!e.is_alive() || !e.has<Model>() || !e.has<Transform>())
+			return false;
+		if (e.has<BoneAnimation>() || e.has<PropertyAnimation>() || e.has<Particles>())
+			return false;
+		if (e.has<RigidBody>() && e.get<RigidBody>().body && !e.get<RigidBody>().body->isStaticObject())
+			return false;
+		const Model& model = e.get<Model>();
+		if (!model.lods[0].geometry || model.lods[1].geometry || model.materials.empty())
+			return false; // Merging would lose the LODs
+		for (const Material& mat : model.materials)
+			if (mat.blendFunc != Material::BLEND_NONE || (mat.flags & Material::ANIMATED))
+				return false;
+		Geometry& geom = *model.lods[0].geometry;
+		if (!geom.bones.empty() || !geom.restoreCpuData())
+			return false;
+		for (Batch& batch : geom.batches)
+			batch.unpack();
+		for (const Batch& batch : geom.batches)
+			if (batch.positions.empty() || !batch.boneindices.empty() || !batch.morphTargets.empty()
+				|| batch.materialIndex >= model.materials.size())
+				return false;
+		return true;
+	}
+
+	// Bit index or array of them to a bit mask
+	uint toBits(const Json& item) {
+		if (item.is_number())
+			return 1 << (uint)item.number_value();
+		uint bits = 0;
+		for (const auto& bit : item.array_items())
+			bits |= 1 << (uint)bit.number_value();
+		return bits;
+	}
+
 	// /foo/bar/baz.txt --> /foo/bar/
 	string dirname(const string& path) {
 		size_t pos = path.find_last_of("/");
@@ -234,6 +278,17 @@ namespace {
 				} else ASSERT(!"Unknown geometry definition");
 			} else ASSERT(!"Unknown geometry definition");
 			model.geometry = model.lods[0].geometry;
+
+			// Shared by all users of the geometry, so the last definition wins
+			if (def["residency"].is_string()) {
+				const string& residency = def["residency"].string_value();
+				Geometry::Residency policy = Geometry::KEEP_ALL;
+				if (residency == "positions") policy = Geometry::KEEP_POSITIONS;
+				else if (residency == "gpu") policy = Geometry::GPU_ONLY;
+				else if (residency != "all") logError("Unknown geometry residency \"%s\"", residency.c_str());
+				for (int i = 0; i < Model::MAX_LODS && model.lods[i].geometry; ++i)
+					model.lods[i].geometry->residency = policy;
+			}
 		}
 
 		// Parse material
@@ -316,7 +371,7 @@ namespace {
 				PropertyAnimation::Keyframe<T> keyframe;
 				setNumber(keyframe.time, keyframeDef.array_items()[0]);
 				set(keyframe.value, keyframeDef.array_items()[1]);
-				track.keyframes.emplace_back(keyframe);
+				track.addKeyframe(keyframe.time, keyframe.value);
 			}
 		}
 		addTrack(dest, track);
@@ -356,6 +411,7 @@ void SceneLoader::load(const string& path, Resources& resources)
 		}
 	}
 
+	batchStatic(resources);
 	resources.startAsyncLoading();
 
 	uint t1 = Engine::timems();
@@ -458,6 +514,8 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 	}
 
 	Entity entity = world->create();
+	if (def["static"].bool_value())
+		m_staticEntities.push_back(entity);
 
 	if (def["name"].is_string()) {
 		entity.tag(def["name"].string_value());
@@ -482,7 +540,7 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 	}
 
 	// Parse transform
-	if (!def["position"].is_null() || !def["rotation"].is_null() || !def["scale"].is_null() || !def["geometry"].is_null()) {
+	if (!def["position"].is_null() || !def["rotation"].is_null() || !def["scale"].is_null() || !def["geometry"].is_null() || !def["terrain"].is_null()) {
 		Transform transform;
 		setVec3(transform.position, def["position"]);
 		setVec3(transform.scale, def["scale"]);
@@ -547,12 +605,33 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		numParticles++;
 	}
 
+	// Parse terrain
+	const Json& terrainDef = def["terrain"];
+	if (!terrainDef.is_null()) {
+		ASSERT(terrainDef.is_object());
+		Terrain terrain;
+		if (terrainDef["heightmap"].is_string())
+			terrain.heightmap = resources.getImage(resolvePath(pathContext, terrainDef["heightmap"].string_value()));
+		else logError("Terrain requires a heightmap");
+		setNumber(terrain.tileSize, terrainDef["tileSize"]);
+		setNumber(terrain.lodLevels, terrainDef["lodLevels"]);
+		setNumber(terrain.lodDistance, terrainDef["lodDistance"]);
+		setNumber(terrain.streamDistance, terrainDef["streamDistance"]);
+		setNumber(terrain.colliderDistance, terrainDef["colliderDistance"]);
+		const Json& materialDef = def["material"]; // Not embedded in terrainDef
+		if (materialDef.is_object())
+			parseMaterial(terrain.material, materialDef, resources, pathContext);
+		entity.add(terrain);
+	}
+
 	// Parse body (needs to be after geometry, transform, bounds...)
 	if (!def["body"].is_null()) {
 		const Json& bodyDef = def["body"];
 		ASSERT(bodyDef.is_object());
 		ASSERT(entity.has<Model>());
 		ASSERT(entity.has<Transform>());
+		ASSERT(world->has_system<PhysicsSystem>());
+		PhysicsSystem& physics = world->get_system<PhysicsSystem>();
 		const Model& model = entity.get<Model>();
 		const Transform& transform = entity.get<Transform>();
 
@@ -563,15 +642,16 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		const string& shapeStr = bodyDef["shape"].string_value();
 		vec3 extents = model.bounds.max - model.bounds.min;
 		if (shapeStr == "box") {
-			shape = new btBoxShape(convert(extents * 0.5f));
+			shape = physics.getBoxShape(extents * 0.5f, transform.scale);
 		} else if (shapeStr == "sphere") {
-			shape = new btSphereShape(model.bounds.radius);
+			// Body origin is at the model origin, so cover the offset sphere center too
+			shape = physics.getSphereShape(model.bounds.radius + glm::length(model.bounds.center), transform.scale);
 		} else if (shapeStr == "cylinder") {
-			shape = new btCylinderShape(convert(extents * 0.5f));
+			shape = physics.getCylinderShape(extents * 0.5f, transform.scale);
 		} else if (shapeStr == "capsule") {
 			float r = glm::max(extents.x, extents.z) * 0.5f;
-			shape = new btCapsuleShape(r, extents.y);
-		} else if (shapeStr == "trimesh") {
+			shape = physics.getCapsuleShape(r, extents.y, transform.scale);
+		} else if (shapeStr == "trimesh" || shapeStr == "convex") {
 			Geometry* colGeo = nullptr;
 			if (bodyDef["geometry"].is_string()) {
 				colGeo = resources.getGeometry(bodyDef["geometry"].string_value());
@@ -580,11 +660,16 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 					logError("LODs not supported for collision mesh.");
 				colGeo = model.lods[0].geometry;
 			}
-			if (!colGeo->collisionMesh)
-				colGeo->generateCollisionTriMesh();
-			if (mass <= 0.f) { // Static mesh
-				shape = new btBvhTriangleMeshShape(colGeo->collisionMesh, true);
+			// Convex shapes and dynamic meshes asking for it are approximated with hulls
+			uint hulls = shapeStr == "convex" ? 1 : 0;
+			setNumber(hulls, bodyDef["decompose"]);
+			if (hulls > 0) {
+				shape = physics.getHullShape(*colGeo, hulls, transform.scale);
+			} else if (mass <= 0.f) { // Static mesh
+				shape = physics.getMeshShape(*colGeo, transform.scale);
 			} else {
+				if (!colGeo->collisionMesh)
+					colGeo->generateCollisionTriMesh();
 				shape = new btGImpactMeshShape(colGeo->collisionMesh);
 				shape->setLocalScaling(convert(transform.scale));
 				static_cast<btGImpactMeshShape*>(shape)->updateBound();
@@ -592,10 +677,9 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		} else {
 			logError("Unknown shape %s", shapeStr.c_str());
 		}
-		ASSERT((shapeStr == "trimesh" || bodyDef["geometry"].is_null()) && "Trimesh shape type required if body.geometry is specified");
+		ASSERT((shapeStr == "trimesh" || shapeStr == "convex" || bodyDef["geometry"].is_null()) && "Mesh shape type required if body.geometry is specified");
 		ASSERT(shape);
 
-		shape->setLocalScaling(convert(transform.scale));
 		btVector3 inertia(0, 0, 0);
 		if (mass > 0)
 			shape->calculateLocalInertia(mass, inertia);
@@ -619,9 +703,9 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 			body.setLinearFactor(convert(toVec3(bodyDef["linearFactor"])));
 		if (bodyDef["noGravity"].bool_value())
 			body.setFlags(body.getFlags() | BT_DISABLE_WORLD_GRAVITY);
-		body.setUserIndex(entity.get_id());
-		if (world->has_system<PhysicsSystem>())
-			world->get_system<PhysicsSystem>().add(entity);
+		rb.collisionGroup = toBits(bodyDef["collisionGroup"]);
+		rb.collisionMask = toBits(bodyDef["collidesWith"]);
+		physics.add(entity);
 	}
 
 	if (!def["animation"].is_null()) {
@@ -669,7 +753,7 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 
 	if (def["trackContacts"].bool_value()) {
 		ASSERT(entity.has<RigidBody>());
-		entity.add<ContactTracker>();
+		world->get_system<PhysicsSystem>().trackContacts(entity);
 	}
 
 	if (def["triggerVolume"].is_object()) {
@@ -680,7 +764,7 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		setNumber(trigger.times, triggerDef["times"]);
 		setNumber(trigger.bounds.radius, triggerDef["radius"]);
 		setVec3(trigger.bounds.min, triggerDef["min"]);
-		setVec3(trigger.bounds.min, triggerDef["max"]);
+		setVec3(trigger.bounds.max, triggerDef["max"]);
 
 		if (triggerDef["receiver"].is_string())
 			trigger.receiverModule = id::hash(triggerDef["receiver"].string_value());
@@ -693,12 +777,7 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 		else if (triggerDef["exitMessage"].is_number())
 			trigger.exitMessage = triggerDef["exitMessage"].number_value();
 
-		if (triggerDef["groups"].is_number())
-			trigger.groups = 1 << (uint)triggerDef["groups"].number_value();
-		else if (triggerDef["groups"].is_array()) {
-			for (const auto& item : triggerDef["groups"].array_items())
-				trigger.groups |= 1 << (uint)item.number_value();
-		}
+		trigger.groups = toBits(triggerDef["groups"]);
 	}
 
 	if (def["triggerGroup"].is_number()) {
@@ -732,8 +811,100 @@ Entity SceneLoader::instantiate(Json def, Resources& resources, const string& pa
 	return entity;
 }
 
+void SceneLoader::batchStatic(Resources& resources)
+{
+	std::vector<Entity> statics;
+	statics.swap(m_staticEntities);
+	if (!cvar_staticBatching())
+		return;
+	statics.erase(std::remove_if(statics.begin(), statics.end(), [](Entity e) { return !canBatch(e); }), statics.end());
+	if (statics.size() < 2)
+		return;
+	START_MEASURE(batchMs)
+
+	// Group batches by material, vertex layout and spatial chunk, so that the chunks can still be culled
+	struct Group {
+		uint material;
+		uint attributes;
+		ivec3 chunk;
+		std::vector<std::pair<const Batch*, mat4>> batches; // Matrix copied, creating entities moves components
+		uint numVertices = 0;
+	};
+	std::vector<Material> materials;
+	std::vector<Group> groups;
+	float chunkSize = glm::max(cvar_staticBatchChunkSize(), 0.01f);
+	uint numBatches = 0;
+	for (Entity e : statics) {
+		const Model& model = e.get<Model>();
+		Transform& transform = e.get<Transform>();
+		transform.updateMatrix();
+		ivec3 chunk = ivec3(glm::floor(model.bounds.worldCenter(transform) / chunkSize));
+		for (const Batch& batch : model.lods[0].geometry->batches) {
+			const Material& mat = model.materials[batch.materialIndex];
+			uint material = 0;
+			while (material < materials.size() && !sameMaterial(materials[material], mat))
+				++material;
+			if (material == materials.size())
+				materials.push_back(mat);
+			uint attributes = attributeMask(batch);
+			auto it = std::find_if(groups.begin(), groups.end(), [&](const Group& group) {
+				return group.material == material && group.attributes == attributes && group.chunk == chunk;
+			});
+			if (it == groups.end()) {
+				groups.emplace_back();
+				it = groups.end() - 1;
+				it->material = material;
+				it->attributes = attributes;
+				it->chunk = chunk;
+			}
+			it->batches.emplace_back(&batch, transform.matrix);
+			it->numVertices += batch.positions.size();
+			++numBatches;
+		}
+	}
+
+	static uint batchId = 0;
+	for (Group& group : groups) {
+		vec3 center = (vec3(group.chunk) + 0.5f) * chunkSize;
+		Geometry* geom = resources.createGeometry("#staticbatch" + std::to_string(batchId++));
+		geom->batches.emplace_back();
+		Batch& merged = geom->batches.back();
+		merged.name = "StaticBatch";
+		merged.positions.reserve(group.numVertices);
+		// Vertices are relative to the chunk center to keep precision and give the entity a sensible position
+		mat4 toChunk = glm::translate(mat4(1.f), -center);
+		for (auto& it : group.batches)
+			merged.append(*it.first, toChunk * it.second);
+		merged.setupAttributes();
+		geom->calculateBoundingBox();
+		geom->calculateBoundingSphere();
+
+		Entity e = world->create();
+#ifdef USE_DEBUG_NAMES
+		DebugInfo info;
+		info.name = "staticbatch#" + std::to_string(batchId - 1);
+		e.tag(info.name);
+		e.add<DebugInfo>(info);
+#endif
+		e.add<Transform>().position = center;
+		Model& model = e.add<Model>();
+		model.lods[0].geometry = geom;
+		model.bounds = geom->bounds;
+		model.materials.push_back(materials[group.material]);
+	}
+
+	// Keep the entities for bodies, triggers, tags etc.
+	for (Entity e : statics)
+		e.remove<Model>();
+
+	END_MEASURE(batchMs)
+	logDebug("Static batching merged %d batches from %d entities to %d draws in %.1fms",
+		numBatches, statics.size(), groups.size(), batchMs);
+}
+
 void SceneLoader::reset()
 {
 	prefabs.clear();
+	m_staticEntities.clear();
 	numModels = 0; numBodies = 0; numLights = 0;
 }
@@ -15,6 +15,9 @@ public:
 	void reset();
 
 	ecs::Entity instantiate(json11::Json def, Resources& resources, const string& pathContext = "");
+	// Merges models of entities instantiated with "static": true into per material chunks,
+	// called by load() but needs to be called manually after positioning instantiated entities
+	void batchStatic(Resources& resources);
 
 	ecs::Entities* world = nullptr;
 	std::map<string, json11::Json> prefabs;
@@ -23,5 +26,6 @@ private:
 	void load_internal(const string& path, Resources& resources);
 
 	json11::Json m_environment;
+	std::vector<ecs::Entity> m_staticEntities;
 	uint numModels = 0, numBodies = 0, numLights = 0, numParticles = 0;
 };
@@ -0,0 +1,466 @@
+#include "terrain.hpp"
+#include "components.hpp"
+#include "geometry.hpp"
+#include "image.hpp"
+#include "physics.hpp"
+#include "engine.hpp"
+#include <map>
+#include "bullet/BulletCollision/CollisionShapes/btHeightfieldTerrainShape.h"
+
+using namespace ecs;
+
+static CVar<int> cvar_meshJobsPerFrame("terrain.meshJobsPerFrame", 8);
+
+namespace {
+	struct HeightData
+	{
+		int width = 0;
+		int height = 0;
+		vec3 scale = vec3(1, 1, 1);
+		std::vector<float> heights; // Already scaled
+
+		float at(int x, int z) const {
+			x = glm::clamp(x, 0, width - 1);
+			z = glm::clamp(z, 0, height - 1);
+			return heights[z * width + x];
+		}
+
+		// Terrain space position of a sample, centered the same way as Geometry(const Image&)
+		vec3 position(int x, int z) const {
+			return vec3((x - width * 0.5f) * scale.x, at(x, z), (z - height * 0.5f) * scale.z);
+		}
+	};
+
+	struct MeshJob
+	{
+		std::unique_ptr<Geometry> geometry;
+		std::atomic_bool done = { false };
+	};
+
+	bool intersectsSphere(vec3 min, vec3 max, vec3 center, float radius) {
+		return glm::distance2(glm::clamp(center, min, max), center) < radius * radius;
+	}
+
+	// Fixed resolution grid mesh of a node. Each vertex also stores the offset to where it
+	// ends up in the next coarser level (odd vertices collapse onto their even neighbours)
+	// so that the vertex shader can morph between the levels without seams.
+	Geometry* buildNodeMesh(const HeightData& data, ivec2 pos, int size, int gridSize, float morphRange, bool morph) {
+		Geometry* geometry = new Geometry();
+		geometry->batches.emplace_back();
+		Batch& batch = geometry->batches.back();
+		batch.name = "TerrainNode";
+		int step = size / gridSize;
+		int verts = gridSize + 1;
+		batch.positions.resize(verts * verts);
+		batch.texcoords.resize(verts * verts);
+		batch.normals.resize(verts * verts);
+		batch.morphTargets.resize(verts * verts);
+		for (int j = 0; j < verts; ++j) {
+			for (int i = 0; i < verts; ++i) {
+				int vert = j * verts + i;
+				ivec2 p = pos + ivec2(i, j) * step;
+				vec3 position = data.position(p.x, p.y);
+				batch.positions[vert] = position;
+				batch.texcoords[vert] = vec2((float)p.x / data.width, (float)p.y / data.height);
+				float dx = data.at(p.x + step, p.y) - data.at(p.x - step, p.y);
+				float dz = data.at(p.x, p.y + step) - data.at(p.x, p.y - step);
+				batch.normals[vert] = glm::normalize(vec3(-dx / (2.f * step * data.scale.x), 1.f, -dz / (2.f * step * data.scale.z)));
+				vec3 offset(0, 0, 0);
+				if (morph) {
+					ivec2 target = pos + ivec2(i & ~1, j & ~1) * step;
+					offset = data.position(target.x, target.y) - position;
+				}
+				batch.morphTargets[vert] = vec4(offset, morphRange);
+			}
+		}
+		// Diagonals go from (i, j) to (i+1, j+1) so that collapsing odd vertices gives the coarser grid
+		batch.indices.reserve(gridSize * gridSize * 6);
+		for (int j = 0; j < gridSize; ++j) {
+			for (int i = 0; i < gridSize; ++i) {
+				uint a = j * verts + i;
+				uint b = a + 1;
+				uint c = a + verts;
+				uint d = c + 1;
+				uint triangles[] = { a, c, d, a, d, b };
+				batch.indices.insert(batch.indices.end(), triangles, triangles + 6);
+			}
+		}
+		geometry->calculateBoundingSphere();
+		geometry->calculateBoundingBox();
+		batch.setupAttributes();
+		return geometry;
+	}
+}
+
+struct TerrainSystem::Node
+{
+	ivec2 pos = ivec2(0, 0); // Heightmap coordinates of the corner
+	int size = 0; // In heightmap samples
+	int level = 0; // 0 is the most detailed
+	vec3 min = vec3(0, 0, 0);
+	vec3 max = vec3(0, 0, 0);
+	uint children[4] = {}; // Unused for leaves
+	std::shared_ptr<MeshJob> job;
+	std::unique_ptr<Geometry> geometry;
+	Entity entity;
+	bool hasEntity = false;
+	bool visible = false;
+	bool selected = false;
+};
+
+struct TerrainSystem::Tile
+{
+	ivec2 coord = ivec2(0, 0);
+	std::vector<Node> nodes; // Root first
+	Entity collider;
+	bool hasCollider = false;
+	std::vector<float> colliderHeights; // Bullet doesn't copy the data
+	bool keep = false;
+};
+
+struct TerrainSystem::Instance
+{
+	Entity entity;
+	bool removed = false;
+	Terrain settings;
+	Transform transform;
+	std::shared_ptr<const HeightData> data;
+	std::map<std::pair<int, int>, std::unique_ptr<Tile>> tiles;
+	ivec2 numTiles = ivec2(0, 0);
+	int gridSize = 0; // Quads per node side
+	std::vector<Node*> selected;
+
+	float lodRange(int level) const { return settings.lodDistance * float(1 << level); }
+};
+
+TerrainSystem::TerrainSystem()
+{
+}
+
+TerrainSystem::~TerrainSystem()
+{
+	reset();
+}
+
+void TerrainSystem::reset()
+{
+	m_instances.clear();
+	m_releasedGeometry.clear();
+	m_releasedHeights.clear();
+}
+
+void TerrainSystem::destroy(Entity entity)
+{
+	// Owned entities can't be killed in the middle of entity destruction, defer to update
+	for (auto& instance : m_instances)
+		if (instance->entity == entity && !instance->removed && entity.has<Terrain>())
+			instance->removed = true;
+}
+
+void TerrainSystem::update(Entities& entities, vec3 cameraPosition)
+{
+	START_MEASURE(terrainMs)
+	// Entities released last frame have been destroyed by now
+	m_releasedGeometry.clear();
+	m_releasedHeights.clear();
+	m_jobsThisFrame = 0;
+	stats = Stats();
+
+	entities.for_each<Terrain, Transform>([&](Entity e, Terrain& terrain, Transform& transform) {
+		for (auto& instance : m_instances)
+			if (instance->entity == e && !instance->removed)
+				return;
+		m_instances.emplace_back(new Instance());
+		Instance& instance = *m_instances.back();
+		instance.entity = e;
+		instance.settings = terrain;
+		instance.transform = transform;
+		init(instance);
+	});
+
+	for (uint i = 0; i < m_instances.size(); ) {
+		Instance& instance = *m_instances[i];
+		if (instance.removed) {
+			for (auto& it : instance.tiles)
+				releaseTile(*it.second);
+			m_instances.erase(m_instances.begin() + i);
+			continue;
+		}
+		if (instance.data)
+			updateInstance(entities, instance, cameraPosition);
+		++i;
+	}
+	END_MEASURE(terrainMs)
+	stats.updateMs = terrainMs;
+}
+
+void TerrainSystem::init(Instance& instance)
+{
+	Terrain& terrain = instance.settings;
+	const Image* image = terrain.heightmap;
+	if (!image || image->width < 2 || image->height < 2 || image->data.empty()) {
+		logError("Invalid terrain heightmap");
+		return;
+	}
+	terrain.tileSize = glm::max(terrain.tileSize, 2u);
+	terrain.lodLevels = glm::clamp(terrain.lodLevels, 1u, 16u);
+	// Every level needs an even number of quads per side for morphing
+	for (; terrain.lodLevels > 1; --terrain.lodLevels) {
+		uint gridSize = terrain.tileSize >> (terrain.lodLevels - 1);
+		if (gridSize >= 2 && gridSize % 2 == 0 && (gridSize << (terrain.lodLevels - 1)) == terrain.tileSize)
+			break;
+	}
+	instance.gridSize = terrain.tileSize >> (terrain.lodLevels - 1);
+	terrain.material.flags |= Material::TERRAIN_MORPH;
+
+	HeightData* data = new HeightData();
+	data->width = image->width;
+	data->height = image->height;
+	data->scale = instance.transform.scale;
+	data->heights.resize(data->width * data->height);
+	for (uint i = 0; i < data->heights.size(); ++i)
+		data->heights[i] = image->data[i * image->channels] / 255.0f * data->scale.y;
+	instance.data.reset(data);
+	instance.numTiles = ivec2((data->width - 2) / terrain.tileSize + 1, (data->height - 2) / terrain.tileSize + 1);
+	logDebug("Terrain %dx%d split into %dx%d tiles with %d LOD levels",
+		data->width, data->height, instance.numTiles.x, instance.numTiles.y, terrain.lodLevels);
+}
+
+void TerrainSystem::updateInstance(Entities& entities, Instance& instance, vec3 cameraPosition)
+{
+	const Terrain& terrain = instance.settings;
+	const HeightData& data = *instance.data;
+	vec3 camera = glm::inverse(instance.transform.rotation) * (cameraPosition - instance.transform.position);
+
+	// Stream tiles around the camera
+	for (auto& it : instance.tiles)
+		it.second->keep = false;
+	int tileSize = terrain.tileSize;
+	ivec2 cameraTile(glm::floor((camera.x / data.scale.x + data.width * 0.5f) / tileSize),
+		glm::floor((camera.z / data.scale.z + data.height * 0.5f) / tileSize));
+	int radius = glm::ceil(terrain.streamDistance / (tileSize * glm::max(glm::min(data.scale.x, data.scale.z), 0.001f))) + 1;
+	for (int z = glm::max(cameraTile.y - radius, 0); z <= glm::min(cameraTile.y + radius, instance.numTiles.y - 1); ++z) {
+		for (int x = glm::max(cameraTile.x - radius, 0); x <= glm::min(cameraTile.x + radius, instance.numTiles.x - 1); ++x) {
+			vec3 tileMin = data.position(x * tileSize, z * tileSize);
+			vec3 tileMax = data.position((x + 1) * tileSize, (z + 1) * tileSize);
+			vec2 closest = glm::clamp(vec2(camera.x, camera.z), vec2(tileMin.x, tileMin.z), vec2(tileMax.x, tileMax.z));
+			if (glm::distance2(closest, vec2(camera.x, camera.z)) > terrain.streamDistance * terrain.streamDistance)
+				continue;
+			auto it = instance.tiles.find(std::make_pair(x, z));
+			if (it == instance.tiles.end()) {
+				createTile(instance, ivec2(x, z));
+				it = instance.tiles.find(std::make_pair(x, z));
+			}
+			it->second->keep = true;
+		}
+	}
+	for (auto it = instance.tiles.begin(); it != instance.tiles.end(); ) {
+		if (!it->second->keep) {
+			releaseTile(*it->second);
+			it = instance.tiles.erase(it);
+		} else ++it;
+	}
+
+	// LOD selection
+	instance.selected.clear();
+	for (auto& it : instance.tiles) {
+		Tile& tile = *it.second;
+		for (Node& node : tile.nodes) {
+			if (node.job && node.job->done) {
+				node.geometry = std::move(node.job->geometry);
+				node.job.reset();
+			}
+		}
+		selectNode(instance, tile, 0, camera, instance.selected);
+		for (Node& node : tile.nodes)
+			if (node.job)
+				stats.pendingMeshes++;
+
+		bool needsCollider = intersectsSphere(tile.nodes[0].min, tile.nodes[0].max, camera, terrain.colliderDistance);
+		if (needsCollider && !tile.hasCollider) {
+			createCollider(entities, instance, tile);
+		} else if (!needsCollider && tile.hasCollider) {
+			tile.collider.kill();
+			tile.hasCollider = false;
+			m_releasedHeights.push_back(std::move(tile.colliderHeights));
+		}
+		stats.colliders += tile.hasCollider ? 1 : 0;
+	}
+	stats.tiles += instance.tiles.size();
+	stats.nodes += instance.selected.size();
+
+	// Hidden nodes keep their entity to avoid re-uploading, the renderer skips them due to LOD distance
+	for (Node* node : instance.selected)
+		node->selected = true;
+	for (auto& it : instance.tiles) {
+		for (Node& node : it.second->nodes) {
+			if (node.selected && !node.hasEntity) {
+				Entity e = entities.create();
+				Transform& transform = e.add<Transform>();
+				transform.position = instance.transform.position;
+				transform.rotation = instance.transform.rotation;
+				Model& model = e.add<Model>();
+				model.lods[0].geometry = node.geometry.get();
+				model.geometry = model.lods[0].geometry;
+				model.bounds = node.geometry->bounds;
+				model.materials.push_back(terrain.material);
+				node.entity = e;
+				node.hasEntity = true;
+			}
+			if (node.selected != node.visible) {
+				node.entity.get<Model>().lods[0].distSq = node.selected ? FLT_MAX : -1.f;
+				node.visible = node.selected;
+			}
+			node.selected = false;
+		}
+	}
+}
+
+void TerrainSystem::createTile(Instance& instance, ivec2 coord)
+{
+	const HeightData& data = *instance.data;
+	Tile* tile = new Tile();
+	tile->coord = coord;
+	auto& nodes = tile->nodes;
+	uint numNodes = 0;
+	for (uint level = 0; level < instance.settings.lodLevels; ++level)
+		numNodes += 1 << (2 * level);
+	nodes.reserve(numNodes);
+
+	// Quadtree is built breadth first, so children always come after their parent
+	nodes.emplace_back();
+	nodes[0].pos = coord * int(instance.settings.tileSize);
+	nodes[0].size = instance.settings.tileSize;
+	nodes[0].level = instance.settings.lodLevels - 1;
+	for (uint i = 0; i < nodes.size(); ++i) {
+		if (nodes[i].level == 0)
+			continue;
+		int half = nodes[i].size / 2;
+		for (int c = 0; c < 4; ++c) {
+			nodes[i].children[c] = nodes.size();
+			nodes.emplace_back();
+			Node& child = nodes.back();
+			child.pos = nodes[i].pos + ivec2(c & 1, c >> 1) * half;
+			child.size = half;
+			child.level = nodes[i].level - 1;
+		}
+	}
+
+	// Bounds from the samples for leaves and from the children for others
+	for (int i = nodes.size() - 1; i >= 0; --i) {
+		Node& node = nodes[i];
+		if (node.level == 0) {
+			float minY = INFINITY, maxY = -INFINITY;
+			for (int z = node.pos.y; z <= node.pos.y + node.size; ++z) {
+				for (int x = node.pos.x; x <= node.pos.x + node.size; ++x) {
+					float h = data.at(x, z);
+					minY = glm::min(minY, h);
+					maxY = glm::max(maxY, h);
+				}
+			}
+			node.min = data.position(node.pos.x, node.pos.y);
+			node.max = data.position(node.pos.x + node.size, node.pos.y + node.size);
+			node.min.y = minY;
+			node.max.y = maxY;
+		} else {
+			node.min = vec3(INFINITY, INFINITY, INFINITY);
+			node.max = vec3(-INFINITY, -INFINITY, -INFINITY);
+			for (uint child : node.children) {
+				node.min = glm::min(node.min, nodes[child].min);
+				node.max = glm::max(node.max, nodes[child].max);
+			}
+		}
+	}
+	instance.tiles[std::make_pair(coord.x, coord.y)].reset(tile);
+}
+
+void TerrainSystem::releaseTile(Tile& tile)
+{
+	for (Node& node : tile.nodes) {
+		if (node.hasEntity) {
+			node.entity.kill();
+			node.hasEntity = false;
+		}
+		if (node.geometry)
+			m_releasedGeometry.push_back(std::move(node.geometry));
+		node.job.reset(); // The worker holds its own reference
+	}
+	if (tile.hasCollider) {
+		tile.collider.kill();
+		tile.hasCollider = false;
+		m_releasedHeights.push_back(std::move(tile.colliderHeights));
+	}
+}
+
+void TerrainSystem::createCollider(Entities& entities, Instance& instance, Tile& tile)
+{
+	const HeightData& data = *instance.data;
+	const Node& root = tile.nodes[0];
+	int samples = root.size + 1;
+	tile.colliderHeights.resize(samples * samples);
+	for (int z = 0; z < samples; ++z)
+		for (int x = 0; x < samples; ++x)
+			tile.colliderHeights[z * samples + x] = data.at(root.pos.x + x, root.pos.y + z);
+
+	// Flipped quad edges to match the render mesh diagonals
+	btHeightfieldTerrainShape* shape = new btHeightfieldTerrainShape(samples, samples,
+		&tile.colliderHeights[0], root.min.y, root.max.y, 1, true);
+	shape->setLocalScaling(btVector3(data.scale.x, 1.f, data.scale.z));
+	// Bullet centers the heightfield on its bounding box
+	vec3 center = (root.min + root.max) * 0.5f;
+	const Transform& terrainTransform = instance.transform;
+	vec3 position = terrainTransform.position + terrainTransform.rotation * center;
+
+	btRigidBody::btRigidBodyConstructionInfo info(0.f, NULL, shape, btVector3(0, 0, 0));
+	info.m_startWorldTransform = btTransform(convert(terrainTransform.rotation), convert(position));
+	Entity e = entities.create();
+	Transform& transform = e.add<Transform>();
+	transform.position = position;
+	transform.rotation = terrainTransform.rotation;
+	RigidBody& rb = e.add<RigidBody>();
+	rb.body = new btRigidBody(info);
+	if (entities.has_system<PhysicsSystem>())
+		entities.get_system<PhysicsSystem>().add(e);
+	tile.collider = e;
+	tile.hasCollider = true;
+}
+
+bool TerrainSystem::selectNode(Instance& instance, Tile& tile, uint index, vec3 camera, std::vector<Node*>& selected)
+{
+	Node& node = tile.nodes[index];
+	// Subdivide when within the range of the next detailed level, falling back to this
+	// level until all children have their meshes ready
+	if (node.level > 0 && intersectsSphere(node.min, node.max, camera, instance.lodRange(node.level - 1))) {
+		uint mark = selected.size();
+		bool ready = true;
+		for (uint child : node.children)
+			ready = selectNode(instance, tile, child, camera, selected) && ready;
+		if (ready)
+			return true;
+		selected.resize(mark);
+	}
+	requestMesh(instance, node);
+	if (!node.geometry)
+		return false;
+	selected.push_back(&node);
+	return true;
+}
+
+void TerrainSystem::requestMesh(Instance& instance, Node& node)
+{
+	if (node.geometry || node.job || m_jobsThisFrame >= (uint)cvar_meshJobsPerFrame())
+		return;
+	++m_jobsThisFrame;
+	std::shared_ptr<MeshJob> job = std::make_shared<MeshJob>();
+	std::shared_ptr<const HeightData> data = instance.data;
+	ivec2 pos = node.pos;
+	int size = node.size;
+	int gridSize = instance.gridSize;
+	float range = instance.lodRange(node.level);
+	bool morph = node.level < (int)instance.settings.lodLevels - 1;
+	node.job = job;
+	Engine::threadpool().enqueue([job, data, pos, size, gridSize, range, morph]() {
+		job->geometry.reset(buildNodeMesh(*data, pos, size, gridSize, range, morph));
+		job->done = true;
+	});
+}
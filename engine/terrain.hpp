@@ -0,0 +1,48 @@
+#pragma once
+#include "common.hpp"
+#include <ecs/ecs.hpp>
+#include <memory>
+
+struct Geometry;
+
+// Chunked CDLOD terrain. The heightmap is split into tiles, each of which is a
+// quadtree of LOD nodes with fixed resolution meshes. Node meshes are built on
+// worker threads and shown as Model entities. Tiles are streamed in and out
+// around the camera and the closest ones get a Bullet heightfield collider.
+class TerrainSystem : public ecs::System
+{
+public:
+	TerrainSystem();
+	~TerrainSystem();
+	void reset();
+
+	void update(ecs::Entities& entities, vec3 cameraPosition);
+	void destroy(ecs::Entity entity) override;
+
+	struct Stats {
+		uint tiles = 0;
+		uint nodes = 0; // Visible
+		uint colliders = 0;
+		uint pendingMeshes = 0;
+		float updateMs = 0.f;
+	} stats;
+
+private:
+	struct Node;
+	struct Tile;
+	struct Instance;
+
+	void init(Instance& instance);
+	void updateInstance(ecs::Entities& entities, Instance& instance, vec3 cameraPosition);
+	void createTile(Instance& instance, ivec2 coord);
+	void releaseTile(Tile& tile);
+	void createCollider(ecs::Entities& entities, Instance& instance, Tile& tile);
+	bool selectNode(Instance& instance, Tile& tile, uint index, vec3 cameraPosition, std::vector<Node*>& selected);
+	void requestMesh(Instance& instance, Node& node);
+
+	std::vector<std::unique_ptr<Instance>> m_instances;
+	// Released resources are kept for a frame until their entities have been destroyed
+	std::vector<std::unique_ptr<Geometry>> m_releasedGeometry;
+	std::vector<std::vector<float>> m_releasedHeights;
+	uint m_jobsThisFrame = 0;
+};
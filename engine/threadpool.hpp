@@ -6,6 +6,8 @@
 #include <condition_variable>
 #include <functional>
 #include <atomic>
+#include <memory>
+#include <algorithm>
 
 
 class thread_pool {
@@ -65,6 +67,39 @@ public:
 		m_condition.notify_one();
 	}
 
+	// Calls func(begin, end) for chunks of [0, count) on the pool threads and the
+	// calling thread, returning once all chunks are done. Only waits for its own
+	// work, so it is safe to use alongside other tasks and from inside them.
+	template<class F>
+	void parallel_for(unsigned count, unsigned chunk_size, F func) {
+		chunk_size = std::max(chunk_size, 1u);
+		if (m_threads.empty() || count <= chunk_size) {
+			func(0u, count);
+			return;
+		}
+		struct state_t {
+			std::atomic_uint next = { 0 };
+			std::atomic_uint done = { 0 };
+		};
+		auto state = std::make_shared<state_t>();
+		unsigned num_chunks = (count + chunk_size - 1) / chunk_size;
+		// Helpers that start after all chunks are claimed only touch the shared state
+		auto work = [state, num_chunks, chunk_size, count, &func] {
+			unsigned chunk;
+			while ((chunk = state->next++) < num_chunks) {
+				unsigned begin = chunk * chunk_size;
+				func(begin, std::min(begin + chunk_size, count));
+				++state->done;
+			}
+		};
+		unsigned helpers = std::min<unsigned>(m_threads.size(), num_chunks - 1);
+		for (unsigned i = 0; i < helpers; ++i)
+			enqueue(work);
+		work();
+		while (state->done < num_chunks)
+			std::this_thread::yield();
+	}
+
 	void sync() const {
 		while (m_count)
 			std::this_thread::yield();
@@ -1,9 +1,34 @@
 #include "triggers.hpp"
 #include "components.hpp"
 #include "module.hpp"
+#include <cmath>
 
 using namespace ecs;
 
+static CVar<float> cvar_cellSize("triggers.cellSize", 16.f);
+
+namespace {
+
+	// Volumes covering more cells than this are not worth hashing
+	const uint MAX_VOLUME_CELLS = 512;
+
+	uint64 cellKey(int x, int y, int z)
+	{
+		return ((uint64)(x & 0x1fffff) << 42) | ((uint64)(y & 0x1fffff) << 21) | (uint64)(z & 0x1fffff);
+	}
+
+	ivec3 cellOf(vec3 pos, float cellSize)
+	{
+		return ivec3(glm::floor(pos / cellSize));
+	}
+
+	template<typename T>
+	bool contains(const std::vector<T>& items, const T& item)
+	{
+		return std::find(items.begin(), items.end(), item) != items.end();
+	}
+}
+
 TriggerSystem::TriggerSystem()
 {
 }
@@ -12,34 +37,198 @@ TriggerSystem::~TriggerSystem()
 {
 }
 
+void TriggerSystem::reset()
+{
+	m_volumes.clear();
+	m_volumeIndex.clear();
+	m_cells.clear();
+	m_oversized.clear();
+	m_inside.clear();
+}
+
+void TriggerSystem::insert(uint index)
+{
+	Volume& vol = m_volumes[index];
+	vec3 lo, hi;
+	if (vol.box) {
+		// World bounds of the rotated box
+		vec3 center = vol.position + vol.rotation * ((vol.boundsMin + vol.boundsMax) * 0.5f);
+		mat3 rot = glm::mat3_cast(vol.rotation);
+		vec3 half = (vol.boundsMax - vol.boundsMin) * 0.5f;
+		vec3 extent = glm::abs(rot[0]) * half.x + glm::abs(rot[1]) * half.y + glm::abs(rot[2]) * half.z;
+		lo = center - extent;
+		hi = center + extent;
+	} else {
+		lo = vol.position - vec3(vol.radius);
+		hi = vol.position + vec3(vol.radius);
+	}
+	vec3 cells = glm::floor(hi / m_cellSize) - glm::floor(lo / m_cellSize) + 1.f;
+	if (!std::isfinite(lo.x + lo.y + lo.z + hi.x + hi.y + hi.z) || cells.x * cells.y * cells.z > MAX_VOLUME_CELLS) {
+		vol.oversized = true;
+		m_oversized.push_back(index);
+		return;
+	}
+	vol.cellMin = cellOf(lo, m_cellSize);
+	vol.cellMax = cellOf(hi, m_cellSize);
+	for (int x = vol.cellMin.x; x <= vol.cellMax.x; ++x)
+		for (int y = vol.cellMin.y; y <= vol.cellMax.y; ++y)
+			for (int z = vol.cellMin.z; z <= vol.cellMax.z; ++z)
+				m_cells[cellKey(x, y, z)].push_back(index);
+}
+
+void TriggerSystem::remove(uint index)
+{
+	Volume& vol = m_volumes[index];
+	if (vol.oversized) {
+		m_oversized.erase(std::find(m_oversized.begin(), m_oversized.end(), index));
+		vol.oversized = false;
+		return;
+	}
+	for (int x = vol.cellMin.x; x <= vol.cellMax.x; ++x) {
+		for (int y = vol.cellMin.y; y <= vol.cellMax.y; ++y) {
+			for (int z = vol.cellMin.z; z <= vol.cellMax.z; ++z) {
+				auto cell = m_cells.find(cellKey(x, y, z));
+				ASSERT(cell != m_cells.end());
+				std::vector<uint>& list = cell->second;
+				list.erase(std::find(list.begin(), list.end(), index));
+				if (list.empty())
+					m_cells.erase(cell);
+			}
+		}
+	}
+	vol.cellMin = ivec3(0);
+	vol.cellMax = ivec3(-1);
+}
+
+// Swaps the last volume into the slot
+void TriggerSystem::erase(uint index)
+{
+	remove(index);
+	m_volumeIndex.erase(m_volumes[index].entity.get_id());
+	uint last = m_volumes.size() - 1;
+	if (index != last) {
+		bool hashed = m_volumes[last].oversized || m_volumes[last].cellMin.x <= m_volumes[last].cellMax.x;
+		remove(last);
+		m_volumes[index] = m_volumes[last];
+		m_volumeIndex[m_volumes[index].entity.get_id()] = index;
+		if (hashed)
+			insert(index);
+	}
+	m_volumes.pop_back();
+}
+
+void TriggerSystem::destroy(Entity entity)
+{
+	auto it = m_volumeIndex.find(entity.get_id());
+	if (it != m_volumeIndex.end())
+		erase(it->second);
+	m_inside.erase(entity.get_id());
+}
+
 void TriggerSystem::update(Entities& entities, float /*dt*/)
 {
+	float cellSize = glm::max(cvar_cellSize(), 0.1f);
+	if (cellSize != m_cellSize) {
+		m_cells.clear();
+		m_oversized.clear();
+		for (Volume& vol : m_volumes) {
+			vol.cellMin = ivec3(0);
+			vol.cellMax = ivec3(-1);
+			vol.oversized = false;
+		}
+		m_cellSize = cellSize;
+	}
+	m_frame++;
 	ModuleSystem& modules = entities.get_system<ModuleSystem>();
-	entities.for_each<TriggerVolume, Transform>([&](Entity, TriggerVolume& trigger, Transform& volTransform) {
-		if (trigger.times <= 0)
+
+	// Rehash the volumes that have been added or changed, exhausted ones leave the grid
+	entities.for_each<TriggerVolume, Transform>([&](Entity e, TriggerVolume& trigger, Transform& transform) {
+		auto it = m_volumeIndex.find(e.get_id());
+		uint index = m_volumes.size();
+		if (it == m_volumeIndex.end()) {
+			m_volumes.emplace_back();
+			m_volumes.back().entity = e;
+			m_volumeIndex[e.get_id()] = index;
+		} else index = it->second;
+		Volume& vol = m_volumes[index];
+		vol.frame = m_frame;
+		bool box = std::isfinite(trigger.bounds.min.x) && std::isfinite(trigger.bounds.max.x);
+		bool changed = vol.box != box || vol.position != transform.position || vol.rotation != transform.rotation
+			|| vol.boundsMin != trigger.bounds.min || vol.boundsMax != trigger.bounds.max || vol.radius != trigger.bounds.radius;
+		bool hashed = vol.oversized || vol.cellMin.x <= vol.cellMax.x;
+		bool active = trigger.times > 0;
+		if (!changed && hashed == active)
 			return;
-		if (trigger.bounds.radius > 0.f) {
-			entities.for_each<TriggerGroup, Transform>([&](Entity, TriggerGroup& group, Transform& transform) {
-				if (!(trigger.groups & group.group) || trigger.times <= 0)
-					return;
-				float rSq = trigger.bounds.radius * trigger.bounds.radius;
-				if (glm::distance2(volTransform.position, transform.position) <= rSq) {
-					if (!group.triggered) {
-						trigger.times--;
-						group.triggered = true;
-						if (trigger.receiverModule && trigger.enterMessage) {
-							modules.call(trigger.receiverModule, trigger.enterMessage, nullptr); // TODO: Some param
-						}
-					}
-				} else {
-					if (group.triggered && trigger.receiverModule && trigger.exitMessage) {
-						group.triggered = false;
-						modules.call(trigger.receiverModule, trigger.exitMessage, nullptr); // TODO: Some param
-					}
-				}
-			});
-		} else {
-			ASSERT(!"Only sphere trigger volume implemented currently.");
+		remove(index);
+		vol.box = box;
+		vol.position = transform.position;
+		vol.rotation = transform.rotation;
+		vol.boundsMin = trigger.bounds.min;
+		vol.boundsMax = trigger.bounds.max;
+		vol.radius = trigger.bounds.radius;
+		if (active)
+			insert(index);
+	});
+	// Volumes that lost their components
+	for (uint i = 0; i < m_volumes.size(); ) {
+		if (m_volumes[i].frame != m_frame)
+			erase(i);
+		else ++i;
+	}
+
+	auto inside = [](const Volume& vol, vec3 pos) {
+		vec3 d = pos - vol.position;
+		if (!vol.box)
+			return glm::length2(d) <= vol.radius * vol.radius;
+		vec3 local = glm::conjugate(vol.rotation) * d;
+		return glm::all(glm::greaterThanEqual(local, vol.boundsMin)) && glm::all(glm::lessThanEqual(local, vol.boundsMax));
+	};
+
+	entities.for_each<TriggerGroup, Transform>([&](Entity e, TriggerGroup& group, Transform& transform) {
+		m_current.clear();
+		auto test = [&](uint index) {
+			const Volume& vol = m_volumes[index];
+			const TriggerVolume& trigger = vol.entity.get<TriggerVolume>();
+			if ((trigger.groups & group.group) && trigger.times > 0 && inside(vol, transform.position))
+				m_current.push_back(vol.entity);
+		};
+		ivec3 cell = cellOf(transform.position, m_cellSize);
+		auto it = m_cells.find(cellKey(cell.x, cell.y, cell.z));
+		if (it != m_cells.end())
+			for (uint index : it->second)
+				test(index);
+		for (uint index : m_oversized)
+			test(index);
+
+		auto last = m_inside.find(e.get_id());
+		if (m_current.empty() && (last == m_inside.end() || last->second.empty()))
+			return;
+		std::vector<Entity>& previous = last != m_inside.end() ? last->second : m_inside[e.get_id()];
+		for (Entity volume : previous) {
+			if (contains(m_current, volume) || !m_volumeIndex.count(volume.get_id()))
+				continue; // Still inside or the volume is gone
+			const TriggerVolume& trigger = volume.get<TriggerVolume>();
+			if (trigger.times > 0 && trigger.receiverModule && trigger.exitMessage)
+				modules.post(trigger.receiverModule, trigger.exitMessage, TriggerEvent{ volume, e });
+		}
+		for (uint i = 0; i < m_current.size(); ) {
+			Entity volume = m_current[i];
+			if (contains(previous, volume)) {
+				++i;
+				continue;
+			}
+			TriggerVolume& trigger = volume.get<TriggerVolume>();
+			if (trigger.times == 0) { // Used up by another member this frame
+				m_current[i] = m_current.back();
+				m_current.pop_back();
+				continue;
+			}
+			trigger.times--;
+			if (trigger.receiverModule && trigger.enterMessage)
+				modules.post(trigger.receiverModule, trigger.enterMessage, TriggerEvent{ volume, e });
+			++i;
 		}
+		previous.swap(m_current);
+		group.triggered = !previous.empty();
 	});
 }
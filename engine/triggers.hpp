@@ -1,12 +1,54 @@
 #pragma once
 #include "common.hpp"
 #include <ecs/ecs.hpp>
+#include <unordered_map>
+
+// Event of the enter and exit messages of trigger volumes, delivered in ModuleEvents
+struct TriggerEvent
+{
+	ecs::Entity volume;
+	ecs::Entity entity; // Member of a trigger group
+};
 
 class TriggerSystem : public ecs::System
 {
 public:
 	TriggerSystem();
 	~TriggerSystem();
+	void reset();
 
+	// Volumes are kept in a spatial hash of their world bounds, which is updated for
+	// those whose transform or bounds have changed. Group members only test the volumes
+	// in their own cell. Enter and exit messages are posted to the receiver modules,
+	// which get them on the next ModuleSystem::dispatch().
 	void update(ecs::Entities& entities, float dt);
+	void destroy(ecs::Entity entity) override;
+
+private:
+	struct Volume {
+		ecs::Entity entity;
+		vec3 position = vec3(0.f);
+		quat rotation = quat_identity;
+		vec3 boundsMin = vec3(0.f);
+		vec3 boundsMax = vec3(0.f);
+		float radius = 0.f;
+		ivec3 cellMin = ivec3(0);
+		ivec3 cellMax = ivec3(-1); // Empty range while not in the grid
+		bool box = false; // Sphere otherwise
+		bool oversized = false; // Covers too many cells, tested against every member
+		uint frame = 0; // Last update that saw the volume
+	};
+
+	void insert(uint index);
+	void remove(uint index);
+	void erase(uint index);
+
+	std::vector<Volume> m_volumes;
+	std::unordered_map<ecs::Entity::Id, uint> m_volumeIndex; // To m_volumes
+	std::unordered_map<uint64, std::vector<uint>> m_cells; // Cell key to m_volumes
+	std::vector<uint> m_oversized;
+	std::unordered_map<ecs::Entity::Id, std::vector<ecs::Entity>> m_inside; // Volumes each member is in
+	std::vector<ecs::Entity> m_current;
+	float m_cellSize = 0.f;
+	uint m_frame = 0;
 };
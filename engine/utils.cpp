@@ -18,6 +18,10 @@
 #else
 #include <unistd.h>
 #endif
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -62,6 +66,65 @@ bool writeFile(const std::string& path, const std::string& contents, bool binary
 	return f.good();
 }
 
+bool MappedFile::open(const std::string& path)
+{
+	close();
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file); // Mapping keeps its own reference
+	if (!mapping)
+		return false;
+	void* ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!ptr) {
+		CloseHandle(mapping);
+		return false;
+	}
+	m_handle = mapping;
+	m_data = (const char*)ptr;
+	m_size = size.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	void* ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); // Mapping stays valid
+	if (ptr == MAP_FAILED)
+		return false;
+	madvise(ptr, st.st_size, MADV_WILLNEED);
+	m_data = (const char*)ptr;
+	m_size = st.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!m_data)
+		return;
+#if defined(_WIN32)
+	UnmapViewOfFile(m_data);
+	CloseHandle((HANDLE)m_handle);
+#else
+	munmap((void*)m_data, m_size);
+#endif
+	m_data = nullptr;
+	m_size = 0;
+	m_handle = nullptr;
+}
+
 bool fileExists(const std::string& path)
 {
 	std::error_code ec;
@@ -40,6 +40,27 @@ namespace utils {
 	std::string joinPaths(const std::string& a, const std::string& b);
 	inline std::string joinPaths(const std::string& a, const std::string& b, const std::string& c) { return joinPaths(joinPaths(a, b), c); }
 
+	// Read-only memory mapped file, unmapped on destruction
+	class MappedFile {
+	public:
+		MappedFile() {}
+		MappedFile(const std::string& path) { open(path); }
+		~MappedFile() { close(); }
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		bool open(const std::string& path);
+		void close();
+		const char* data() const { return m_data; }
+		size_t size() const { return m_size; }
+		bool valid() const { return m_data != nullptr; }
+
+	private:
+		const char* m_data = nullptr;
+		size_t m_size = 0;
+		void* m_handle = nullptr; // Windows mapping object
+	};
+
 	int execute(const std::string& cmd);
 	int openUrl(const std::string& url); // Can be file
 
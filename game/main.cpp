@@ -11,6 +11,7 @@
 #include "audio.hpp"
 #include "module.hpp"
 #include "triggers.hpp"
+#include "terrain.hpp"
 #include "gui.hpp"
 #include "image.hpp"
 #include "glrenderer/renderdevice.hpp"
@@ -43,6 +44,7 @@ void init(Game& game)
 	game.entities.add_system<RenderSystem>(game.resources);
 	game.entities.add_system<AnimationSystem>();
 	game.entities.add_system<PhysicsSystem>();
+	game.entities.add_system<TerrainSystem>();
 	game.entities.add_system<AudioSystem>();
 	game.entities.add_system<ModuleSystem>();
 	ModuleSystem& modules = game.entities.get_system<ModuleSystem>();
@@ -117,6 +119,7 @@ int main(int argc, char* argv[])
 		AudioSystem& audio = game.entities.get_system<AudioSystem>();
 		AnimationSystem& animation = game.entities.get_system<AnimationSystem>();
 		TriggerSystem& triggers = game.entities.get_system<TriggerSystem>();
+		TerrainSystem& terrain = game.entities.get_system<TerrainSystem>();
 		ModuleSystem& modules = game.entities.get_system<ModuleSystem>();
 		ImGuiSystem& imgui = game.entities.get_system<ImGuiSystem>();
 		Entity cameraEnt = game.entities.get_entity_by_tag("camera");
@@ -124,6 +127,16 @@ int main(int argc, char* argv[])
 		Camera& camera = cameraEnt.get<Camera>();
 		Transform& cameraTrans = cameraEnt.get<Transform>();
 
+		// Changed files being watched
+		Engine::fileWatcher().update();
+
+		// Results of a threaded physics step, bodies are safe to use until the next step
+		BEGIN_CPU_SAMPLE(physSync)
+		physics.sync(game.entities);
+		END_CPU_SAMPLE()
+		if (!physics.contacts().empty())
+			modules.post(0, $id(CONTACT), physics.contacts().data(), physics.contacts().size());
+
 		while (SDL_PollEvent(&e)) {
 			if (e.type == SDL_QUIT) {
 				running = false;
@@ -213,6 +226,11 @@ int main(int argc, char* argv[])
 		triggers.update(game.entities, game.engine.dt);
 		END_CPU_SAMPLE()
 
+		// Contact and trigger events queued for modules this frame
+		BEGIN_CPU_SAMPLE(moduleEventTime)
+		modules.dispatch();
+		END_CPU_SAMPLE()
+
 		// Animation
 		BEGIN_CPU_SAMPLE(animTime)
 		animation.update(game.entities, game.engine.dt);
@@ -234,6 +252,11 @@ int main(int argc, char* argv[])
 		if (controller.enabled)
 			cameraTrans.rotation = controller.rotation;
 
+		// Terrain
+		BEGIN_CPU_SAMPLE(terrainTime)
+		terrain.update(game.entities, cameraTrans.position);
+		END_CPU_SAMPLE()
+
 		// Audio
 		BEGIN_CPU_SAMPLE(audioTime)
 		audio.update(game.entities, cameraTrans);
@@ -288,6 +311,7 @@ int main(int argc, char* argv[])
 			modules.call($id(DEINIT), &game);
 			renderer.reset(game.entities);
 			physics.reset();
+			triggers.reset();
 			game.scene.reset();
 			resources.reset();
 			init(game);
@@ -303,6 +327,7 @@ int main(int argc, char* argv[])
 	game.entities.remove_system<TriggerSystem>();
 	game.entities.remove_system<ModuleSystem>();
 	game.entities.remove_system<AudioSystem>();
+	game.entities.remove_system<TerrainSystem>();
 	game.entities.remove_system<PhysicsSystem>();
 	game.entities.remove_system<AnimationSystem>();
 	game.entities.remove_system<RenderSystem>();
@@ -71,6 +71,7 @@ static void spawnAsteroid() {
 	model.lods[0].geometry = model.geometry = s_game->resources.getGeometry("debug/plane.obj");
 	model.bounds.min = model.lods[0].geometry->bounds.min * trans.scale;
 	model.bounds.max = model.lods[0].geometry->bounds.max * trans.scale;
+	model.bounds.center = model.lods[0].geometry->bounds.center * trans.scale;
 	model.bounds.radius = model.lods[0].geometry->bounds.radius * glm::compMax(trans.scale);
 	Material material;
 	material.alphaTest = 0.9f;
@@ -95,6 +96,7 @@ static void spawnLaser(vec2 pos, float angle, float speed) {
 	model.lods[0].geometry = model.geometry = s_game->resources.getGeometry("debug/plane.obj");
 	model.bounds.min = model.lods[0].geometry->bounds.min * trans.scale;
 	model.bounds.max = model.lods[0].geometry->bounds.max * trans.scale;
+	model.bounds.center = model.lods[0].geometry->bounds.center * trans.scale;
 	model.bounds.radius = model.lods[0].geometry->bounds.radius * glm::compMax(trans.scale);
 	Material material;
 	material.alphaTest = 0.9f;
@@ -238,6 +240,14 @@ static void simulate(float dt) {
 MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			subs.add($id(INPUT));
+			subs.add($id(UPDATE));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
@@ -7,6 +7,8 @@
 #include "glrenderer/renderdevice.hpp"
 #include "physics.hpp"
 #include "audio.hpp"
+#include "animation.hpp"
+#include "terrain.hpp"
 #include "gui.hpp"
 #include "module.hpp"
 #include "utils.hpp"
@@ -14,16 +16,11 @@
 #include "../controller.hpp"
 #include "../imgui-utils.hpp"
 
-using utils::timestamp;
-using utils::sleep;
-
 static bool s_autoReloadModules = true;
 static bool s_autoReloadShaders = true;
 static bool s_autoReloadScene = true;
 static bool s_preserveCamOnReload = true;
-static std::vector<string> s_shaderFiles;
-static std::vector<uint> s_shaderTimestamps;
-static uint s_sceneTimestamp = 0;
+static bool s_shadersChanged = false;
 
 
 #define Tooltip(...) if (ImGui::IsItemHovered()) ImGui::SetTooltip(__VA_ARGS__);
@@ -38,24 +35,36 @@ static void reloadShaders(Game& game)
 		for (auto& material : model.materials)
 			material.shaderId[TECH_COLOR] = -1;
 	});
-	for (uint i = 0; i < s_shaderFiles.size(); ++i)
-		s_shaderTimestamps[i] = timestamp(s_shaderFiles[i]);
+	s_shadersChanged = false;
 }
 
 MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	Game& game = *static_cast<Game*>(param);
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
 			game.moduleInit();
-			s_sceneTimestamp = timestamp(game.resources.findPath(game.scenePath));
-			s_shaderFiles = game.resources.listFiles("shaders/");
-			s_shaderTimestamps.resize(s_shaderFiles.size());
-			for (uint i = 0; i < s_shaderFiles.size(); ++i) {
-				s_shaderFiles[i] = game.resources.findPath("shaders/" + s_shaderFiles[i]);
-				s_shaderTimestamps[i] = timestamp(s_shaderFiles[i]);
+			// Callbacks into the previous code must not survive a reload
+			Engine::fileWatcher().unwatch($id(devtools));
+			game.resources.watch(game.scenePath, [&game](const string&) {
+				if (!s_autoReloadScene || game.reload)
+					return;
+				logDebug("Scene change detected, reloading...");
+				game.restoreCam = s_preserveCamOnReload;
+				game.reload = true;
+			}, $id(devtools), 500);
+			for (const string& file : game.resources.listFiles("shaders/")) {
+				game.resources.watch("shaders/" + file, [](const string&) {
+					s_shadersChanged = true; // Many may change at once
+				}, $id(devtools), 100);
 			}
 			break;
 		}
@@ -106,6 +115,25 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 						audio.soloud->getMaxActiveVoiceCount(),
 						audio.soloud->getVoiceCount());
 					ImGui::Separator();
+					if (ImGui::TreeNode("Terrain stats")) {
+						const TerrainSystem::Stats& ts = game.entities.get_system<TerrainSystem>().stats;
+						ImGui::Text("Update:        %.3fms", ts.updateMs);
+						ImGui::Text("Tiles:         %5u", ts.tiles);
+						ImGui::Text("Nodes:         %5u  (visible)", ts.nodes);
+						ImGui::Text("Colliders:     %5u", ts.colliders);
+						ImGui::Text("Pending:       %5u  (mesh jobs)", ts.pendingMeshes);
+						ImGui::TreePop();
+					}
+					if (ImGui::TreeNode("Animation stats")) {
+						const AnimationSystem::Stats& as = game.entities.get_system<AnimationSystem>().stats;
+						ImGui::Text("Skeletons:     %.3fms", as.skeletonMs);
+						ImGui::Text("Evaluated:     %5u", as.skeletons);
+						ImGui::Text("Throttled:     %5u  (small on screen)", as.throttled);
+						ImGui::Text("Off-screen:    %5u", as.offscreen);
+						ImGui::Text("Properties:    %.3fms", as.propertyMs);
+						ImGui::Text("Tracks:        %5u", as.propertyTracks);
+						ImGui::TreePop();
+					}
 					if (ImGui::TreeNode("Resource stats")) {
 						const Resources::Stats& res = game.resources.updateStats();
 						ImGui::Text("Images:        %5u  (textures, heightmaps...)", res.images);
@@ -121,8 +149,11 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 					ImGui::Text("Position: %.1f %.1f %.1f", cameraTrans.position.x, cameraTrans.position.y, cameraTrans.position.z);
 					if (ImGui::Checkbox("Fly", &controller.fly)) {
 						if (cameraEnt.has<RigidBody>()) {
-							btRigidBody& body = *cameraEnt.get<RigidBody>().body;
-							body.setGravity(controller.fly ? btVector3(0, 0, 0) : physics.dynamicsWorld->getGravity());
+							btRigidBody* body = cameraEnt.get<RigidBody>().body;
+							bool fly = controller.fly;
+							physics.enqueue([body, fly](PhysicsSystem& physics) {
+								body->setGravity(fly ? btVector3(0, 0, 0) : physics.dynamicsWorld->getGravity());
+							});
 						}
 					}
 					ImGui::SameLine();
@@ -283,23 +314,9 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 			if (s_autoReloadModules)
 				game.entities.get_system<ModuleSystem>().autoReload(&game);
 			// Shader hotload
-			for (uint i = 0; s_autoReloadShaders && i < s_shaderFiles.size(); ++i) {
-				if (timestamp(s_shaderFiles[i]) > s_shaderTimestamps[i]) {
-					logDebug("Shader change detected, reloading...");
-					sleep(100);
-					reloadShaders(game);
-					break;
-				}
-			}
-			if (s_autoReloadScene) {
-				uint ts = timestamp(game.resources.findPath(game.scenePath));
-				if (ts > s_sceneTimestamp) {
-					logDebug("Scene change detected, reloading...");
-					sleep(500);
-					s_sceneTimestamp = ts;
-					game.restoreCam = s_preserveCamOnReload;
-					game.reload = true;
-				}
+			if (s_autoReloadShaders && s_shadersChanged) {
+				logDebug("Shader change detected, reloading...");
+				reloadShaders(game);
 			}
 		}
 	}
@@ -11,6 +11,13 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	Game& game = *static_cast<Game*>(param);
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			subs.add($id(UPDATE));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
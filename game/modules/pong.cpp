@@ -76,6 +76,14 @@ static void steer(const string& paddleName, int dir) {
 MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			subs.add($id(INPUT));
+			subs.add($id(UPDATE));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
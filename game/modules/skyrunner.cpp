@@ -111,6 +111,14 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	Game& game = *static_cast<Game*>(param);
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			subs.add($id(INPUT));
+			subs.add($id(UPDATE));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
@@ -222,6 +230,7 @@ static void generateLevel1(Game& game, vec3 pos)
 	Entity e = loader.instantiate(loader.prefabs["goalblock"], game.resources);
 	e.get<Transform>().setPosition(pos);
 	goalPos = pos + up_axis;
+	loader.batchStatic(game.resources);
 	game.resources.startAsyncLoading();
 }
 
@@ -256,6 +265,7 @@ static void generateLevel2(Game& game, vec3 pos)
 	Entity e = loader.instantiate(loader.prefabs["goalblock"], game.resources);
 	e.get<Transform>().setPosition(pos);
 	goalPos = pos + up_axis;
+	loader.batchStatic(game.resources);
 	game.resources.startAsyncLoading();
 }
 
@@ -290,5 +300,6 @@ static void generateLevel3(Game& game, vec3 pos)
 	Entity e = loader.instantiate(loader.prefabs["goalblock"], game.resources);
 	e.get<Transform>().setPosition(pos);
 	goalPos = pos + up_axis;
+	loader.batchStatic(game.resources);
 	game.resources.startAsyncLoading();
 }
@@ -4,12 +4,20 @@
 #include "components.hpp"
 #include "material.hpp"
 #include "engine.hpp"
+#include "triggers.hpp"
 #include "../game.hpp"
 
 MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 {
 	Game& game = *static_cast<Game*>(param);
 	switch (msg) {
+		case $id(SUBSCRIBE):
+		{
+			ModuleSubscriptions& subs = *static_cast<ModuleSubscriptions*>(param);
+			subs.add($id(INIT));
+			subs.add($id(UPDATE));
+			break;
+		}
 		case $id(INIT):
 		case $id(RELOAD):
 		{
@@ -64,12 +72,16 @@ MODULE_EXPORT void MODULE_FUNC_NAME(uint msg, void* param)
 		}
 		case $id(TRIGGER_ENTER):
 		{
-			logDebug("ENTER TRIGGER VOLUME");
+			const ModuleEvents& events = *static_cast<ModuleEvents*>(param);
+			for (uint i = 0; i < events.count; ++i)
+				logDebug("ENTER TRIGGER VOLUME %u", events.get<TriggerEvent>(i).volume.get_id());
 			break;
 		}
 		case $id(TRIGGER_EXIT):
 		{
-			logDebug("EXIT TRIGGER VOLUME");
+			const ModuleEvents& events = *static_cast<ModuleEvents*>(param);
+			for (uint i = 0; i < events.count; ++i)
+				logDebug("EXIT TRIGGER VOLUME %u", events.get<TriggerEvent>(i).volume.get_id());
 			break;
 		}
 	}
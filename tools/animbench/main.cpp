@@ -0,0 +1,128 @@
+// Headless skeletal animation benchmark: a crowd of characters sharing a
+// synthetic skeleton is evaluated with AnimationSystem on the engine thread pool.
+
+#include "common.hpp"
+#include "engine.hpp"
+#include "geometry.hpp"
+#include "animation.hpp"
+#include "components.hpp"
+#include "args.hpp"
+#include <ecs/ecs.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/constants.hpp>
+#include <chrono>
+#include <cstdio>
+
+static void usage(const char* app)
+{
+	printf("Usage: %s [options]\n", app);
+	printf("  -c, --characters=N  animated characters (default: 1000)\n");
+	printf("  -b, --bones=N       bones per skeleton (default: 64)\n");
+	printf("  -t, --threads=N     worker threads in addition to the main thread (default: cores - 1)\n");
+	printf("  -u, --updates=N     measured updates (default: 300)\n");
+	printf("  -d, --dense         play uncompressed clips\n");
+	printf("  -s, --significance  vary screen size and visibility like a crowd seen from within\n");
+}
+
+static mat3x4 toBone(const mat4& m)
+{
+	mat4 t = glm::transpose(m);
+	return mat3x4(t[0], t[1], t[2]);
+}
+
+// Binary tree skeleton with a looping 2 second clip of swaying bones
+static void createSkeleton(Geometry& geom, uint numBones, uint numFrames)
+{
+	std::vector<mat4> bind(numBones), inverseBind(numBones);
+	geom.bones.resize(numBones);
+	geom.boneParents.resize(numBones);
+	for (uint i = 0; i < numBones; ++i) {
+		int parent = i ? (i - 1) / 2 : -1;
+		mat4 local = glm::translate(mat4(1.f), vec3(i % 2 ? 0.1f : -0.1f, 0.2f, 0.f));
+		bind[i] = parent >= 0 ? bind[parent] * local : local;
+		inverseBind[i] = glm::inverse(bind[i]);
+		geom.bones[i] = toBone(bind[i]);
+		geom.boneParents[i] = parent;
+	}
+	geom.animFrames.resize(numFrames * numBones);
+	for (uint f = 0; f < numFrames; ++f) {
+		for (uint i = 0; i < numBones; ++i) {
+			int parent = geom.boneParents[i];
+			float angle = 0.5f * glm::sin(glm::two_pi<float>() * f / numFrames + i);
+			mat4 local = glm::translate(mat4(1.f), vec3(i % 2 ? 0.1f : -0.1f, 0.2f, 0.f));
+			local = glm::rotate(local, angle, glm::normalize(vec3(1.f, 0.5f, i % 3)));
+			mat4 frame = parent >= 0 ? bind[parent] * local : local;
+			geom.animFrames[f * numBones + i] = toBone(frame * inverseBind[i]);
+		}
+	}
+	Geometry::Animation anim;
+	anim.length = numFrames;
+	anim.frameRate = numFrames / 2.f;
+	anim.name = "sway";
+	geom.animations.push_back(std::move(anim));
+}
+
+int main(int argc, char* argv[])
+{
+	Args args(argc, argv);
+	if (args.opt('h', "help")) {
+		usage(argv[0]);
+		return 0;
+	}
+	uint numCharacters = args.arg<uint>('c', "characters", 1000);
+	uint numBones = args.arg<uint>('b', "bones", 64);
+	uint numThreads = args.arg<uint>('t', "threads", std::max(std::thread::hardware_concurrency(), 1u) - 1);
+	uint numUpdates = std::max(args.arg<uint>('u', "updates", 300), 1u);
+	bool significance = args.opt('s', "significance");
+
+	if (args.opt('d', "dense"))
+		*CVar<float>::getCVar("anim.compressionError") = -1.f;
+
+	Engine engine;
+	engine.threads = numThreads;
+	Engine::threadpool().resize(numThreads);
+
+	Geometry geom;
+	createSkeleton(geom, numBones, 60);
+
+	ecs::ECS::worlds = new ecs::Entities(0);
+	ecs::Entities& entities = ecs::ECS::get(0);
+	entities.add_system<AnimationSystem>();
+	AnimationSystem& animation = entities.get_system<AnimationSystem>();
+	for (uint i = 0; i < numCharacters; ++i) {
+		ecs::Entity e = entities.create();
+		Model& model = e.add<Model>();
+		model.lods[0].geometry = &geom;
+		BoneAnimation& anim = e.add<BoneAnimation>();
+		anim.speed = 0.5f + (i % 16) / 16.f; // Desynchronize characters
+		if (significance) {
+			// Every third one behind the camera, the rest at increasing distances
+			anim.visible = i % 3 != 0;
+			anim.screenSize = 1.f / (1 + i % 50);
+		}
+		animation.play(e);
+	}
+
+	const float dt = 1.f / 60.f;
+	animation.update(entities, dt); // Builds pose data
+	double total = 0.0, best = 1e9, worst = 0.0;
+	for (uint i = 0; i < numUpdates; ++i) {
+		auto start = std::chrono::high_resolution_clock::now();
+		animation.update(entities, dt);
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		total += ms;
+		best = std::min(best, ms);
+		worst = std::max(worst, ms);
+	}
+	const kernels::CompressedAnimation& clip = geom.animations[0].compressed;
+	printf("%u characters, %u bones, %u threads + main thread, %u updates\n", numCharacters, numBones, numThreads, numUpdates);
+	if (clip.numFrames)
+		printf("Clip: %u bytes compressed, %u bytes dense\n", (uint)clip.memoryUsage(), (uint)(clip.numFrames * numBones * sizeof(mat3x4)));
+	printf("Update: avg %.3fms, min %.3fms, max %.3fms (%.2fus per character)\n",
+		total / numUpdates, best, worst, total / numUpdates / numCharacters * 1000.0);
+	printf("Last update: %u evaluated, %u throttled, %u off-screen\n",
+		animation.stats.skeletons, animation.stats.throttled, animation.stats.offscreen);
+	entities.remove_system<AnimationSystem>();
+	delete ecs::ECS::worlds;
+	return 0;
+}
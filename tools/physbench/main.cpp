@@ -0,0 +1,302 @@
+// Headless physics benchmark: loads the bodies of a scene without a window and steps
+// them at a fixed rate, reporting step times and Bullet statistics. Running the scene
+// more than once checks that the simulation is deterministic by hashing body states.
+
+#include "common.hpp"
+#include "engine.hpp"
+#include "physics.hpp"
+#include "animation.hpp"
+#include "resources.hpp"
+#include "scene.hpp"
+#include "components.hpp"
+#include "camera.hpp"
+#include "utils.hpp"
+#include "args.hpp"
+#include <ecs/ecs.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <sstream>
+
+static void usage(const char* app)
+{
+	printf("Usage: %s [options] <scene.json>\n", app);
+	printf("  -d, --data=DIR      data directory the scene is looked up from (default: ../data/)\n");
+	printf("  -f, --frames=N      simulated frames, one step each (default: 600)\n");
+	printf("  -r, --rate=N        steps per second (default: 60)\n");
+	printf("  -n, --runs=N        times to run the scene, later runs are compared to the first (default: 2)\n");
+	printf("  -t, --threads=N     worker threads in addition to the main thread (default: cores - 1)\n");
+	printf("  -p, --parallel      use the multithreaded world\n");
+	printf("  -s, --shake=N       push a random dynamic body every N frames\n");
+	printf("  -q, --queries=N     run N sphere and box overlap queries around the bodies as one batch each frame\n");
+	printf("  -i, --impulses=FILE replay impulses recorded with --record\n");
+	printf("  -w, --record=FILE   save the impulses applied during the first run\n");
+	printf("  -o, --output=FILE   write per step statistics as CSV\n");
+}
+
+// Push given to a body at the start of a frame, the body is its index in the collision object array
+struct Impulse
+{
+	uint frame;
+	uint body;
+	vec3 impulse;
+};
+
+struct StepStats
+{
+	double ms;
+	uint pairs;
+	uint manifolds;
+	uint islands;
+	uint queryHits;
+	uint64 hash;
+};
+
+static bool loadImpulses(const string& path, std::vector<Impulse>& impulses)
+{
+	if (!utils::fileExists(path))
+		return false;
+	std::istringstream file(utils::readFile(path));
+	string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#')
+			continue;
+		Impulse imp;
+		if (sscanf(line.c_str(), "%u %u %f %f %f", &imp.frame, &imp.body, &imp.impulse.x, &imp.impulse.y, &imp.impulse.z) == 5)
+			impulses.push_back(imp);
+	}
+	std::sort(impulses.begin(), impulses.end(), [](const Impulse& a, const Impulse& b) { return a.frame < b.frame; });
+	return true;
+}
+
+static bool saveImpulses(const string& path, const std::vector<Impulse>& impulses)
+{
+	string file = "# frame body x y z\n";
+	char line[128];
+	for (const Impulse& imp : impulses) {
+		snprintf(line, sizeof(line), "%u %u %.9g %.9g %.9g\n", imp.frame, imp.body, imp.impulse.x, imp.impulse.y, imp.impulse.z);
+		file += line;
+	}
+	return utils::writeFile(path, file);
+}
+
+// FNV-1a over the raw bits of every body's pose and velocities
+static uint64 hashBodies(const btDiscreteDynamicsWorld& world)
+{
+	uint64 hash = 14695981039346656037ull;
+	auto add = [&hash](const btVector3& v) {
+		const unsigned char* bytes = reinterpret_cast<const unsigned char*>(v.m_floats);
+		for (uint i = 0; i < 3 * sizeof(btScalar); ++i)
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+	};
+	const btCollisionObjectArray& objects = world.getCollisionObjectArray();
+	for (int i = 0; i < objects.size(); ++i) {
+		const btRigidBody* body = btRigidBody::upcast(objects[i]);
+		if (!body)
+			continue;
+		const btTransform& trans = body->getCenterOfMassTransform();
+		add(trans.getOrigin());
+		for (int row = 0; row < 3; ++row)
+			add(trans.getBasis()[row]);
+		add(body->getLinearVelocity());
+		add(body->getAngularVelocity());
+	}
+	return hash;
+}
+
+// Islands that the solver had to process, i.e. ones with active bodies
+static uint countIslands(const btDiscreteDynamicsWorld& world)
+{
+	std::vector<int> tags;
+	const btCollisionObjectArray& objects = world.getCollisionObjectArray();
+	for (int i = 0; i < objects.size(); ++i) {
+		const btCollisionObject* obj = objects[i];
+		if (obj->isActive() && !obj->isStaticOrKinematicObject() && obj->getIslandTag() >= 0)
+			tags.push_back(obj->getIslandTag());
+	}
+	std::sort(tags.begin(), tags.end());
+	return std::unique(tags.begin(), tags.end()) - tags.begin();
+}
+
+// Returns the number of bodies in the scene
+static uint run(const string& scenePath, Resources& resources, uint numFrames, float dt, uint shakeInterval,
+	uint numQueries, std::vector<Impulse>& impulses, bool recording, std::vector<StepStats>& stats)
+{
+	ecs::ECS::worlds = new ecs::Entities(0);
+	ecs::Entities& entities = ecs::ECS::get(0);
+	entities.add_system<PhysicsSystem>();
+	entities.add_system<AnimationSystem>();
+	PhysicsSystem& physics = entities.get_system<PhysicsSystem>();
+	// Without a window the scene loader cannot set up the default camera
+	ecs::Entity cameraEnt = entities.create();
+	cameraEnt.tag("camera");
+	cameraEnt.add<Camera>();
+
+	SceneLoader scene(entities);
+	scene.load(scenePath, resources);
+	btDiscreteDynamicsWorld& world = *physics.dynamicsWorld;
+	const btCollisionObjectArray& objects = world.getCollisionObjectArray();
+
+	std::vector<uint> dynamicBodies;
+	for (int i = 0; i < objects.size(); ++i)
+		if (!objects[i]->isStaticOrKinematicObject())
+			dynamicBodies.push_back(i);
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> dist(-1.f, 1.f);
+	PhysicsQueryBatch queries;
+
+	stats.resize(numFrames);
+	uint nextImpulse = 0;
+	for (uint frame = 0; frame < numFrames; ++frame) {
+		if (recording && shakeInterval && frame % shakeInterval == 0 && !dynamicBodies.empty()) {
+			uint body = dynamicBodies[rng() % dynamicBodies.size()];
+			vec3 dir(dist(rng), dist(rng) + 1.f, dist(rng));
+			float mass = 1.f / glm::max(btRigidBody::upcast(objects[body])->getInvMass(), 0.001f);
+			impulses.push_back({ frame, body, glm::normalize(dir) * 5.f * mass });
+		}
+		for (; nextImpulse < impulses.size() && impulses[nextImpulse].frame <= frame; ++nextImpulse) {
+			const Impulse& imp = impulses[nextImpulse];
+			btRigidBody* body = imp.body < (uint)objects.size() ? btRigidBody::upcast(objects[imp.body]) : nullptr;
+			if (!body) {
+				logError("Impulse for missing body %u on frame %u", imp.body, imp.frame);
+				continue;
+			}
+			body->activate(true);
+			body->applyCentralImpulse(convert(imp.impulse));
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		physics.step(entities, dt, false); // Exactly one step of dt
+		StepStats& step = stats[frame];
+		step.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		step.pairs = physics.broadphase->getOverlappingPairCache()->getNumOverlappingPairs();
+		step.manifolds = physics.dispatcher->getNumManifolds();
+		step.islands = countIslands(world);
+		step.hash = hashBodies(world);
+
+		// Overlaps touching each body in turn, with some of them offset to miss
+		queries.clear();
+		for (uint i = 0; i < numQueries && objects.size(); ++i) {
+			const btCollisionObject* obj = objects[i % objects.size()];
+			vec3 pos = convert(obj->getWorldTransform().getOrigin()) + vec3(0.f, (i / objects.size()) % 2 ? 100.f : 0.f, 0.f);
+			if (i % 2)
+				queries.addBoxOverlap(pos, vec3(0.25f), quat_identity);
+			else queries.addSphereOverlap(pos, 0.25f);
+		}
+		physics.query(queries);
+		step.queryHits = 0;
+		for (uint i = 0; i < queries.size(); ++i)
+			step.queryHits += queries.hit[i];
+	}
+
+	uint numBodies = objects.size();
+	entities.remove_system<AnimationSystem>();
+	entities.remove_system<PhysicsSystem>();
+	delete ecs::ECS::worlds;
+	ecs::ECS::worlds = nullptr;
+	return numBodies;
+}
+
+int main(int argc, char* argv[])
+{
+	Args args(argc, argv);
+	string scenePath = argc > 1 ? argv[argc-1] : "";
+	if (args.opt('h', "help") || scenePath.empty() || scenePath[0] == '-') {
+		usage(argv[0]);
+		return scenePath.empty() ? 1 : 0;
+	}
+	uint numFrames = std::max(args.arg<uint>('f', "frames", 600), 1u);
+	float rate = std::max(args.arg<float>('r', "rate", 60.f), 1.f);
+	uint numRuns = std::max(args.arg<uint>('n', "runs", 2), 1u);
+	uint numThreads = args.arg<uint>('t', "threads", std::max(std::thread::hardware_concurrency(), 1u) - 1);
+	uint shakeInterval = args.arg<uint>('s', "shake", 0);
+	uint numQueries = args.arg<uint>('q', "queries", 0);
+	string impulsePath = args.arg<string>('i', "impulses", "");
+	string recordPath = args.arg<string>('w', "record", "");
+	string outputPath = args.arg<string>('o', "output", "");
+
+	Engine engine;
+	engine.threads = numThreads;
+	Engine::threadpool().resize(numThreads);
+	*CVar<int>::getCVar("physics.threaded") = 0;
+	*CVar<int>::getCVar("physics.parallel") = args.opt('p', "parallel");
+	*CVar<int>::getCVar("scene.staticBatching") = 0;
+
+	string dataPath = args.arg<string>('d', "data", "../data/");
+	Resources resources;
+	resources.addPath(dataPath);
+	if (!utils::fileExists(dataPath + "/" + scenePath)) {
+		logError("Scene %s not found", scenePath.c_str());
+		return 1;
+	}
+
+	std::vector<Impulse> impulses;
+	if (!impulsePath.empty() && !loadImpulses(impulsePath, impulses)) {
+		logError("Could not read impulses from %s", impulsePath.c_str());
+		return 1;
+	}
+
+	std::vector<StepStats> first, stats;
+	uint numBodies = 0;
+	int divergedRun = -1, divergedFrame = -1;
+	for (uint i = 0; i < numRuns; ++i) {
+		numBodies = run(scenePath, resources, numFrames, 1.f / rate, shakeInterval, numQueries, impulses, i == 0 && impulsePath.empty(), i ? stats : first);
+		if (!i || divergedRun >= 0)
+			continue;
+		for (uint frame = 0; frame < numFrames; ++frame) {
+			if (stats[frame].hash != first[frame].hash || stats[frame].queryHits != first[frame].queryHits) {
+				divergedRun = i;
+				divergedFrame = frame;
+				break;
+			}
+		}
+	}
+
+	if (!recordPath.empty() && !saveImpulses(recordPath, impulses))
+		logError("Could not save impulses to %s", recordPath.c_str());
+
+	if (!outputPath.empty()) {
+		string csv = "frame,ms,pairs,manifolds,islands,queryhits,hash\n";
+		char line[128];
+		for (uint frame = 0; frame < numFrames; ++frame) {
+			const StepStats& s = first[frame];
+			snprintf(line, sizeof(line), "%u,%.4f,%u,%u,%u,%u,%016llx\n", frame, s.ms, s.pairs, s.manifolds, s.islands, s.queryHits, (unsigned long long)s.hash);
+			csv += line;
+		}
+		if (!utils::writeFile(outputPath, csv))
+			logError("Could not save statistics to %s", outputPath.c_str());
+	}
+
+	double total = 0.0, best = 1e9, worst = 0.0;
+	double pairs = 0.0, manifolds = 0.0, islands = 0.0;
+	std::vector<double> times;
+	for (const StepStats& s : first) {
+		total += s.ms;
+		best = std::min(best, s.ms);
+		worst = std::max(worst, s.ms);
+		pairs += s.pairs;
+		manifolds += s.manifolds;
+		islands += s.islands;
+		times.push_back(s.ms);
+	}
+	std::sort(times.begin(), times.end());
+	printf("%s: %u bodies, %u frames at %g Hz, %s world, %u threads + main thread, %u impulses\n",
+		scenePath.c_str(), numBodies, numFrames, rate, args.opt('p', "parallel") ? "parallel" : "single threaded",
+		numThreads, (uint)impulses.size());
+	printf("Step: avg %.3fms, median %.3fms, min %.3fms, max %.3fms\n",
+		total / numFrames, times[numFrames / 2], best, worst);
+	printf("Per step: %.1f broadphase pairs, %.1f manifolds, %.1f active islands\n",
+		pairs / numFrames, manifolds / numFrames, islands / numFrames);
+	if (numQueries)
+		printf("Overlap queries: %u per frame, %u hits on the last frame\n", numQueries, first.back().queryHits);
+	printf("Final state hash: %016llx\n", (unsigned long long)first.back().hash);
+	if (numRuns > 1) {
+		if (divergedRun >= 0) {
+			printf("Run %d diverged from the first one on frame %d\n", divergedRun + 1, divergedFrame);
+			return 2;
+		}
+		printf("Deterministic over %u runs\n", numRuns);
+	}
+	return 0;
+}
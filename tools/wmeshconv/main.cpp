@@ -0,0 +1,54 @@
+// Converts OBJ and IQM meshes to the native .wmesh format,
+// which the engine memory maps and uploads without per-vertex processing.
+
+#include "common.hpp"
+#include "engine.hpp"
+#include "geometry.hpp"
+#include "utils.hpp"
+#include "args.hpp"
+#include <thread>
+#include <cstdio>
+
+static void usage(const char* app)
+{
+	printf("Usage: %s [options] <input.obj|input.iqm>\n", app);
+	printf("  -o, --output=FILE  output path (default: input with .wmesh extension)\n");
+	printf("  -t, --tangents     generate tangents for normal mapping\n");
+	printf("  -j, --threads=N    worker threads in addition to the main thread (default: cores - 1)\n");
+}
+
+int main(int argc, char* argv[])
+{
+	Args args(argc, argv);
+	string input = argc > 1 ? argv[argc-1] : "";
+	if (args.opt('h', "help") || input.empty() || input[0] == '-') {
+		usage(argv[0]);
+		return input.empty() ? 1 : 0;
+	}
+	if (!utils::fileExists(input)) {
+		logError("Input file %s not found", input.c_str());
+		return 1;
+	}
+	string output = args.arg<string>('o', "output", utils::removeExtension(input) + ".wmesh");
+	uint numThreads = args.arg<uint>('j', "threads", std::max(std::thread::hardware_concurrency(), 1u) - 1);
+
+	// The loaders decode animations and tangents on the engine's thread pool
+	Engine engine;
+	engine.threads = numThreads;
+	Engine::threadpool().resize(numThreads);
+
+	Geometry geometry(input);
+	if (geometry.batches.empty()) {
+		logError("No geometry loaded from %s", input.c_str());
+		return 1;
+	}
+	if (args.opt('t', "tangents")) {
+		geometry.calculateTangents();
+		for (auto& batch : geometry.batches)
+			batch.setupAttributes();
+	}
+	if (!geometry.saveWmesh(output))
+		return 1;
+	logInfo("Converted %s to %s", input.c_str(), output.c_str());
+	return 0;
+}